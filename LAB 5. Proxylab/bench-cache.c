@@ -0,0 +1,67 @@
+/*
+ * bench-cache.c - micro-benchmark for the proxy cache hit path
+ *
+ * Fills the cache with N small objects and measures the average time
+ * of a lookup + release for random keys, for growing N.
+ * usage: ./bench-cache [-n lookups]
+ */
+#include <getopt.h>
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+
+#define OBJ_SIZE 64
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = {16, 64, 256, 1024, 4096, 8192};
+    char data[OBJ_SIZE], path[64];
+    ChunkBuf body;
+    CacheMeta meta = {0, 1};
+    long lookups = 1000000, i, hits;
+    int c, s, n;
+    double start, elapsed;
+
+    while((c = getopt(argc, argv, "n:")) != -1){
+        if(c == 'n'){
+            lookups = atol(optarg);
+        }else{
+            fprintf(stderr, "usage: %s [-n lookups]\n", argv[0]);
+            exit(1);
+        }
+    }
+    memset(data, 'x', sizeof(data));
+    meta.expires = time(NULL) + 3600;
+    init_cache();
+    printf("%8s %12s %10s\n", "entries", "ns/hit", "hit ratio");
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+        n = sizes[s];
+        for(i = 0; i < n; i++){
+            sprintf(path, "/static/object-%ld.html", i);
+            cb_init(&body);
+            cb_append(&body, data, OBJ_SIZE);
+            insert_item("origin.example.com", "80", path, &body, &meta);
+        }
+        srand(1);
+        hits = 0;
+        start = now_ns();
+        for(i = 0; i < lookups; i++){
+            CacheItem *item;
+            sprintf(path, "/static/object-%d.html", rand() % n);
+            if((item = cache_check("origin.example.com", "80", path)) != NULL){
+                cache_release(item);
+                hits++;
+            }
+        }
+        elapsed = now_ns() - start;
+        printf("%8d %12.1f %10.3f\n", cache_count(), elapsed / lookups, (double)hits / lookups);
+        clear_cache();
+    }
+    return 0;
+}
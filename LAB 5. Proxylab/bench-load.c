@@ -0,0 +1,400 @@
+/*
+ * bench-load.c - load generator and latency benchmark for the proxy
+ *
+ * Client threads each keep one request outstanding against a running
+ * proxy, for objects picked with Zipf popularity from a fixed set whose
+ * sizes follow a chosen distribution. A share of the requests can be
+ * for responses the origin marks no-store. Every body is checked byte
+ * for byte; reports throughput, latency percentiles and the hit ratio.
+ *
+ * The origin is a static responder built in (the default), which
+ * counts the requests that reach it, or an external one such as tiny
+ * (-o host:port), serving the objects as files the generator writes
+ * under -w dir. Without the built-in origin the hit ratio is unknown.
+ * usage: ./bench-load [-c clients] [-n requests] [-k objects]
+ *                     [-a zipf alpha] [-s sizes] [-u uncacheable %]
+ *                     [-K] [-o host:port -w dir] <proxy port>
+ */
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "csapp.h"
+
+#define PATTERN "abcdefghijklmnopqrstuvwxyz"
+#define PLEN 26
+#define IOCHUNK 65536           /* bytes per read or write of a body */
+
+static int nclients = 16;
+static long nrequests = 20000;
+static int nobjects = 1000;
+static double alpha = 0.8;
+static int uncacheable = 0;     /* percent of requests for no-store objects */
+static int keepalive = 0;
+static char *proxy_host = "localhost", *proxy_port;
+static char origin_host[256], origin_port[16];
+static int builtin = 1;
+static double *cdf;
+
+/* Object sizes: fixed:N, uniform:LO:HI or log:LO:HI (log-uniform) */
+static enum {SZ_FIXED, SZ_UNIFORM, SZ_LOG} size_dist = SZ_LOG;
+static size_t size_lo = 256, size_hi = 65536;
+
+/* one byte pattern, long enough to send any IOCHUNK from any phase */
+static char pattern[IOCHUNK + PLEN];
+
+static long origin_requests;    /* requests the built-in origin served */
+
+typedef struct{
+    unsigned int seed;
+    long n;                     /* requests to send */
+    double *lat;                /* their latencies, ns */
+    long done, errors;
+    long long bytes;
+} Client;
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+// size of an object, fixed by its key so origin and client agree
+static size_t object_size(long key){
+    unsigned int h = (unsigned int)key * 2654435761u;
+    double u = (h >> 8) / (double)(1 << 24);
+    switch(size_dist){
+    case SZ_FIXED: return size_lo;
+    case SZ_UNIFORM: return size_lo + (size_t)(u * (size_hi - size_lo + 1));
+    default: return (size_t)(size_lo * pow((double)size_hi / size_lo, u));
+    }
+}
+// Zipf-distributed object number in [0, nobjects)
+static int zipf_next(unsigned int *seed){
+    double u = rand_r(seed) / ((double)RAND_MAX + 1);
+    int lo = 0, hi = nobjects - 1, mid;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+static int parse_sizes(char *spec){
+    if(sscanf(spec, "fixed:%zu", &size_lo) == 1){
+        size_dist = SZ_FIXED;
+        size_hi = size_lo;
+    }else if(sscanf(spec, "uniform:%zu:%zu", &size_lo, &size_hi) == 2){
+        size_dist = SZ_UNIFORM;
+    }else if(sscanf(spec, "log:%zu:%zu", &size_lo, &size_hi) == 2){
+        size_dist = SZ_LOG;
+    }else{
+        return -1;
+    }
+    return size_lo > 0 && size_lo <= size_hi ? 0 : -1;
+}
+
+/* ---------------- built-in origin ---------------- */
+
+// answer requests for /bench/<key>-<size>[-nc] on one connection
+static void *origin_conn(void *vargp){
+    int fd = *(int *)vargp, nc, closing;
+    char line[MAXLINE], hdr[MAXLINE];
+    struct iovec iov[2];
+    long key;
+    size_t size, off, n;
+    rio_t rio;
+
+    free(vargp);
+    Pthread_detach(pthread_self());
+    rio_readinitb(&rio, fd);
+    while(rio_readlineb(&rio, line, MAXLINE) > 0){
+        if(sscanf(line, "GET /bench/%ld-%zu", &key, &size) != 2){
+            break;
+        }
+        nc = strstr(line, "-nc ") != NULL;
+        closing = strstr(line, "HTTP/1.0") != NULL;
+        while(rio_readlineb(&rio, hdr, MAXLINE) > 0 && strcmp(hdr, "\r\n")){
+            if(!strncasecmp(hdr, "Connection:", 11)){
+                closing = strstr(hdr + 11, "close") != NULL || strstr(hdr + 11, "Close") != NULL;
+            }
+        }
+        __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = sprintf(hdr, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+            "Content-Type: application/octet-stream\r\nCache-Control: %s\r\n%s\r\n",
+            size, nc ? "no-store" : "max-age=3600", closing ? "Connection: close\r\n" : "");
+        // headers and the start of the body in one segment, as a real
+        // server would send them
+        n = size < IOCHUNK ? size : IOCHUNK;
+        iov[1].iov_base = pattern + key % PLEN;
+        iov[1].iov_len = n;
+        if(writev(fd, iov, 2) != iov[0].iov_len + n){
+            break;
+        }
+        for(off = n; off < size; off += n){
+            n = size - off < IOCHUNK ? size - off : IOCHUNK;
+            if(rio_writen(fd, pattern + (key + off) % PLEN, n) < 0){
+                break;
+            }
+        }
+        if(off < size || closing){
+            break;
+        }
+    }
+    Close(fd);
+    return NULL;
+}
+static void *origin_thread(void *vargp){
+    int listenfd = *(int *)vargp, *connfd;
+    pthread_t tid;
+    while(1){
+        connfd = Malloc(sizeof(int));
+        if((*connfd = accept(listenfd, NULL, NULL)) < 0){
+            free(connfd);
+            continue;
+        }
+        Pthread_create(&tid, NULL, origin_conn, connfd);
+    }
+    return NULL;
+}
+// start the built-in origin on a free port
+static void start_origin(){
+    static int listenfd;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t tid;
+
+    listenfd = Open_listenfd("0");
+    if(getsockname(listenfd, (SA *)&addr, &len) < 0){
+        unix_error("getsockname error");
+    }
+    strcpy(origin_host, "localhost");
+    sprintf(origin_port, "%d", ntohs(addr.sin_port));
+    Pthread_create(&tid, NULL, origin_thread, &listenfd);
+}
+// write the object set under dir/bench for an external origin
+static void write_objects(char *dir){
+    char path[MAXLINE];
+    size_t size, off, n;
+    long key;
+    int fd;
+
+    sprintf(path, "%s/bench", dir);
+    if(mkdir(path, 0755) < 0 && errno != EEXIST){
+        unix_error("mkdir error");
+    }
+    for(key = 0; key < nobjects; key++){
+        size = object_size(key);
+        sprintf(path, "%s/bench/%ld-%zu", dir, key, size);
+        fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for(off = 0; off < size; off += n){
+            n = size - off < IOCHUNK ? size - off : IOCHUNK;
+            Rio_writen(fd, pattern + (key + off) % PLEN, n);
+        }
+        Close(fd);
+    }
+}
+
+/* ---------------- clients ---------------- */
+
+// read one response for key; its body length, or -1 if it is not the
+// object. *closing is set when the proxy will close the connection.
+static long read_response(rio_t *rio, long key, size_t size, int *closing){
+    static __thread char buf[IOCHUNK];
+    char line[MAXLINE];
+    long len = -1;
+    size_t got = 0, want;
+    ssize_t n;
+    int status;
+
+    if(rio_readlineb(rio, line, MAXLINE) <= 0 || sscanf(line, "HTTP/1.%*d %d", &status) != 1){
+        return -1;
+    }
+    *closing = !strncmp(line, "HTTP/1.0", 8);
+    while((n = rio_readlineb(rio, line, MAXLINE)) > 0 && strcmp(line, "\r\n")){
+        if(!strncasecmp(line, "Content-Length:", 15)){
+            len = atol(line + 15);
+        }else if(!strncasecmp(line, "Connection:", 11)){
+            *closing = strstr(line + 11, "close") != NULL || strstr(line + 11, "Close") != NULL;
+        }
+    }
+    if(n <= 0 || status != 200){
+        return -1;
+    }
+    if(len < 0){
+        *closing = 1;
+    }
+    // up to Content-Length, or EOF without one
+    while(len < 0 || got < len){
+        want = len < 0 || len - got > IOCHUNK ? IOCHUNK : len - got;
+        if((n = rio_readnb(rio, buf, want)) <= 0){
+            break;
+        }
+        if(got + n > size || memcmp(buf, pattern + (key + got) % PLEN, n)){
+            return -1;
+        }
+        got += n;
+    }
+    return got == size && (len < 0 || got == len) ? got : -1;
+}
+static void *client_thread(void *vargp){
+    Client *cl = vargp;
+    char req[MAXLINE];
+    long i, key, got;
+    size_t size;
+    int fd = -1, closing, nc, n;
+    double start;
+    rio_t rio;
+
+    for(i = 0; i < cl->n; i++){
+        key = zipf_next(&cl->seed);
+        nc = builtin && rand_r(&cl->seed) % 100 < uncacheable;
+        size = object_size(key);
+        n = sprintf(req, "GET http://%s:%s/bench/%ld-%zu%s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n",
+            origin_host, origin_port, key, size, nc ? "-nc" : "",
+            origin_host, origin_port, keepalive ? "" : "Connection: close\r\n");
+
+        start = now_ns();
+        if(fd < 0){
+            if((fd = open_clientfd(proxy_host, proxy_port)) < 0){
+                cl->errors++;
+                continue;
+            }
+            rio_readinitb(&rio, fd);
+        }
+        closing = 1;
+        got = rio_writen(fd, req, n) < 0 ? -1 : read_response(&rio, key, size, &closing);
+        if(got < 0 || closing || !keepalive){
+            Close(fd);
+            fd = -1;
+        }
+        if(got < 0){
+            cl->errors++;
+            continue;
+        }
+        cl->lat[cl->done++] = now_ns() - start;
+        cl->bytes += got;
+    }
+    if(fd >= 0){
+        Close(fd);
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(double *)a, y = *(double *)b;
+    return x < y ? -1 : x > y;
+}
+static double percentile(double *lat, long n, double p){
+    long i = (long)(p * n);
+    return lat[i < n ? i : n - 1] / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    char *dir = NULL, *colon;
+    double sum = 0, start, elapsed, *lat;
+    long long bytes = 0;
+    long done = 0, errors = 0, origin;
+    Client *cls;
+    pthread_t *tids;
+    int c, i;
+
+    while((c = getopt(argc, argv, "c:n:k:a:s:u:Ko:w:")) != -1){
+        switch(c){
+        case 'c': nclients = atoi(optarg); break;
+        case 'n': nrequests = atol(optarg); break;
+        case 'k': nobjects = atoi(optarg); break;
+        case 'a': alpha = atof(optarg); break;
+        case 's': if(parse_sizes(optarg) < 0) nclients = 0; break;
+        case 'u': uncacheable = atoi(optarg); break;
+        case 'K': keepalive = 1; break;
+        case 'o':
+            if((colon = strchr(optarg, ':')) == NULL || colon - optarg >= sizeof(origin_host) || strlen(colon + 1) >= 16){
+                nclients = 0;
+                break;
+            }
+            *colon = '\0';
+            strcpy(origin_host, optarg);
+            strcpy(origin_port, colon + 1);
+            builtin = 0;
+            break;
+        case 'w': dir = optarg; break;
+        default: nclients = 0;
+        }
+    }
+    if(optind != argc - 1 || nclients <= 0 || nrequests <= 0 || nobjects <= 0 || (!builtin && dir == NULL)){
+        fprintf(stderr, "usage: %s [-c clients] [-n requests] [-k objects] [-a zipf alpha]\n"
+            "       [-s fixed:N|uniform:LO:HI|log:LO:HI] [-u uncacheable %%] [-K]\n"
+            "       [-o host:port -w dir] <proxy port>\n", argv[0]);
+        exit(1);
+    }
+    proxy_port = argv[optind];
+    Signal(SIGPIPE, SIG_IGN);
+
+    for(i = 0; i < sizeof(pattern); i++){
+        pattern[i] = PATTERN[i % PLEN];
+    }
+    cdf = Malloc(nobjects * sizeof(double));
+    for(i = 0; i < nobjects; i++){
+        sum += 1 / pow(i + 1, alpha);
+        cdf[i] = sum;
+    }
+    for(i = 0; i < nobjects; i++){
+        cdf[i] /= sum;
+    }
+    if(builtin){
+        start_origin();
+    }else{
+        // an external origin serves files, which are never no-store
+        write_objects(dir);
+        uncacheable = 0;
+    }
+
+    cls = Calloc(nclients, sizeof(Client));
+    tids = Malloc(nclients * sizeof(pthread_t));
+    for(i = 0; i < nclients; i++){
+        cls[i].seed = i + 1;
+        cls[i].n = nrequests / nclients + (i < nrequests % nclients);
+        cls[i].lat = Malloc((cls[i].n + 1) * sizeof(double));
+    }
+    start = now_ns();
+    for(i = 0; i < nclients; i++){
+        Pthread_create(&tids[i], NULL, client_thread, &cls[i]);
+    }
+    for(i = 0; i < nclients; i++){
+        Pthread_join(tids[i], NULL);
+    }
+    elapsed = (now_ns() - start) / 1e9;
+    origin = __atomic_load_n(&origin_requests, __ATOMIC_RELAXED);
+
+    lat = Malloc((nrequests + 1) * sizeof(double));
+    for(i = 0; i < nclients; i++){
+        memcpy(lat + done, cls[i].lat, cls[i].done * sizeof(double));
+        done += cls[i].done;
+        errors += cls[i].errors;
+        bytes += cls[i].bytes;
+        free(cls[i].lat);
+    }
+    qsort(lat, done, sizeof(double), cmp_double);
+
+    printf("%d clients, %ld requests, %d objects, zipf %.2f, %zu-%zu bytes, %d%% uncacheable%s\n",
+        nclients, nrequests, nobjects, alpha, size_lo, size_hi, uncacheable, keepalive ? ", keep-alive" : "");
+    printf("completed %ld, errors %ld, %.2f s\n", done, errors, elapsed);
+    printf("throughput %.0f req/s, %.1f MB/s\n", done / elapsed, bytes / elapsed / (1 << 20));
+    if(done > 0){
+        printf("latency us: p50 %.0f, p99 %.0f, p999 %.0f, max %.0f\n",
+            percentile(lat, done, 0.5), percentile(lat, done, 0.99),
+            percentile(lat, done, 0.999), lat[done - 1] / 1000);
+    }
+    if(!builtin){
+        printf("hit ratio unknown (external origin)\n");
+    }else if(done > 0){
+        printf("hit ratio %.3f (%ld of %ld requests reached the origin)\n",
+            done > origin ? (double)(done - origin) / done : 0.0, origin, done);
+    }
+    free(lat);
+    free(cls);
+    free(tids);
+    free(cdf);
+    return errors > 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * bench-policy.c - hit ratio and byte hit ratio of the cache policies
+ *
+ * Replays a synthetic trace against the cache under every policy: Zipf
+ * popularity over a fixed set of objects whose sizes spread from 256
+ * bytes to 64 KB, optionally interleaved with scans of objects that are
+ * asked for only once. A miss inserts the object, as the proxy would.
+ * usage: ./bench-policy [-n requests] [-k objects] [-a zipf alpha]
+ */
+#include <getopt.h>
+#include <math.h>
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+#define SCAN_EVERY 20000        /* requests between scans */
+#define SCAN_LENGTH 2000        /* one-time objects per scan */
+
+static long nrequests = 500000;
+static int nobjects = 5000;
+static double alpha = 0.8;
+static double *cdf;
+
+// size of an object: log-uniform from 256 bytes to 64 KB
+static size_t object_size(long key){
+    unsigned int h = (unsigned int)key * 2654435761u;
+    return (size_t)(256 * pow(256.0, (h >> 8) / (double)(1 << 24)));
+}
+// Zipf-distributed object number in [0, nobjects)
+static int zipf_next(unsigned int *seed){
+    double u = rand_r(seed) / ((double)RAND_MAX + 1);
+    int lo = 0, hi = nobjects - 1, mid;
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+// replay the trace once; scan != 0 mixes in the one-time objects
+static void replay(int scan){
+    static char data[65536];
+    unsigned int seed = 1;
+    CacheMeta meta = {0, 1};
+    ChunkBuf body;
+    CacheItem *item;
+    char path[64];
+    long i, key, scanned = 0;
+    size_t size;
+
+    meta.expires = time(NULL) + 3600;
+    for(i = 0; i < nrequests; i++){
+        if(scan && i % SCAN_EVERY < SCAN_LENGTH){
+            // a burst of objects no one asks for again
+            key = nobjects + scanned++;
+        }else{
+            key = zipf_next(&seed);
+        }
+        sprintf(path, "/object/%ld", key);
+        if((item = cache_check("origin.example.com", "80", path)) != NULL){
+            cache_release(item);
+            continue;
+        }
+        size = object_size(key);
+        cache_count_miss(size);
+        cb_init(&body);
+        cb_append(&body, data, size);
+        insert_item("origin.example.com", "80", path, &body, &meta);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double sum = 0;
+    int c, i, scan;
+
+    while((c = getopt(argc, argv, "n:k:a:")) != -1){
+        switch(c){
+        case 'n': nrequests = atol(optarg); break;
+        case 'k': nobjects = atoi(optarg); break;
+        case 'a': alpha = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [-k objects] [-a zipf alpha]\n", argv[0]);
+            exit(1);
+        }
+    }
+    cdf = Malloc(nobjects * sizeof(double));
+    for(i = 0; i < nobjects; i++){
+        sum += 1 / pow(i + 1, alpha);
+        cdf[i] = sum;
+    }
+    for(i = 0; i < nobjects; i++){
+        cdf[i] /= sum;
+    }
+
+    init_cache();
+    printf("%d objects, zipf %.2f, %ld requests, cache %d bytes\n", nobjects, alpha, nrequests, MAX_CACHE_SIZE);
+    printf("%-10s %-10s %10s %15s\n", "policy", "trace", "hit ratio", "byte hit ratio");
+    for(scan = 0; scan < 2; scan++){
+        for(i = 0; cache_policies[i] != NULL; i++){
+            clear_cache();
+            cache_set_policy(cache_policies[i]->name);
+            cache_reset_stats();
+            replay(scan);
+            printf("%-10s %-10s %10.3f %15.3f\n", cache_policies[i]->name, scan ? "zipf+scan" : "zipf",
+                (double)cache.stats->hits / cache.stats->lookups,
+                (double)cache.stats->hit_bytes / (cache.stats->hit_bytes + cache.stats->miss_bytes));
+        }
+    }
+    clear_cache();
+    free(cdf);
+    return 0;
+}
@@ -0,0 +1,568 @@
+/*
+ * cache.c - sharded, thread-safe response cache with a hash index
+ *
+ * The key (host, port, path) hashes to a shard and to a bucket inside
+ * that shard. Each shard keeps its items on the policy's queues and on
+ * bucket chains, guarded by a reader/writer lock. Hits take the reader
+ * lock, pin the item with a reference count and tell the policy;
+ * inserts and evictions take the writer lock. An evicted item is freed
+ * when its last reader releases it. Evicted items, and items too large
+ * for memory, can spill into a next tier (see cache_set_spill).
+ *
+ * Items, keys and response chunks are carved from a slab pool sized
+ * after the budget, and the budget is charged their slab sizes.
+ *
+ * Items expire (CacheMeta.expires, from the response's Cache-Control or
+ * Expires). A stale item is still found, so the caller can revalidate
+ * it with the validators it kept instead of fetching it again.
+ *
+ * After cache_share, init_cache maps the shards, the statistics and the
+ * slab pool MAP_SHARED, with process-shared locks, for proxy processes
+ * forked afterwards: a hit in one is a hit in all. Only items made
+ * entirely of pool memory are inserted then; one that got memory from
+ * malloc because the pool ran out is moved into the pool, after enough
+ * items were evicted to give a slab back to it, so no size class keeps
+ * the pool to itself.
+ */
+#include "cache.h"
+#include "hash.h"
+#include "policy.h"
+#include "slab.h"
+
+/* Slabs emptied to move an item into a shared pool, at most */
+#define CACHE_RECLAIM_TRIES 8
+
+static CacheShard local_shards[CACHE_SHARDS];
+static CacheStats local_stats;
+
+Cache cache = {.shards = local_shards, .stats = &local_stats};
+
+static CacheShard *shard_of(unsigned int hash);
+static CacheItem *shard_find(CacheShard *sh, unsigned int h, char *host, char *port, char *content);
+static void delete_item(CacheShard *sh, CacheItem *item);
+static size_t copy_out(CacheItem *item, size_t off, size_t len, char *buf);
+static int in_pool(CacheItem *item);
+static CacheItem *move_to_pool(CacheItem *item, size_t isize);
+static int reclaim_slab();
+static void init_shards();
+
+// initialize cache (with the clock policy and default limits unless set)
+void init_cache(){
+    char *m;
+    if(cache.policy == NULL){
+        cache.policy = cache_policies[0];
+    }
+    if(cache.capacity == 0){
+        cache_set_limits(MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+    }
+    // each process sharing the pool has buffers of its own in flight
+    slab_init(cache.capacity + cache.capacity / CACHE_POOL_EXTRA * (cache.shared ? cache.shared : 1),
+        cache.shared > 0);
+    if(cache.shared){
+        m = Mmap(NULL, sizeof(local_shards) + sizeof(local_stats), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        cache.shards = (CacheShard *)m;
+        cache.stats = (CacheStats *)(m + sizeof(local_shards));
+    }
+    init_shards();
+    cache_reset_stats();
+    return;
+}
+/*
+ * cache_rebuild - start a shared cache over, empty, once every process
+ *     that used it is gone. One that died in the middle of an update may
+ *     have left a shard or the slab pool locked (process-shared locks
+ *     are not robust, and a rwlock cannot be) or half linked, and the
+ *     items it pinned would never be freed.
+ */
+void cache_rebuild(){
+    slab_reset();
+    init_shards();
+    cache_reset_stats();
+}
+// keep the cache in shared memory, for nprocs processes forked after
+// init_cache (call before it)
+void cache_share(int nprocs){
+    cache.shared = nprocs;
+}
+// choose the policy by name (cache must be empty); -1 if unknown
+int cache_set_policy(char *name){
+    CachePolicy *p = policy_find(name);
+    int i;
+    if(p == NULL){
+        return -1;
+    }
+    cache.policy = p;
+    for(i = 0; i < CACHE_SHARDS; i++){
+        pthread_rwlock_wrlock(&cache.shards[i].lock);
+        p->reset(&cache.shards[i]);
+        pthread_rwlock_unlock(&cache.shards[i].lock);
+    }
+    return 0;
+}
+// set the memory budget and the object size limit (before init_cache);
+// an object has to fit a shard; -1 if the limits do not work
+int cache_set_limits(size_t capacity, size_t max_object){
+    if(capacity < CACHE_SHARDS || max_object == 0 || max_object > capacity / CACHE_SHARDS){
+        return -1;
+    }
+    cache.capacity = capacity;
+    cache.shard_size = capacity / CACHE_SHARDS;
+    cache.max_object = max_object;
+    return 0;
+}
+// hand evicted items (and ones too large for memory) smaller than
+// max_object to spill, which must not keep the item; unspill takes an
+// object out of that tier again when it is dropped or replaced here
+void cache_set_spill(void (*spill)(CacheItem *item), void (*unspill)(char *host, char *port, char *content),
+    size_t max_object){
+    cache.spill = spill;
+    cache.unspill = unspill;
+    cache.spill_max = max_object;
+}
+// objects at least this large are kept by no tier
+size_t cache_max_object(){
+    return cache.spill && cache.spill_max > cache.max_object ? cache.spill_max : cache.max_object;
+}
+// check cache hit for the request; a hit stays valid until cache_release
+// and may be stale (see cache_fresh)
+CacheItem *cache_check(char *host, char *port, char *content){
+    unsigned int h = hash_key(host, port, content);
+    CacheShard *sh = shard_of(h);
+    CacheItem *item;
+    pthread_rwlock_rdlock(&sh->lock);
+    if((item = shard_find(sh, h, host, port, content)) != NULL){
+        // Cache hit! pin the item; the policy only counts it
+        __atomic_add_fetch(&item->refcnt, 1, __ATOMIC_RELAXED);
+        cache.policy->hit(sh, item);
+        if(cache_fresh(item)){
+            __atomic_add_fetch(&cache.stats->hits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&cache.stats->hit_bytes, item->size, __ATOMIC_RELAXED);
+        }else{
+            __atomic_add_fetch(&cache.stats->stale, 1, __ATOMIC_RELAXED);
+        }
+    }else if(cache.policy->miss){
+        cache.policy->miss(sh, h);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    __atomic_add_fetch(&cache.stats->lookups, 1, __ATOMIC_RELAXED);
+    return item;
+}
+// same as cache_check, but neither counted nor seen by the policy
+CacheItem *cache_peek(char *host, char *port, char *content){
+    unsigned int h = hash_key(host, port, content);
+    CacheShard *sh = shard_of(h);
+    CacheItem *item;
+    pthread_rwlock_rdlock(&sh->lock);
+    if((item = shard_find(sh, h, host, port, content)) != NULL){
+        __atomic_add_fetch(&item->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return item;
+}
+// drop a reference taken by cache_check
+void cache_release(CacheItem *item){
+    if(__atomic_sub_fetch(&item->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        cb_free(&item->body);
+        slab_free(item);
+    }
+    return;
+}
+// may the item be sent without asking the origin?
+int cache_fresh(CacheItem *item){
+    return time(NULL) < __atomic_load_n(&item->meta.expires, __ATOMIC_RELAXED);
+}
+/*
+ * cache_validators - the conditional request headers that revalidate
+ *     item (If-None-Match, If-Modified-Since), written to buf. Returns
+ *     their length, 0 if the item kept no validators that fit.
+ */
+int cache_validators(CacheItem *item, char *buf, size_t size){
+    CacheMeta *m = &item->meta;
+    size_t n = 0;
+    if(m->etag_len && sizeof("If-None-Match: \r\n") + m->etag_len <= size){
+        n += sprintf(buf, "If-None-Match: ");
+        n += copy_out(item, m->etag, m->etag_len, buf + n);
+        n += sprintf(buf + n, "\r\n");
+    }
+    if(m->modified_len && n + sizeof("If-Modified-Since: \r\n") + m->modified_len <= size){
+        n += sprintf(buf + n, "If-Modified-Since: ");
+        n += copy_out(item, m->modified, m->modified_len, buf + n);
+        n += sprintf(buf + n, "\r\n");
+    }
+    return n;
+}
+// the origin says a stale item is still good (304): fresh until expires
+void cache_revalidated(CacheItem *item, time_t expires){
+    if(!(item->meta.flags & META_NO_CACHE)){
+        __atomic_store_n(&item->meta.expires, expires, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&cache.stats->revalidated, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache.stats->hit_bytes, item->size, __ATOMIC_RELAXED);
+}
+// forget an object the origin no longer lets us keep, in every tier;
+// readers that hold it still finish sending it
+void cache_drop(char *host, char *port, char *content){
+    unsigned int h = hash_key(host, port, content);
+    CacheShard *sh = shard_of(h);
+    CacheItem *item;
+    pthread_rwlock_wrlock(&sh->lock);
+    if((item = shard_find(sh, h, host, port, content)) != NULL){
+        delete_item(sh, item);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    if(cache.unspill){
+        cache.unspill(host, port, content);
+    }
+}
+// insert new item, taking over the chunks of body (left empty);
+// the policy may turn it away, and then the chunks are freed
+void insert_item(char *host, char *port, char *content, ChunkBuf *body, CacheMeta *meta){
+    CacheItem *old, *victim, *spilled = NULL;
+    int admitted = 0;
+    size_t hlen = strlen(host) + 1, plen = strlen(port) + 1, clen = strlen(content) + 1;
+    size_t isize = sizeof(CacheItem) + hlen + plen + clen;
+    CacheItem *item = slab_alloc(isize);
+    size_t size = body->size, charge;
+    // generate new item, the key right behind it
+    item->host = memcpy(item->key, host, hlen);
+    item->port = memcpy(item->key + hlen, port, plen);
+    item->content = memcpy(item->key + hlen + plen, content, clen);
+    item->hash = hash_key(item->host, item->port, item->content);
+    item->size = size;
+    cb_trim(body);
+    cb_move(&item->body, body);
+    item->charge = charge = slab_size(isize) + cb_footprint(&item->body);
+    item->meta = *meta;
+    item->refcnt = 1;
+    item->referenced = 0;
+    item->freq = 0;
+    item->prio = 0;
+    // the next tier's copy is older, whether or not this one is kept
+    if(cache.unspill){
+        cache.unspill(item->host, item->port, item->content);
+    }
+    // past the shared pool, other processes could not read it
+    if(!in_pool(item) && (item = move_to_pool(item, isize)) == NULL){
+        return;
+    }
+    charge = item->charge;
+    // too large for memory: straight to the next tier, if any
+    if(size >= cache.max_object || charge > cache.shard_size){
+        if(cache.spill && size < cache.spill_max){
+            cache.spill(item);
+        }
+        cache_release(item);
+        return;
+    }
+
+    CacheShard *sh = shard_of(item->hash);
+    pthread_rwlock_wrlock(&sh->lock);
+    // drop a stale copy of the same object
+    if((old = shard_find(sh, item->hash, item->host, item->port, item->content)) != NULL){
+        delete_item(sh, old);
+    }
+    // evict until there exist enough space
+    while(sh->size + charge > cache.shard_size && sh->count > 0){
+        victim = cache.policy->victim(sh);
+        // an admission filter weighs the new item against the first victim
+        if(!admitted && cache.policy->admit && !cache.policy->admit(sh, item, victim)){
+            pthread_rwlock_unlock(&sh->lock);
+            cache_release(item);
+            return;
+        }
+        admitted = 1;
+        // keep evicted items alive until they are spilled, outside the lock
+        if(cache.spill && victim->size < cache.spill_max){
+            __atomic_add_fetch(&victim->refcnt, 1, __ATOMIC_RELAXED);
+            delete_item(sh, victim);
+            victim->hnext = spilled;
+            spilled = victim;
+        }else{
+            delete_item(sh, victim);
+        }
+    }
+    // insert new item into the policy's queue and the index
+    cache.policy->insert(sh, item);
+    item->hnext = sh->buckets[item->hash & (SHARD_BUCKETS - 1)];
+    sh->buckets[item->hash & (SHARD_BUCKETS - 1)] = item;
+    // update shard info
+    sh->size += charge;
+    sh->count++;
+    pthread_rwlock_unlock(&sh->lock);
+    while((victim = spilled) != NULL){
+        spilled = victim->hnext;
+        cache.spill(victim);
+        cache_release(victim);
+    }
+    return;
+}
+// describe a cached response with connhdr inserted after its headers,
+// from byte off on, in at most CACHE_IOV iovecs; returns the count
+int cache_iovec(CacheItem *item, char *connhdr, size_t off, struct iovec *iov){
+    size_t hdr = item->meta.hdr_len, clen = strlen(connhdr);
+    int n = 0;
+    if(off < hdr){
+        n = cb_iovec(&item->body, off, hdr - off, iov, CACHE_IOV - 1);
+        off = hdr;
+    }
+    // (headers take a few chunks at most, so they always fit)
+    if(off < hdr + clen){
+        iov[n].iov_base = connhdr + (off - hdr);
+        iov[n].iov_len = hdr + clen - off;
+        n++;
+        off = hdr + clen;
+    }
+    n += cb_iovec(&item->body, off - clen, item->size + clen - off, iov + n, CACHE_IOV - n);
+    return n;
+}
+// count bytes sent to clients for a miss (for the byte hit ratio)
+void cache_count_miss(size_t bytes){
+    __atomic_add_fetch(&cache.stats->miss_bytes, bytes, __ATOMIC_RELAXED);
+}
+// one line of statistics: policy, hit ratio and byte hit ratio
+void cache_report(FILE *fp){
+    CacheStats st;
+    st.lookups = __atomic_load_n(&cache.stats->lookups, __ATOMIC_RELAXED);
+    st.hits = __atomic_load_n(&cache.stats->hits, __ATOMIC_RELAXED);
+    st.stale = __atomic_load_n(&cache.stats->stale, __ATOMIC_RELAXED);
+    st.revalidated = __atomic_load_n(&cache.stats->revalidated, __ATOMIC_RELAXED);
+    st.hit_bytes = __atomic_load_n(&cache.stats->hit_bytes, __ATOMIC_RELAXED);
+    st.miss_bytes = __atomic_load_n(&cache.stats->miss_bytes, __ATOMIC_RELAXED);
+    fprintf(fp, "cache %s: hit ratio %.3f (%ld/%ld), byte hit ratio %.3f (%ld/%ld), "
+        "%ld stale, %ld revalidated, %d objects, %zu bytes\n",
+        cache.policy->name, st.lookups ? (double)st.hits / st.lookups : 0.0, st.hits, st.lookups,
+        st.hit_bytes + st.miss_bytes ? (double)st.hit_bytes / (st.hit_bytes + st.miss_bytes) : 0.0,
+        st.hit_bytes, st.hit_bytes + st.miss_bytes, st.stale, st.revalidated, cache_count(), cache_size());
+}
+// zero the statistics
+void cache_reset_stats(){
+    memset(cache.stats, 0, sizeof(CacheStats));
+}
+// drop every cached object
+void clear_cache(){
+    int i, l;
+    for(i = 0; i < CACHE_SHARDS; i++){
+        CacheShard *sh = &cache.shards[i];
+        pthread_rwlock_wrlock(&sh->lock);
+        for(l = 0; l < 2; l++){
+            while(sh->lists[l].head != NULL){
+                delete_item(sh, sh->lists[l].head);
+            }
+        }
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return;
+}
+// number of cached objects
+int cache_count(){
+    int i, n = 0;
+    for(i = 0; i < CACHE_SHARDS; i++){
+        pthread_rwlock_rdlock(&cache.shards[i].lock);
+        n += cache.shards[i].count;
+        pthread_rwlock_unlock(&cache.shards[i].lock);
+    }
+    return n;
+}
+// number of bytes charged for the cached objects
+size_t cache_size(){
+    int i;
+    size_t n = 0;
+    for(i = 0; i < CACHE_SHARDS; i++){
+        pthread_rwlock_rdlock(&cache.shards[i].lock);
+        n += cache.shards[i].size;
+        pthread_rwlock_unlock(&cache.shards[i].lock);
+    }
+    return n;
+}
+// printing cache for debugging
+void print_cache(){
+    int i, l;
+    printf("--------------printinf cache contents--------------\n");
+    for(i = 0; i < CACHE_SHARDS; i++){
+        CacheShard *sh = &cache.shards[i];
+        pthread_rwlock_rdlock(&sh->lock);
+        for(l = 0; l < 2; l++){
+            CacheItem *cur = sh->lists[l].head;
+            while(cur != NULL){
+                printf("cache content[%d.%d]: host(%s:%s), content(%s)\n", i, l, cur->host, cur->port, cur->content);
+                cur = cur->next;
+            }
+        }
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return;
+}
+// take item off its queue (caller holds the writer lock)
+void cache_list_unlink(CacheShard *sh, CacheItem *item){
+    CacheList *l = &sh->lists[item->list];
+    if(item->prev){
+        item->prev->next = item->next;
+    }else{
+        l->head = item->next;
+    }
+    if(item->next){
+        item->next->prev = item->prev;
+    }else{
+        l->tail = item->prev;
+    }
+    l->size -= item->charge;
+}
+// append item at the young end of queue list (caller holds the writer lock)
+void cache_list_push(CacheShard *sh, int list, CacheItem *item){
+    CacheList *l = &sh->lists[list];
+    item->list = list;
+    item->next = NULL;
+    item->prev = l->tail;
+    if(l->tail){
+        l->tail->next = item;
+    }else{
+        l->head = item;
+    }
+    l->tail = item;
+    l->size += item->charge;
+}
+
+// high bits pick the shard, low bits pick the bucket
+static CacheShard *shard_of(unsigned int hash){
+    return &cache.shards[(hash >> 24) & (CACHE_SHARDS - 1)];
+}
+// look up a key in the shard index (caller holds the shard lock)
+static CacheItem *shard_find(CacheShard *sh, unsigned int h, char *host, char *port, char *content){
+    CacheItem *cur = sh->buckets[h & (SHARD_BUCKETS - 1)];
+    while(cur != NULL){
+        if(cur->hash == h && (strcmp(cur->host, host)==0)
+            && (strcmp(cur->port, port)==0) && (strcmp(cur->content, content)==0)){
+            break;
+        }
+        cur = cur->hnext;
+    }
+    return cur;
+}
+// copy len bytes of the item's response from off on to buf; returns
+// how many there were
+static size_t copy_out(CacheItem *item, size_t off, size_t len, char *buf){
+    struct iovec iov[CACHE_IOV];
+    size_t done = 0;
+    int i, n;
+    while(done < len){
+        if((n = cb_iovec(&item->body, off + done, len - done, iov, CACHE_IOV)) == 0){
+            break;
+        }
+        for(i = 0; i < n; i++){
+            memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+            done += iov[i].iov_len;
+        }
+    }
+    return done;
+}
+// is all of the item pool memory, as a shared cache needs? (it always
+// is unless shared)
+static int in_pool(CacheItem *item){
+    Chunk *c;
+    if(!cache.shared){
+        return 1;
+    }
+    if(!slab_owns(item)){
+        return 0;
+    }
+    for(c = item->body.head; c != NULL; c = c->next){
+        if(!slab_owns(c)){
+            return 0;
+        }
+    }
+    return 1;
+}
+// copy item (isize bytes with its key) and its chunks into the shared
+// pool, emptying slabs until they fit; the copy, or NULL if it does not
+// fit (item is released either way)
+static CacheItem *move_to_pool(CacheItem *item, size_t isize){
+    CacheItem *head = Malloc(isize), *copy;
+    size_t size = item->body.size;
+    size_t port = item->port - item->key, content = item->content - item->key;
+    char *data = Malloc(size);
+    ChunkBuf body;
+    int tries = 0;
+    // what item has in the pool goes back first, and may be enough
+    memcpy(head, item, isize);
+    copy_out(item, 0, size, data);
+    cache_release(item);
+    while(1){
+        copy = slab_alloc(isize);
+        memcpy(copy, head, isize);
+        copy->host = copy->key;
+        copy->port = copy->key + port;
+        copy->content = copy->key + content;
+        cb_init(&body);
+        cb_append(&body, data, size);
+        cb_trim(&body);
+        cb_move(&copy->body, &body);
+        copy->charge = slab_size(isize) + cb_footprint(&copy->body);
+        if(in_pool(copy)){
+            break;
+        }
+        cache_release(copy);
+        copy = NULL;
+        if(++tries > CACHE_RECLAIM_TRIES || !reclaim_slab()){
+            break;
+        }
+    }
+    free(head);
+    free(data);
+    return copy;
+}
+// evict items, in the policy's order and from each shard in turn, until
+// a slab goes back to the pool (readers may hold on to evicted items a
+// while); how many were evicted
+static int reclaim_slab(){
+    static int next_shard;
+    size_t spare = slab_spare();
+    CacheShard *sh;
+    int evicted = 0, empty = 0;
+    while(empty < CACHE_SHARDS && slab_spare() <= spare){
+        sh = &cache.shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) & (CACHE_SHARDS - 1)];
+        pthread_rwlock_wrlock(&sh->lock);
+        if(sh->count > 0){
+            delete_item(sh, cache.policy->victim(sh));
+            evicted++;
+            empty = 0;
+        }else{
+            empty++;
+        }
+        pthread_rwlock_unlock(&sh->lock);
+    }
+    return evicted;
+}
+// delete item from the list and the index (caller holds the writer lock)
+static void delete_item(CacheShard *sh, CacheItem *item){
+    CacheItem **pp = &sh->buckets[item->hash & (SHARD_BUCKETS - 1)];
+    while(*pp != item){
+        pp = &(*pp)->hnext;
+    }
+    *pp = item->hnext;
+    cache_list_unlink(sh, item);
+    sh->size -= item->charge;
+    sh->count--;
+    // readers may still be sending it
+    cache_release(item);
+    return;
+}
+// empty shards with new locks
+static void init_shards(){
+    pthread_rwlockattr_t attr;
+    int i;
+    pthread_rwlockattr_init(&attr);
+    if(cache.shared){
+        pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    for(i = 0; i < CACHE_SHARDS; i++){
+        CacheShard *sh = &cache.shards[i];
+        pthread_rwlock_init(&sh->lock, &attr);
+        sh->size = 0;
+        sh->count = 0;
+        memset(sh->lists, 0, sizeof(sh->lists));
+        memset(sh->buckets, 0, sizeof(sh->buckets));
+        cache.policy->reset(sh);
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
@@ -0,0 +1,155 @@
+/*
+ * cache.h - response cache for the proxy
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "chunkbuf.h"
+
+/* Recommended max cache and object sizes (defaults of cache_set_limits) */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+/* Number of hash buckets (power of two) */
+#define CACHE_BUCKETS 4096
+/* Number of shards (power of two); every shard must fit a max-size object */
+#define CACHE_SHARDS 8
+#define SHARD_BUCKETS (CACHE_BUCKETS / CACHE_SHARDS)
+
+/* The slab pool holds the cache plus 1/CACHE_POOL_EXTRA more for buffers in flight */
+#define CACHE_POOL_EXTRA 4
+
+/* Max iovecs per gather write of a cached response */
+#define CACHE_IOV 64
+
+/* Policy state per shard (see policy.c) */
+#define GHOST_SIZE 256          /* S3-FIFO: keys recently evicted from the small queue */
+#define SKETCH_ROWS 4           /* TinyLFU: count-min sketch of access frequencies */
+#define SKETCH_WIDTH 1024
+
+/* Longest conditional request headers built by cache_validators */
+#define CACHE_COND_MAX 512
+
+/* CacheMeta flags */
+#define META_MUST_REVALIDATE 1  /* never served stale, even if the origin is down */
+#define META_NO_CACHE 2         /* revalidated before every use */
+
+/* What the cache keeps about a response besides its bytes */
+typedef struct{
+    size_t hdr_len;     /* status line and headers, before the blank line */
+    int framed;         /* body length known without reading to EOF */
+    int flags;          /* META_* */
+    time_t expires;     /* fresh until then, revalidated after */
+    unsigned short etag, etag_len;          /* validators: where their values */
+    unsigned short modified, modified_len;  /* are in the headers, 0 if absent */
+} CacheMeta;
+
+/*  Cache for holding responses
+  * split into shards by key hash, each with its own lock
+  * per shard: policy queues + hash index on (host, port, path)
+  * responses are stored without Connection headers (see cache_iovec)
+  * admission and eviction are up to the policy (policy.h), chosen at
+  * startup; hits only update per-item counters, so they need just a
+  * reader lock
+  * items and their chunks live in the slab pool (slab.h); the byte
+  * budget is charged what they take there, key and header included
+  * a hit may be stale (cache_fresh); it is then revalidated with the
+  * origin, and a 304 makes it fresh again (cache_revalidated)
+  * with cache_share, shards, stats and the slab pool are mapped shared
+  * before the proxy forks, so every process sees one cache
+*/
+typedef struct CacheItem{
+    char *host;                 /* the key, stored in key[] */
+    char *port;
+    char *content;
+    unsigned int hash;
+    size_t size;                /* response bytes */
+    size_t charge;              /* memory taken: item, key and chunks */
+    ChunkBuf body;              /* response bytes, owned by the item */
+    CacheMeta meta;
+    int refcnt;                 /* one for the cache, one per reader */
+    int referenced;             /* set on hit, cleared by the clock hand */
+    int freq;                   /* hits counted by the policy */
+    unsigned long prio;         /* GDSF priority */
+    int list;                   /* policy queue the item is on */
+    struct CacheItem* next;
+    struct CacheItem* prev;
+    struct CacheItem* hnext;    /* next item in the same bucket */
+    char key[];                 /* "host\0port\0content\0" */
+}CacheItem;
+
+/* A FIFO of items, oldest at head */
+typedef struct{
+    CacheItem *head;
+    CacheItem *tail;
+    size_t size;                /* bytes charged for the items on it */
+} CacheList;
+
+typedef struct{
+    pthread_rwlock_t lock;
+    CacheList lists[2];         /* policy queues; most policies use one */
+    CacheItem *buckets[SHARD_BUCKETS];
+    size_t size;
+    int count;
+    unsigned int ghost[GHOST_SIZE];
+    int ghost_next;
+    unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+    unsigned int sketch_adds;
+    unsigned long inflation;    /* GDSF: priority of the last victim */
+} CacheShard;
+
+/* Hit and byte counters, for hit ratio and byte hit ratio */
+typedef struct{
+    long lookups;
+    long hits;          /* fresh ones */
+    long stale;
+    long revalidated;   /* stale hits the origin answered with 304 */
+    long hit_bytes;
+    long miss_bytes;
+} CacheStats;
+
+struct CachePolicy;
+
+typedef struct{
+    CacheShard *shards;         /* CACHE_SHARDS of them */
+    struct CachePolicy *policy;
+    CacheStats *stats;
+    int shared;                 /* processes sharing shards, stats and items; 0: not shared */
+    size_t capacity;            /* bytes of memory, over all shards */
+    size_t shard_size;
+    size_t max_object;          /* objects must be smaller than this */
+    void (*spill)(CacheItem *item);     /* next tier, gets evicted items */
+    size_t spill_max;           /* ... smaller than this */
+    void (*unspill)(char *host, char *port, char *content);    /* ... forgets one */
+} Cache;
+
+extern Cache cache;
+
+void init_cache();
+void cache_share(int nprocs);
+void cache_rebuild();
+int cache_set_policy(char *name);
+int cache_set_limits(size_t capacity, size_t max_object);
+void cache_set_spill(void (*spill)(CacheItem *item), void (*unspill)(char *host, char *port, char *content),
+    size_t max_object);
+size_t cache_max_object();
+CacheItem *cache_check(char *host, char *port, char *content);
+CacheItem *cache_peek(char *host, char *port, char *content);
+void cache_release(CacheItem *item);
+int cache_fresh(CacheItem *item);
+int cache_validators(CacheItem *item, char *buf, size_t size);
+void cache_revalidated(CacheItem *item, time_t expires);
+void cache_drop(char *host, char *port, char *content);
+void insert_item(char *host, char *port, char *content, ChunkBuf *body, CacheMeta *meta);
+int cache_iovec(CacheItem *item, char *connhdr, size_t off, struct iovec *iov);
+void cache_count_miss(size_t bytes);
+void cache_report(FILE *fp);
+void cache_reset_stats();
+void clear_cache();
+int cache_count();
+size_t cache_size();
+void print_cache();
+void cache_list_push(CacheShard *sh, int list, CacheItem *item);
+void cache_list_unlink(CacheShard *sh, CacheItem *item);
+
+#endif /* __CACHE_H__ */
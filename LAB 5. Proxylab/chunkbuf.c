@@ -0,0 +1,178 @@
+/*
+ * chunkbuf.c - growable, binary-safe buffer made of a list of chunks
+ *
+ * Bytes are read straight into the free space of the tail chunk
+ * (cb_reserve + cb_commit), so filling never copies or rescans earlier
+ * data, and a finished buffer is handed over whole with cb_move.
+ * Chunks come from the slab allocator (slab.h), in its size classes.
+ */
+#include "chunkbuf.h"
+#include "slab.h"
+
+// initialize an empty buffer
+void cb_init(ChunkBuf *cb){
+    cb->head = NULL;
+    cb->tail = NULL;
+    cb->size = 0;
+}
+// free space at the tail, adding a chunk when the tail is full
+char *cb_reserve(ChunkBuf *cb, size_t *avail){
+    Chunk *c = cb->tail;
+    if(c == NULL || c->len == c->cap){
+        size_t size = c ? (sizeof(Chunk) + c->cap) * 2 : CHUNK_MIN;
+        if(size > CHUNK_MAX) size = CHUNK_MAX;
+        c = slab_alloc(size);
+        c->next = NULL;
+        c->len = 0;
+        c->cap = size - sizeof(Chunk);
+        if(cb->tail){
+            cb->tail->next = c;
+        }else{
+            cb->head = c;
+        }
+        cb->tail = c;
+    }
+    *avail = c->cap - c->len;
+    return c->data + c->len;
+}
+// mark n bytes written into the reserved space as in use
+void cb_commit(ChunkBuf *cb, size_t n){
+    cb->tail->len += n;
+    cb->size += n;
+}
+// copy n bytes to the end of the buffer
+void cb_append(ChunkBuf *cb, const void *data, size_t n){
+    size_t avail, m;
+    char *p;
+    while(n > 0){
+        p = cb_reserve(cb, &avail);
+        m = n < avail ? n : avail;
+        memcpy(p, data, m);
+        cb_commit(cb, m);
+        data = (const char *)data + m;
+        n -= m;
+    }
+}
+// empty the buffer but keep its last chunk for reuse
+void cb_recycle(ChunkBuf *cb){
+    Chunk *c = cb->head, *next;
+    if(c == NULL) return;
+    while(c != cb->tail){
+        next = c->next;
+        slab_free(c);
+        c = next;
+    }
+    c->len = 0;
+    cb->head = c;
+    cb->size = 0;
+}
+// transfer ownership of all chunks from src to dst (dst must be empty)
+void cb_move(ChunkBuf *dst, ChunkBuf *src){
+    *dst = *src;
+    cb_init(src);
+}
+// give the unused tail space back: move the tail into the smallest
+// size class that holds it
+void cb_trim(ChunkBuf *cb){
+    Chunk *c = cb->tail, *prev;
+    size_t size;
+    if(c == NULL || c->len == c->cap) return;
+    if(c->len == 0 && c != cb->head){
+        // drop an empty tail chunk
+        for(prev = cb->head; prev->next != c; prev = prev->next)
+            ;
+        prev->next = NULL;
+        cb->tail = prev;
+        slab_free(c);
+        return;
+    }
+    if((size = slab_size(sizeof(Chunk) + c->len)) >= sizeof(Chunk) + c->cap){
+        return;
+    }
+    c = slab_alloc(size);
+    memcpy(c, cb->tail, sizeof(Chunk) + cb->tail->len);
+    c->cap = size - sizeof(Chunk);
+    if(cb->head == cb->tail){
+        cb->head = c;
+    }else{
+        for(prev = cb->head; prev->next != cb->tail; prev = prev->next)
+            ;
+        prev->next = c;
+    }
+    slab_free(cb->tail);
+    cb->tail = c;
+}
+// free every chunk
+void cb_free(ChunkBuf *cb){
+    Chunk *c = cb->head, *next;
+    while(c){
+        next = c->next;
+        slab_free(c);
+        c = next;
+    }
+    cb_init(cb);
+}
+// bytes of memory the chunks take
+size_t cb_footprint(ChunkBuf *cb){
+    Chunk *c;
+    size_t n = 0;
+    for(c = cb->head; c != NULL; c = c->next){
+        n += sizeof(Chunk) + c->cap;
+    }
+    return n;
+}
+// describe len bytes from offset off with at most max iovecs; returns count
+int cb_iovec(ChunkBuf *cb, size_t off, size_t len, struct iovec *iov, int max){
+    Chunk *c = cb->head;
+    size_t m;
+    int n = 0;
+    while(c && off >= c->len){
+        off -= c->len;
+        c = c->next;
+    }
+    for(; c && len > 0 && n < max; c = c->next){
+        m = c->len - off < len ? c->len - off : len;
+        iov[n].iov_base = c->data + off;
+        iov[n].iov_len = m;
+        len -= m;
+        off = 0;
+        n++;
+    }
+    return n;
+}
+// one writev of the iovecs, skipping their first skip bytes;
+// returns bytes written (0 if nothing is left) or -1
+ssize_t iov_write(int fd, struct iovec *iov, int n, size_t skip){
+    struct iovec first;
+    ssize_t rc;
+    while(n > 0 && skip >= iov->iov_len){
+        skip -= iov->iov_len;
+        iov++;
+        n--;
+    }
+    if(n == 0) return 0;
+    // the first iovec may be partly sent; adjust a copy of it
+    first = iov[0];
+    iov[0].iov_base = (char *)iov[0].iov_base + skip;
+    iov[0].iov_len -= skip;
+    while((rc = writev(fd, iov, n)) < 0 && errno == EINTR)
+        ;
+    iov[0] = first;
+    return rc;
+}
+// write all iovecs to a blocking descriptor; returns bytes or -1
+ssize_t iov_writen(int fd, struct iovec *iov, int n){
+    size_t off = 0, total = 0;
+    ssize_t rc;
+    int i;
+    for(i = 0; i < n; i++){
+        total += iov[i].iov_len;
+    }
+    while(off < total){
+        if((rc = iov_write(fd, iov, n, off)) < 0){
+            return -1;
+        }
+        off += rc;
+    }
+    return off;
+}
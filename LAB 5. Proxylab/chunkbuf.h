@@ -0,0 +1,41 @@
+/*
+ * chunkbuf.h - growable, binary-safe buffer made of a list of chunks
+ */
+#ifndef __CHUNKBUF_H__
+#define __CHUNKBUF_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+
+/* Chunks double in size from CHUNK_MIN up to CHUNK_MAX bytes, header
+   included, so they fill their slab size classes exactly */
+#define CHUNK_MIN 2048
+#define CHUNK_MAX 32768
+
+typedef struct Chunk{
+    struct Chunk *next;
+    size_t len;         /* bytes in use */
+    size_t cap;         /* bytes available in data */
+    char data[];
+} Chunk;
+
+typedef struct{
+    Chunk *head;
+    Chunk *tail;
+    size_t size;        /* total bytes in use */
+} ChunkBuf;
+
+void cb_init(ChunkBuf *cb);
+char *cb_reserve(ChunkBuf *cb, size_t *avail);
+void cb_commit(ChunkBuf *cb, size_t n);
+void cb_append(ChunkBuf *cb, const void *data, size_t n);
+void cb_recycle(ChunkBuf *cb);
+void cb_trim(ChunkBuf *cb);
+void cb_move(ChunkBuf *dst, ChunkBuf *src);
+void cb_free(ChunkBuf *cb);
+size_t cb_footprint(ChunkBuf *cb);
+int cb_iovec(ChunkBuf *cb, size_t off, size_t len, struct iovec *iov, int max);
+ssize_t iov_write(int fd, struct iovec *iov, int n, size_t skip);
+ssize_t iov_writen(int fd, struct iovec *iov, int n);
+
+#endif /* __CHUNKBUF_H__ */
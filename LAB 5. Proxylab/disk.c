@@ -0,0 +1,410 @@
+/*
+ * disk.c - second cache tier in mmap'd, append-only segment files
+ *
+ * Objects evicted from memory (and objects too large for it) are
+ * appended as records to the youngest segment file in the cache
+ * directory; the index that finds them stays in memory. A hit pins the
+ * segment and is sent straight from its read-only mapping with writev,
+ * so the bytes come out of the page cache without a copy in the proxy.
+ *
+ * Segments only grow. When the tier is full the oldest segment is
+ * dropped whole, and a background thread compacts sealed segments that
+ * are mostly dead (replaced objects) by appending their live records
+ * again and dropping them. A dropped segment is unmapped and unlinked
+ * once its last reader lets go.
+ *
+ * Record layout: DiskRecord, key (NUL-terminated), response bytes,
+ * padded to 8 bytes.
+ *
+ * The tier only serves fresh objects: a stale one is dropped from the
+ * index when it is looked up, and the memory tier fetches it again.
+ */
+#include <dirent.h>
+#include "disk.h"
+#include "hash.h"
+
+#define DISK_MAGIC 0x50584431u     /* "PXD1" */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct{
+    unsigned int magic;
+    unsigned int keylen;        /* including the NUL */
+    unsigned long size;
+    CacheMeta meta;
+} DiskRecord;
+
+static struct{
+    int enabled;
+    char dir[MAXLINE / 2];
+    size_t seg_size;
+    int max_segs;
+    size_t max_object;
+    pthread_mutex_t lock;
+    DiskEntry *buckets[DISK_BUCKETS];
+    DiskSeg *oldest;
+    DiskSeg *active;            /* youngest, the one appended to */
+    int nsegs;
+    int next_id;
+    int count;
+    size_t live;
+    long lookups, hits, compactions;
+} disk;
+
+static DiskEntry *find_entry(char *key, unsigned int h);
+static DiskSeg *new_segment();
+static void drop_segment(DiskSeg *seg);
+static void seg_unpin(DiskSeg *seg);
+static void remove_entry(DiskEntry *e);
+static int append(char *key, CacheMeta *meta, size_t size, ChunkBuf *body, char *data,
+    DiskSeg *from, size_t from_off);
+static void *compact_thread(void *vargp);
+
+// open the tier in dir (created if missing, old segments removed); -1 on error
+int disk_init(char *dir, size_t capacity, size_t max_object){
+    char path[MAXLINE];
+    struct dirent *de;
+    pthread_t tid;
+    DIR *d;
+
+    if(capacity < 2 * DISK_MIN_SEGMENT || strlen(dir) >= sizeof(disk.dir)){
+        return -1;
+    }
+    if(mkdir(dir, 0700) < 0 && errno != EEXIST){
+        return -1;
+    }
+    if((d = opendir(dir)) == NULL){
+        return -1;
+    }
+    // the index is not persistent, so neither are the segments
+    while((de = readdir(d)) != NULL){
+        if(!strncmp(de->d_name, "seg-", 4)){
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    strcpy(disk.dir, dir);
+    // at least two segments, and an object must fit half of one
+    disk.seg_size = capacity / 2 < DISK_SEGMENT_SIZE ? capacity / 2 : DISK_SEGMENT_SIZE;
+    disk.max_segs = capacity / disk.seg_size;
+    disk.max_object = max_object < disk.seg_size / 2 ? max_object : disk.seg_size / 2;
+    pthread_mutex_init(&disk.lock, NULL);
+    disk.enabled = 1;
+    Pthread_create(&tid, NULL, compact_thread, NULL);
+    return 0;
+}
+// is the tier in use?
+int disk_enabled(){
+    return disk.enabled;
+}
+// objects at least this large do not go to disk
+size_t disk_max_object(){
+    return disk.max_object;
+}
+// write an object to disk (the spill function of the memory tier)
+void disk_put(CacheItem *item){
+    char key[MAXLINE];
+    if(!cache_fresh(item)){
+        return;
+    }
+    snprintf(key, sizeof(key), "%s:%s%s", item->host, item->port, item->content);
+    append(key, &item->meta, item->size, &item->body, NULL, NULL, 0);
+}
+// look up an object; on a hit, *hit stays valid until disk_release
+int disk_check(char *host, char *port, char *content, DiskHit *hit){
+    char key[MAXLINE];
+    DiskEntry *e;
+    if(!disk.enabled){
+        return 0;
+    }
+    snprintf(key, sizeof(key), "%s:%s%s", host, port, content);
+    pthread_mutex_lock(&disk.lock);
+    disk.lookups++;
+    if((e = find_entry(key, hash_str(HASH_INIT, key))) == NULL){
+        pthread_mutex_unlock(&disk.lock);
+        return 0;
+    }
+    if(time(NULL) >= e->meta.expires){
+        remove_entry(e);
+        pthread_mutex_unlock(&disk.lock);
+        return 0;
+    }
+    disk.hits++;
+    e->seg->refcnt++;
+    hit->seg = e->seg;
+    hit->data = e->seg->map + e->data;
+    hit->size = e->size;
+    hit->meta = e->meta;
+    pthread_mutex_unlock(&disk.lock);
+    // a miss in memory all the same, for the byte hit ratio up there
+    cache_count_miss(hit->size);
+    return 1;
+}
+// forget an object (the unspill function of the memory tier); readers
+// that pinned it still finish sending it
+void disk_drop(char *host, char *port, char *content){
+    char key[MAXLINE];
+    DiskEntry *e;
+    if(!disk.enabled){
+        return;
+    }
+    snprintf(key, sizeof(key), "%s:%s%s", host, port, content);
+    pthread_mutex_lock(&disk.lock);
+    if((e = find_entry(key, hash_str(HASH_INIT, key))) != NULL){
+        remove_entry(e);
+    }
+    pthread_mutex_unlock(&disk.lock);
+}
+// like cache_iovec: bytes from off on of headers, connhdr, blank line, body
+int disk_iovec(DiskHit *hit, char *connhdr, size_t off, struct iovec *iov){
+    struct iovec all[3];
+    int i, n = 0;
+    all[0].iov_base = hit->data;
+    all[0].iov_len = hit->meta.hdr_len;
+    all[1].iov_base = connhdr;
+    all[1].iov_len = strlen(connhdr);
+    all[2].iov_base = hit->data + hit->meta.hdr_len;
+    all[2].iov_len = hit->size - hit->meta.hdr_len;
+    for(i = 0; i < 3; i++){
+        if(off >= all[i].iov_len){
+            off -= all[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)all[i].iov_base + off;
+        iov[n].iov_len = all[i].iov_len - off;
+        off = 0;
+        n++;
+    }
+    return n;
+}
+// unpin a hit
+void disk_release(DiskHit *hit){
+    pthread_mutex_lock(&disk.lock);
+    seg_unpin(hit->seg);
+    pthread_mutex_unlock(&disk.lock);
+    hit->seg = NULL;
+}
+// one line of statistics
+void disk_report(FILE *fp){
+    if(!disk.enabled) return;
+    pthread_mutex_lock(&disk.lock);
+    fprintf(fp, "disk: hit ratio %.3f (%ld/%ld), %d objects, %zu live bytes in %d segments, %ld compactions\n",
+        disk.lookups ? (double)disk.hits / disk.lookups : 0.0, disk.hits, disk.lookups,
+        disk.count, disk.live, disk.nsegs, disk.compactions);
+    pthread_mutex_unlock(&disk.lock);
+}
+
+// index lookup (lock held)
+static DiskEntry *find_entry(char *key, unsigned int h){
+    DiskEntry *e;
+    for(e = disk.buckets[h & (DISK_BUCKETS - 1)]; e != NULL; e = e->next){
+        if(e->hash == h && !strcmp(e->key, key)) break;
+    }
+    return e;
+}
+// start a new youngest segment, dropping the oldest when full (lock held)
+static DiskSeg *new_segment(){
+    char path[MAXLINE];
+    DiskSeg *seg;
+    int fd;
+    while(disk.nsegs >= disk.max_segs && disk.oldest != NULL){
+        drop_segment(disk.oldest);
+    }
+    snprintf(path, sizeof(path), "%s/seg-%06d", disk.dir, disk.next_id);
+    if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0){
+        return NULL;
+    }
+    seg = Calloc(1, sizeof(DiskSeg));
+    // sparse: the file only takes the blocks that are written
+    if(ftruncate(fd, disk.seg_size) < 0
+        || (seg->map = mmap(NULL, disk.seg_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        close(fd);
+        unlink(path);
+        free(seg);
+        return NULL;
+    }
+    seg->id = disk.next_id++;
+    seg->fd = fd;
+    seg->refcnt = 1;
+    if(disk.active){
+        disk.active->next = seg;
+    }else{
+        disk.oldest = seg;
+    }
+    disk.active = seg;
+    disk.nsegs++;
+    return seg;
+}
+// forget a segment and everything in it (lock held)
+static void drop_segment(DiskSeg *seg){
+    DiskEntry *e, *next;
+    DiskSeg **pp;
+    int i;
+    for(i = 0; i < DISK_BUCKETS; i++){
+        for(e = disk.buckets[i]; e != NULL; e = next){
+            next = e->next;
+            if(e->seg == seg) remove_entry(e);
+        }
+    }
+    for(pp = &disk.oldest; *pp != seg; pp = &(*pp)->next)
+        ;
+    *pp = seg->next;
+    if(disk.active == seg){
+        // only when it is the last one; the list is empty then
+        disk.active = NULL;
+    }
+    disk.nsegs--;
+    seg->dead = 1;
+    seg_unpin(seg);
+}
+// drop a reference; a dead segment goes away with the last one (lock held)
+static void seg_unpin(DiskSeg *seg){
+    char path[MAXLINE];
+    if(--seg->refcnt > 0 || !seg->dead){
+        return;
+    }
+    munmap(seg->map, disk.seg_size);
+    close(seg->fd);
+    snprintf(path, sizeof(path), "%s/seg-%06d", disk.dir, seg->id);
+    unlink(path);
+    free(seg);
+}
+// take an entry out of the index (lock held)
+static void remove_entry(DiskEntry *e){
+    DiskEntry **pp = &disk.buckets[e->hash & (DISK_BUCKETS - 1)];
+    while(*pp != e){
+        pp = &(*pp)->next;
+    }
+    *pp = e->next;
+    e->seg->live -= e->reclen;
+    disk.live -= e->size;
+    disk.count--;
+    free(e->key);
+    free(e);
+}
+/*
+ * append - write one record to the youngest segment and index it. The
+ *     bytes come from body or data. With from set (compaction) the index
+ *     is only updated if the key still points at from:from_off.
+ */
+static int append(char *key, CacheMeta *meta, size_t size, ChunkBuf *body, char *data,
+    DiskSeg *from, size_t from_off){
+    DiskRecord rec;
+    DiskSeg *seg;
+    DiskEntry *e;
+    Chunk *c;
+    unsigned int h = hash_str(HASH_INIT, key);
+    size_t keylen = strlen(key) + 1;
+    size_t reclen = ALIGN8(sizeof(rec) + keylen + size);
+    size_t off, pos;
+    int ok = 1;
+
+    // reserve room, then write without the lock
+    pthread_mutex_lock(&disk.lock);
+    seg = disk.active;
+    if(seg == NULL || seg->used + reclen > disk.seg_size){
+        seg = new_segment();
+    }
+    if(seg == NULL){
+        pthread_mutex_unlock(&disk.lock);
+        return -1;
+    }
+    off = seg->used;
+    seg->used += reclen;
+    seg->refcnt++;
+    pthread_mutex_unlock(&disk.lock);
+
+    rec.magic = DISK_MAGIC;
+    rec.keylen = keylen;
+    rec.size = size;
+    rec.meta = *meta;
+    pos = off;
+    if(pwrite(seg->fd, &rec, sizeof(rec), pos) != sizeof(rec)
+        || pwrite(seg->fd, key, keylen, pos + sizeof(rec)) != keylen){
+        ok = 0;
+    }
+    pos += sizeof(rec) + keylen;
+    if(data != NULL){
+        ok = ok && pwrite(seg->fd, data, size, pos) == size;
+    }else{
+        for(c = body->head; c != NULL && ok; c = c->next){
+            ok = pwrite(seg->fd, c->data, c->len, pos) == c->len;
+            pos += c->len;
+        }
+    }
+
+    pthread_mutex_lock(&disk.lock);
+    e = find_entry(key, h);
+    // a dropped segment or a newer copy wins over this record
+    if(!ok || seg->dead || (from != NULL && (e == NULL || e->seg != from || e->off != from_off))){
+        seg_unpin(seg);
+        pthread_mutex_unlock(&disk.lock);
+        return -1;
+    }
+    if(e != NULL){
+        remove_entry(e);
+    }
+    e = Malloc(sizeof(DiskEntry));
+    e->key = strdup(key);
+    e->hash = h;
+    e->seg = seg;
+    e->off = off;
+    e->reclen = reclen;
+    e->data = off + sizeof(rec) + keylen;
+    e->size = size;
+    e->meta = *meta;
+    e->next = disk.buckets[h & (DISK_BUCKETS - 1)];
+    disk.buckets[h & (DISK_BUCKETS - 1)] = e;
+    seg->live += reclen;
+    disk.live += size;
+    disk.count++;
+    seg_unpin(seg);
+    pthread_mutex_unlock(&disk.lock);
+    return 0;
+}
+// move the live records out of mostly dead segments, in the background
+static void *compact_thread(void *vargp){
+    DiskSeg *seg;
+    DiskEntry *e, *copy;
+    int i, n;
+    Pthread_detach(pthread_self());
+    while(1){
+        sleep(DISK_COMPACT_INTERVAL);
+        pthread_mutex_lock(&disk.lock);
+        for(seg = disk.oldest; seg != NULL && seg != disk.active; seg = seg->next){
+            if(seg->live * 100 < seg->used * DISK_COMPACT_LIVE) break;
+        }
+        if(seg == NULL || seg == disk.active){
+            pthread_mutex_unlock(&disk.lock);
+            continue;
+        }
+        // note what is still live, so the appends can run unlocked
+        copy = Malloc((seg->live / ALIGN8(sizeof(DiskRecord) + 2) + 1) * sizeof(DiskEntry));
+        n = 0;
+        for(i = 0; i < DISK_BUCKETS; i++){
+            for(e = disk.buckets[i]; e != NULL; e = e->next){
+                if(e->seg != seg) continue;
+                copy[n] = *e;
+                copy[n++].key = strdup(e->key);
+            }
+        }
+        seg->refcnt++;
+        pthread_mutex_unlock(&disk.lock);
+
+        for(i = 0; i < n; i++){
+            append(copy[i].key, &copy[i].meta, copy[i].size, NULL, seg->map + copy[i].data,
+                seg, copy[i].off);
+            free(copy[i].key);
+        }
+        free(copy);
+
+        pthread_mutex_lock(&disk.lock);
+        if(!seg->dead){
+            drop_segment(seg);
+        }
+        seg_unpin(seg);
+        disk.compactions++;
+        pthread_mutex_unlock(&disk.lock);
+    }
+    return NULL;
+}
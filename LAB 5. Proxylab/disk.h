@@ -0,0 +1,67 @@
+/*
+ * disk.h - second cache tier in mmap'd, append-only segment files
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Defaults of the disk tier */
+#define DISK_CAPACITY (64 << 20)
+#define DISK_MAX_OBJECT (1 << 20)
+/* Size of a segment file (less if the capacity is small) */
+#define DISK_SEGMENT_SIZE (8 << 20)
+/* ... but never less than this */
+#define DISK_MIN_SEGMENT (64 << 10)
+/* Number of hash buckets of the index (power of two) */
+#define DISK_BUCKETS 4096
+/* Sealed segments with less than this percentage of live bytes are compacted */
+#define DISK_COMPACT_LIVE 50
+/* Seconds between compaction passes */
+#define DISK_COMPACT_INTERVAL 1
+
+/* A segment file, mapped read-only; appended to with pwrite */
+typedef struct DiskSeg{
+    int id;
+    int fd;
+    char *map;
+    size_t used;                /* bytes reserved by appends */
+    size_t live;                /* bytes of records still in the index */
+    int refcnt;                 /* the segment list, readers and writers */
+    int dead;                   /* dropped; removed when refcnt hits 0 */
+    struct DiskSeg *next;       /* next younger segment */
+} DiskSeg;
+
+/* Where the index finds an object */
+typedef struct DiskEntry{
+    char *key;                  /* "host:port/path" */
+    unsigned int hash;
+    DiskSeg *seg;
+    size_t off;                 /* offset of the record in the segment */
+    size_t reclen;
+    size_t data;                /* offset of the response bytes */
+    size_t size;
+    CacheMeta meta;
+    struct DiskEntry *next;
+} DiskEntry;
+
+/* A pinned disk hit, valid until disk_release */
+typedef struct{
+    DiskSeg *seg;
+    char *data;
+    size_t size;
+    CacheMeta meta;
+} DiskHit;
+
+int disk_init(char *dir, size_t capacity, size_t max_object);
+int disk_enabled();
+size_t disk_max_object();
+void disk_put(CacheItem *item);
+int disk_check(char *host, char *port, char *content, DiskHit *hit);
+void disk_drop(char *host, char *port, char *content);
+int disk_iovec(DiskHit *hit, char *connhdr, size_t off, struct iovec *iov);
+void disk_release(DiskHit *hit);
+void disk_report(FILE *fp);
+
+#endif /* __DISK_H__ */
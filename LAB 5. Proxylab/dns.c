@@ -0,0 +1,283 @@
+/*
+ * dns.c - resolver cache for upstream connects
+ *
+ * getaddrinfo blocks the calling thread for as long as the resolver
+ * takes, and used to run on every miss. Answers are now kept per
+ * (host, port) for a TTL (DNS_TTL seconds unless the proxy is given
+ * one), failures for DNS_NEGATIVE_TTL. A lookup that finds its name
+ * being resolved waits for that answer instead of asking again, so a
+ * burst of misses to a new origin costs one resolution. Names in use
+ * are resolved again by a background thread shortly before they
+ * expire, so busy origins do not wait for the resolver at all; expired
+ * names are dropped.
+ */
+#include <poll.h>
+#include "dns.h"
+#include "hash.h"
+
+static struct{
+    pthread_mutex_t lock;
+    DnsEntry *buckets[DNS_BUCKETS];
+    int count;
+    int ttl, negative_ttl, ahead;   /* seconds, set by dns_init */
+    long lookups, hits, shared, negative, refreshes;
+} dns = {PTHREAD_MUTEX_INITIALIZER};
+
+static DnsEntry *find_name(unsigned int h, char *host, char *port);
+static int resolve(char *host, char *port, DnsAddr *addrs);
+static void store(DnsEntry *e, DnsAddr *addrs, int n);
+static void *refresh_thread(void *vargp);
+
+// keep answers for ttl seconds, and start the background refresher
+void dns_init(int ttl){
+    pthread_t tid;
+    dns.ttl = ttl;
+    dns.negative_ttl = DNS_NEGATIVE_TTL < ttl ? DNS_NEGATIVE_TTL : ttl;
+    dns.ahead = DNS_REFRESH_AHEAD < ttl / 2 ? DNS_REFRESH_AHEAD : ttl / 2;
+    Pthread_create(&tid, NULL, refresh_thread, NULL);
+}
+/*
+ * dns_lookup - addresses of host:port, from the cache if possible
+ *     fills addrs (DNS_MAX_ADDRS of them) and returns how many, or -1
+ *     if the name does not resolve
+ */
+int dns_lookup(char *host, char *port, DnsAddr *addrs){
+    unsigned int h = hash_origin(host, port);
+    DnsEntry **bucket = &dns.buckets[h & (DNS_BUCKETS - 1)], *e;
+    time_t now = time(NULL);
+    int n;
+
+    if(strlen(host) >= sizeof(e->host) || strlen(port) >= sizeof(e->port)){
+        return resolve(host, port, addrs);
+    }
+    pthread_mutex_lock(&dns.lock);
+    dns.lookups++;
+    if((e = find_name(h, host, port)) == NULL){
+        if(dns.count >= DNS_MAX_ENTRIES){
+            pthread_mutex_unlock(&dns.lock);
+            return resolve(host, port, addrs);
+        }
+        e = Calloc(1, sizeof(DnsEntry));
+        strcpy(e->host, host);
+        strcpy(e->port, port);
+        e->hash = h;
+        pthread_cond_init(&e->done, NULL);
+        e->next = *bucket;
+        *bucket = e;
+        dns.count++;
+    }
+    e->used = now;
+    if(now >= e->expires && e->resolving){
+        // being resolved already: share that answer
+        dns.shared++;
+        e->waiters++;
+        while(e->resolving){
+            pthread_cond_wait(&e->done, &dns.lock);
+        }
+        e->waiters--;
+    }else if(now >= e->expires){
+        // resolve it ourselves, without the lock
+        e->resolving = 1;
+        pthread_mutex_unlock(&dns.lock);
+        n = resolve(host, port, addrs);
+        pthread_mutex_lock(&dns.lock);
+        store(e, addrs, n);
+        pthread_mutex_unlock(&dns.lock);
+        return n;
+    }else{
+        dns.hits++;
+    }
+    if((n = e->naddrs) < 0){
+        dns.negative++;
+    }else{
+        memcpy(addrs, e->addrs, n * sizeof(DnsAddr));
+    }
+    pthread_mutex_unlock(&dns.lock);
+    return n;
+}
+/*
+ * dns_cached - dns_lookup for callers that must not block: the answer
+ *     if a fresh one is cached, else DNS_MISS (and nothing is counted)
+ */
+int dns_cached(char *host, char *port, DnsAddr *addrs){
+    DnsEntry *e;
+    time_t now = time(NULL);
+    int n = DNS_MISS;
+    pthread_mutex_lock(&dns.lock);
+    if((e = find_name(hash_origin(host, port), host, port)) != NULL && now < e->expires){
+        e->used = now;
+        dns.lookups++;
+        dns.hits++;
+        if((n = e->naddrs) < 0){
+            dns.negative++;
+        }else{
+            memcpy(addrs, e->addrs, n * sizeof(DnsAddr));
+        }
+    }
+    pthread_mutex_unlock(&dns.lock);
+    return n;
+}
+/*
+ * dns_connect - like open_clientfd, with the address from the cache
+ *     Tries the addresses in turn within timeout_ms altogether (0: no
+ *     limit) and returns a blocking socket; -2 if the name does not
+ *     resolve, -1 if no address answered (errno ETIMEDOUT if time ran
+ *     out).
+ */
+int dns_connect(char *host, char *port, int timeout_ms){
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    struct pollfd pfd;
+    struct timespec ts;
+    long deadline = 0, left;
+    socklen_t len;
+    int i, n, fd, err, rc;
+    if((n = dns_lookup(host, port, addrs)) < 0){
+        return -2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if(timeout_ms > 0){
+        deadline = ts.tv_sec * 1000L + ts.tv_nsec / 1000000 + timeout_ms;
+    }
+    for(i = 0; i < n; i++){
+        if((fd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK, addrs[i].protocol)) < 0){
+            continue;
+        }
+        err = 0;
+        if(connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) < 0){
+            err = errno;
+        }
+        // wait for the handshake, no longer than what is left
+        while(err == EINPROGRESS){
+            left = -1;
+            if(deadline){
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                if((left = deadline - (ts.tv_sec * 1000L + ts.tv_nsec / 1000000)) <= 0){
+                    err = ETIMEDOUT;
+                    break;
+                }
+            }
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if((rc = poll(&pfd, 1, left)) < 0 && errno != EINTR){
+                err = errno;
+            }else if(rc > 0){
+                len = sizeof(err);
+                if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0){
+                    err = errno;
+                }
+            }
+        }
+        if(err == 0){
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            return fd;
+        }
+        close(fd);
+        if(err == ETIMEDOUT && deadline){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    errno = ECONNREFUSED;
+    return -1;
+}
+// one line of statistics
+void dns_report(FILE *fp){
+    pthread_mutex_lock(&dns.lock);
+    fprintf(fp, "dns: %d names, hit ratio %.3f (%ld/%ld), %ld shared, %ld negative hits, %ld refreshes\n",
+        dns.count, dns.lookups ? (double)dns.hits / dns.lookups : 0.0, dns.hits, dns.lookups,
+        dns.shared, dns.negative, dns.refreshes);
+    pthread_mutex_unlock(&dns.lock);
+}
+
+// the cached entry of host:port, NULL if none (lock held)
+static DnsEntry *find_name(unsigned int h, char *host, char *port){
+    DnsEntry *e;
+    for(e = dns.buckets[h & (DNS_BUCKETS - 1)]; e != NULL; e = e->next){
+        if(e->hash == h && !strcmp(e->host, host) && !strcmp(e->port, port)) break;
+    }
+    return e;
+}
+// ask the resolver; returns the number of addresses or -1
+static int resolve(char *host, char *port, DnsAddr *addrs){
+    struct addrinfo hints, *listp, *p;
+    int n = 0;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if(getaddrinfo(host, port, &hints, &listp) != 0){
+        return -1;
+    }
+    for(p = listp; p && n < DNS_MAX_ADDRS; p = p->ai_next){
+        if(p->ai_addrlen > sizeof(addrs[n].addr)) continue;
+        addrs[n].family = p->ai_family;
+        addrs[n].socktype = p->ai_socktype;
+        addrs[n].protocol = p->ai_protocol;
+        addrs[n].addrlen = p->ai_addrlen;
+        memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+        n++;
+    }
+    freeaddrinfo(listp);
+    return n > 0 ? n : -1;
+}
+// an answer for e arrived; wake whoever waits for it (lock held)
+static void store(DnsEntry *e, DnsAddr *addrs, int n){
+    e->naddrs = n;
+    if(n > 0){
+        memcpy(e->addrs, addrs, n * sizeof(DnsAddr));
+    }
+    e->expires = time(NULL) + (n < 0 ? dns.negative_ttl : dns.ttl);
+    e->resolving = 0;
+    pthread_cond_broadcast(&e->done);
+}
+// refresh names in use before they expire, drop expired ones
+static void *refresh_thread(void *vargp){
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    DnsEntry **pp, *e, *batch[64];
+    time_t now;
+    int i, n, nbatch;
+    Pthread_detach(pthread_self());
+    while(1){
+        sleep(1);
+        now = time(NULL);
+        nbatch = 0;
+        pthread_mutex_lock(&dns.lock);
+        for(i = 0; i < DNS_BUCKETS; i++){
+            pp = &dns.buckets[i];
+            while((e = *pp) != NULL){
+                if(e->resolving){
+                    pp = &e->next;
+                }else if(now >= e->expires && e->waiters == 0){
+                    *pp = e->next;
+                    pthread_cond_destroy(&e->done);
+                    free(e);
+                    dns.count--;
+                }else{
+                    if(e->naddrs > 0 && e->expires - now <= dns.ahead
+                        && now - e->used < dns.ttl && nbatch < 64){
+                        e->resolving = 1;
+                        batch[nbatch++] = e;
+                    }
+                    pp = &e->next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&dns.lock);
+
+        // lookups meanwhile keep getting the old answer
+        for(i = 0; i < nbatch; i++){
+            e = batch[i];
+            n = resolve(e->host, e->port, addrs);
+            pthread_mutex_lock(&dns.lock);
+            if(n > 0){
+                store(e, addrs, n);
+                dns.refreshes++;
+            }else{
+                // keep the old answer until it expires; try again next time
+                e->resolving = 0;
+                pthread_cond_broadcast(&e->done);
+            }
+            pthread_mutex_unlock(&dns.lock);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * dns.h - resolver cache for upstream connects
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* Number of hash buckets (power of two) */
+#define DNS_BUCKETS 256
+/* Names cached at most; lookups beyond that resolve uncached */
+#define DNS_MAX_ENTRIES 1024
+/* Addresses kept per name */
+#define DNS_MAX_ADDRS 8
+/* Seconds an answer is used by default (getaddrinfo reports no TTL) */
+#define DNS_TTL 60
+/* Seconds a failure is remembered, at most the TTL */
+#define DNS_NEGATIVE_TTL 5
+/* Names used recently are resolved again this many seconds before they
+   expire, at most half the TTL */
+#define DNS_REFRESH_AHEAD 10
+/* dns_cached: no fresh answer cached, dns_lookup would block */
+#define DNS_MISS -2
+
+/* One address of a name, as getaddrinfo gave it */
+typedef struct{
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} DnsAddr;
+
+/* A cached name (host:port) */
+typedef struct DnsEntry{
+    char host[200];
+    char port[10];
+    unsigned int hash;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    int naddrs;                 /* -1: the name did not resolve */
+    time_t expires;             /* 0: no answer yet */
+    time_t used;                /* last lookup */
+    int resolving;              /* a lookup or the refresher is at it */
+    pthread_cond_t done;        /* signalled when resolving ends */
+    int waiters;
+    struct DnsEntry *next;
+} DnsEntry;
+
+void dns_init(int ttl);
+int dns_lookup(char *host, char *port, DnsAddr *addrs);
+int dns_cached(char *host, char *port, DnsAddr *addrs);
+int dns_connect(char *host, char *port, int timeout_ms);
+void dns_report(FILE *fp);
+
+#endif /* __DNS_H__ */
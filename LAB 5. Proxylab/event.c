@@ -0,0 +1,977 @@
+/*
+ * event.c - event-driven (epoll) run mode of the proxy
+ *
+ * Each event loop is one thread with its own epoll instance; all loops
+ * share the listening socket (EPOLLEXCLUSIVE wakes only one of them).
+ * Every socket is non-blocking and every client connection is a small
+ * state machine:
+ *
+ *   REQUEST -> (cache hit)  HIT                          -> done
+ *           -> (disk hit)   HIT                          -> done
+ *           -> (cache miss) [RESOLVE] CONNECT -> FORWARD -> RELAY -> done
+ *           -> (same miss in flight) WAIT -> (cached) HIT -> done
+ *                                         -> (not) as a cache miss
+ *           -> (stale hit)  [RESOLVE] CONNECT -> FORWARD -> (304) HIT -> done
+ *                                                        -> RELAY -> done
+ *
+ * An idle client costs one Conn (request buffer allocated on first
+ * read), not a thread. Responses always end with Connection: close.
+ * Bodies the cache will not keep are spliced from the server socket to
+ * the client's through a pipe of the connection's own. One it keeps is
+ * followed to its end by Content-Length or chunk sizes, and is cached
+ * only if the origin did not close before that.
+ *
+ * The origin's address comes from the resolver cache when it has a
+ * fresh one. Otherwise a resolver thread waits for getaddrinfo and
+ * hands the connection back to its loop through the loop's pipe; the
+ * loop goes on meanwhile.
+ *
+ * A miss on an object a fetch of the same loop is getting already
+ * waits for that fetch instead of asking the origin again, and then
+ * is a cache hit. If the fetch did not end up in the cache, the ones
+ * waiting fetch it themselves; if the origin timed out, they get a
+ * 504 as well. A fetch whose own client goes away goes on for them.
+ *
+ * Connections talking to an origin are kept on a list of their loop,
+ * which is swept every EVENT_TICK ms for the deadlines of upstream.h:
+ * connect, time since the last byte moved, and the whole response. One
+ * that missed its deadline gets a 504 if nothing was sent yet (or its
+ * stale copy), else it is closed.
+ */
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+#include "dns.h"
+#include "request.h"
+#include "http.h"
+#include "splice.h"
+#include "upstream.h"
+#include "event.h"
+#include "hash.h"
+
+#define MAX_EVENTS 256
+/* Milliseconds between two sweeps for upstream deadlines */
+#define EVENT_TICK 250
+/* Threads resolving names for the loops */
+#define EVENT_RESOLVERS 4
+/* Buckets of a loop's table of fetches (power of two) */
+#define EVENT_FETCH_BUCKETS 256
+
+typedef enum{
+    ST_REQUEST,     /* reading request headers from the client */
+    ST_HIT,         /* writing a cached object (memory or disk) to the client */
+    ST_WAIT,        /* waiting for another connection's fetch of the object */
+    ST_RESOLVE,     /* a resolver thread has it, looking up the origin */
+    ST_CONNECT,     /* waiting for the upstream connect to finish */
+    ST_FORWARD,     /* writing the proxy request to the server */
+    ST_RELAY        /* relaying the response, filling the cache */
+} ConnState;
+
+/* How far a chunked response body got */
+typedef enum{
+    CHUNK_NONE,     /* not chunked: Content-Length, or until EOF */
+    CHUNK_SIZE,     /* in a chunk-size line */
+    CHUNK_EXT,      /* ... past the size, in its extensions */
+    CHUNK_DATA,     /* in chunk data */
+    CHUNK_DATA_END, /* in the CRLF after the data */
+    CHUNK_TRAILER,  /* in a trailer line, or the blank line ending them */
+    CHUNK_DONE      /* the whole body is in */
+} ChunkState;
+
+typedef struct Conn Conn;
+
+/* What an epoll event points at: one end of a connection */
+typedef struct{
+    Conn *conn;
+    int server;     /* 0: client socket, 1: server socket */
+    int added;      /* already registered with epoll */
+} EventEnd;
+
+struct Conn{
+    ConnState state;
+    int epfd;
+    int client_fd;
+    int server_fd;
+    EventEnd cend;
+    EventEnd send;
+    char *in;               /* request headers read so far, then response headers */
+    size_t inlen;
+    char *rq;               /* request headers, which req points into */
+    Request *req;
+    struct iovec pr[REQ_IOV];   /* proxy request to the server */
+    int npr;
+    size_t prlen, proff;
+    CacheItem *hit;         /* pinned cache hit being sent */
+    CacheItem *stale;       /* pinned stale hit being revalidated */
+    char *cond;             /* ... with these conditional headers */
+    DiskHit dhit;           /* ... or pinned disk hit, if dhit.seg is set */
+    size_t hitoff;
+    int hdrdone;            /* response headers parsed */
+    CacheMeta meta;
+    ChunkBuf body;          /* response bytes, handed to the cache at the end */
+    char *buf;              /* last chunk read, not yet sent to the client */
+    size_t buflen, bufoff;
+    size_t relayed;         /* response bytes sent to the client */
+    int cacheable;
+    long body_left;         /* body (or chunk data) bytes still due, -1: until EOF */
+    ChunkState chunk;
+    size_t linelen;         /* bytes in the current chunked trailer line */
+    SplicePipe pipe;        /* uncacheable bytes, on their way to the client */
+    long started;           /* upstream_now() of the connect */
+    long last_io;           /* ... of the last byte relayed */
+    int tracked;            /* on the loop's upstream list */
+    Conn *prev, *next;
+    int notify_fd;          /* the loop's pipe, for resolver threads */
+    DnsAddr *addrs;         /* what a resolver thread found */
+    int naddrs;
+    int hup;                /* the client went away while resolving */
+    Conn *rnext;            /* next on the resolver queue */
+    int fetching;           /* in the loop's table of fetches */
+    unsigned int fhash;     /* ... under this hash of the key */
+    Conn *fnext;            /* next fetch in the same bucket */
+    Conn *waiters;          /* connections waiting for this fetch */
+    Conn *leader;           /* the fetch this one waits for */
+    Conn *wnext;            /* next waiting for the same fetch */
+    int inserted;           /* the response went to the cache */
+    int timed_out;          /* the origin missed a deadline before answering */
+    int closed;             /* freed after this round of events */
+};
+
+/* Connections of this loop with an origin to wait for */
+static __thread Conn *upstreams;
+/* Connections closed in this round of events: later events of the
+   round may still point at them */
+static __thread Conn *closed;
+/* Fetches of this loop, by key */
+static __thread Conn *fetches[EVENT_FETCH_BUCKETS];
+/* The loop's pipe: resolver threads write Conn pointers to [1] */
+static __thread int resolved[2];
+/* What the pipe's epoll event points at */
+static EventEnd resolved_end;
+
+/* Connections waiting for a resolver thread */
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    Conn *head, *tail;
+} resolver = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *event_loop(void *vargp);
+static void accept_clients(int epfd, int listenfd);
+static void handle_event(Conn *c, int server, unsigned int events);
+static void do_request(Conn *c);
+static void serve_request(Conn *c, int coalesce);
+static Conn *find_fetch(Conn *c);
+static void add_fetch(Conn *c);
+static Conn *end_fetch(Conn *c);
+static void start_connect(Conn *c);
+static void *resolver_thread(void *vargp);
+static void do_resolved();
+static void connect_addrs(Conn *c, DnsAddr *addrs, int n);
+static void do_connect(Conn *c);
+static void do_forward(Conn *c);
+static void do_relay_hdrs(Conn *c);
+static void do_relay_read(Conn *c);
+static void track_body(Conn *c, char *p, size_t n);
+static int body_complete(Conn *c);
+static void do_splice_read(Conn *c);
+static void do_relay_write(Conn *c);
+static int drop_client(Conn *c);
+static void do_hit(Conn *c);
+static void switch_to_hit(Conn *c);
+static void track(Conn *c);
+static void untrack(Conn *c);
+static void expire_conns();
+static void set_events(Conn *c, int server, unsigned int events);
+static void fail_conn(Conn *c, char *status);
+static void close_conn(Conn *c);
+
+// start nloops event loop threads and serve forever
+void run_event_loops(int listenfd, int nloops){
+    pthread_t tid;
+    int i;
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    for(i = 0; i < EVENT_RESOLVERS; i++){
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+    }
+    for(i = 1; i < nloops; i++){
+        Pthread_create(&tid, NULL, event_loop, (void *)(long)listenfd);
+    }
+    event_loop((void *)(long)listenfd);
+}
+
+// one epoll loop: accept new clients and advance connection state machines
+static void *event_loop(void *vargp){
+    int listenfd = (int)(long)vargp;
+    struct epoll_event ev, events[MAX_EVENTS];
+    long last_sweep = 0, now;
+    int epfd, n, i;
+    Conn *c;
+
+    if((epfd = epoll_create1(0)) < 0){
+        unix_error("epoll_create1 error");
+    }
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0){
+        unix_error("epoll_ctl error");
+    }
+    if(pipe(resolved) < 0){
+        unix_error("pipe error");
+    }
+    fcntl(resolved[0], F_SETFL, fcntl(resolved[0], F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &resolved_end;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, resolved[0], &ev) < 0){
+        unix_error("epoll_ctl error");
+    }
+    while(1){
+        // no need to wake up while no one waits on an origin
+        if((n = epoll_wait(epfd, events, MAX_EVENTS, upstreams ? EVENT_TICK : -1)) < 0){
+            if(errno == EINTR) continue;
+            unix_error("epoll_wait error");
+        }
+        for(i = 0; i < n; i++){
+            EventEnd *end = events[i].data.ptr;
+            if(end == NULL){
+                accept_clients(epfd, listenfd);
+            }else if(end == &resolved_end){
+                do_resolved();
+            }else{
+                handle_event(end->conn, end->server, events[i].events);
+            }
+        }
+        if(upstreams && (now = upstream_now()) - last_sweep >= EVENT_TICK){
+            last_sweep = now;
+            expire_conns();
+        }
+        while((c = closed) != NULL){
+            closed = c->next;
+            free(c);
+        }
+    }
+    return NULL;
+}
+// accept every pending connection as a new state machine
+static void accept_clients(int epfd, int listenfd){
+    int connfd;
+    while((connfd = accept(listenfd, NULL, NULL)) >= 0){
+        Conn *c = Calloc(1, sizeof(Conn));
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        c->state = ST_REQUEST;
+        c->epfd = epfd;
+        c->client_fd = connfd;
+        c->server_fd = -1;
+        c->notify_fd = resolved[1];
+        c->pipe.fd[0] = c->pipe.fd[1] = -1;
+        c->cend.conn = c;
+        c->cend.server = 0;
+        c->send.conn = c;
+        c->send.server = 1;
+        set_events(c, 0, EPOLLIN);
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        fprintf(stderr, "ERROR(accept_clients): %s\n", strerror(errno));
+    }
+}
+// dispatch an event on one end of a connection by state
+static void handle_event(Conn *c, int server, unsigned int events){
+    if(c->closed){
+        return;
+    }
+    if(c->state == ST_RESOLVE){
+        // (only the client can hang up) a resolver thread holds c: it
+        // is closed when handed back
+        c->hup = 1;
+        epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->client_fd, NULL);
+        c->cend.added = 0;
+        return;
+    }
+    if(events & (EPOLLERR | EPOLLHUP)){
+        // a failed connect reports through the connect path
+        if(!(server && c->state == ST_CONNECT) && (server || !drop_client(c))){
+            close_conn(c);
+            return;
+        }
+    }
+    switch(c->state){
+    case ST_REQUEST:
+        do_request(c);
+        break;
+    case ST_HIT:
+        do_hit(c);
+        break;
+    case ST_WAIT:       /* only hang-ups, handled above */
+    case ST_RESOLVE:
+        break;
+    case ST_CONNECT:
+        do_connect(c);
+        break;
+    case ST_FORWARD:
+        do_forward(c);
+        break;
+    case ST_RELAY:
+        if(server){
+            do_relay_read(c);
+        }else{
+            do_relay_write(c);
+        }
+        break;
+    }
+}
+// read request headers; once complete, serve from cache or go upstream
+static void do_request(Conn *c){
+    size_t blocklen = 0;
+    ssize_t n;
+    char *err;
+    if(c->in == NULL){
+        c->in = Malloc(MAXBUF);
+    }
+    while((n = read(c->client_fd, c->in + c->inlen, MAXBUF - c->inlen)) > 0){
+        blocklen = request_end(c->in, c->inlen + n, c->inlen);
+        c->inlen += n;
+        if(blocklen){
+            break;
+        }
+        if(c->inlen == MAXBUF){
+            fail_conn(c, "431 Request Header Fields Too Large");
+            return;
+        }
+    }
+    if(n == 0){
+        close_conn(c);
+        return;
+    }
+    if(n < 0){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            close_conn(c);
+        }
+        return;
+    }
+    // headers complete: parse them where they are, describe the proxy request
+    c->rq = c->in;
+    c->in = NULL;
+    c->inlen = 0;
+    c->req = Malloc(sizeof(Request));
+    if((err = parse_request(c->req, c->rq, blocklen)) != NULL){
+        fail_conn(c, err);
+        return;
+    }
+    serve_request(c, 1);
+}
+// answer a parsed request from a cache tier, or fetch it; with coalesce
+// set, a miss may wait for a fetch of the same object instead
+static void serve_request(Conn *c, int coalesce){
+    char cond[CACHE_COND_MAX];
+    Conn *leader;
+    int i;
+    // the cache only answers GETs: HEAD goes to the origin
+    c->hit = c->req->head ? NULL : cache_check(c->req->host, c->req->port, c->req->content);
+    if(c->hit != NULL && !cache_fresh(c->hit)){
+        // stale: revalidate it if it kept validators, else fetch it anew
+        if(!c->req->conditional && cache_validators(c->hit, cond, sizeof(cond)) > 0){
+            c->stale = c->hit;
+            c->cond = strdup(cond);
+        }else{
+            cache_release(c->hit);
+        }
+        c->hit = NULL;
+    }
+    if(c->hit != NULL || (c->stale == NULL && !c->req->head
+        && disk_check(c->req->host, c->req->port, c->req->content, &c->dhit))){
+        c->state = ST_HIT;
+        set_events(c, 0, EPOLLOUT);
+        do_hit(c);
+        return;
+    }
+    // a plain miss: one fetch of the object at a time
+    if(c->stale == NULL && !c->req->head){
+        if(coalesce && (leader = find_fetch(c)) != NULL){
+            c->state = ST_WAIT;
+            c->leader = leader;
+            c->wnext = leader->waiters;
+            leader->waiters = c;
+            // registered only for hang-ups meanwhile
+            set_events(c, 0, 0);
+            return;
+        }
+        add_fetch(c);
+    }
+    c->npr = request_iovec(c->req, 0, c->cond, c->pr);
+    for(i = 0; i < c->npr; i++){
+        c->prlen += c->pr[i].iov_len;
+    }
+    start_connect(c);
+}
+// write a cached object to the client
+static void do_hit(Conn *c){
+    static char *connhdr = "Connection: close\r\n";
+    struct iovec iov[CACHE_IOV];
+    size_t total = (c->hit ? c->hit->size : c->dhit.size) + strlen(connhdr);
+    ssize_t n;
+    int cnt;
+    while(c->hitoff < total){
+        cnt = c->hit ? cache_iovec(c->hit, connhdr, c->hitoff, iov)
+                     : disk_iovec(&c->dhit, connhdr, c->hitoff, iov);
+        n = iov_write(c->client_fd, iov, cnt, 0);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            break;
+        }
+        c->hitoff += n;
+    }
+    close_conn(c);
+}
+// send the pinned c->hit, done with the origin
+static void switch_to_hit(Conn *c){
+    // closing leaves the epoll set, so the origin hanging up cannot end us
+    if(c->server_fd >= 0){
+        close(c->server_fd);
+        c->server_fd = -1;
+        c->send.added = 0;
+    }
+    untrack(c);
+    c->state = ST_HIT;
+    set_events(c, 0, EPOLLOUT);
+    do_hit(c);
+}
+// the fetch of this loop c's miss can wait for, NULL if none
+static Conn *find_fetch(Conn *c){
+    unsigned int h = hash_key(c->req->host, c->req->port, c->req->content);
+    Conn *f;
+    for(f = fetches[h & (EVENT_FETCH_BUCKETS - 1)]; f != NULL; f = f->fnext){
+        if(f->fhash == h && !strcmp(f->req->content, c->req->content)
+            && !strcmp(f->req->host, c->req->host) && !strcmp(f->req->port, c->req->port)){
+            return f;
+        }
+    }
+    return NULL;
+}
+// c fetches its object: later misses on it wait for c
+static void add_fetch(Conn *c){
+    Conn **bucket;
+    c->fhash = hash_key(c->req->host, c->req->port, c->req->content);
+    bucket = &fetches[c->fhash & (EVENT_FETCH_BUCKETS - 1)];
+    c->fnext = *bucket;
+    *bucket = c;
+    c->fetching = 1;
+}
+// c's fetch is over: take it out of the table; returns its waiters
+static Conn *end_fetch(Conn *c){
+    Conn **pp = &fetches[c->fhash & (EVENT_FETCH_BUCKETS - 1)], *w;
+    while(*pp != c){
+        pp = &(*pp)->fnext;
+    }
+    *pp = c->fnext;
+    c->fetching = 0;
+    w = c->waiters;
+    c->waiters = NULL;
+    return w;
+}
+// open a non-blocking connection to the origin, once its name resolved
+static void start_connect(Conn *c){
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    int n;
+    // a resolver cache hit does not block the loop; a miss would
+    if((n = dns_cached(c->req->host, c->req->port, addrs)) != DNS_MISS){
+        connect_addrs(c, addrs, n);
+        return;
+    }
+    c->addrs = Malloc(DNS_MAX_ADDRS * sizeof(DnsAddr));
+    c->state = ST_RESOLVE;
+    // registered only for hang-ups meanwhile
+    set_events(c, 0, 0);
+    pthread_mutex_lock(&resolver.lock);
+    c->rnext = NULL;
+    if(resolver.tail != NULL){
+        resolver.tail->rnext = c;
+    }else{
+        resolver.head = c;
+    }
+    resolver.tail = c;
+    pthread_cond_signal(&resolver.more);
+    pthread_mutex_unlock(&resolver.lock);
+}
+// resolve the names of queued connections, and hand them back to their loop
+static void *resolver_thread(void *vargp){
+    Conn *c;
+    Pthread_detach(pthread_self());
+    while(1){
+        pthread_mutex_lock(&resolver.lock);
+        while(resolver.head == NULL){
+            pthread_cond_wait(&resolver.more, &resolver.lock);
+        }
+        c = resolver.head;
+        if((resolver.head = c->rnext) == NULL){
+            resolver.tail = NULL;
+        }
+        pthread_mutex_unlock(&resolver.lock);
+        c->naddrs = dns_lookup(c->req->host, c->req->port, c->addrs);
+        // (a pointer is written whole to a pipe)
+        if(write(c->notify_fd, &c, sizeof(c)) != sizeof(c)){
+            unix_error("resolver write error");
+        }
+    }
+    return NULL;
+}
+// connections whose names resolved, back from the resolver threads
+static void do_resolved(){
+    Conn *c;
+    while(read(resolved[0], &c, sizeof(c)) == sizeof(c)){
+        if(c->hup){
+            close_conn(c);
+        }else{
+            connect_addrs(c, c->addrs, c->naddrs);
+        }
+    }
+}
+// connect to the first of the n addresses that takes it (none if n < 0)
+static void connect_addrs(Conn *c, DnsAddr *addrs, int n){
+    int i, fd = -1;
+    if(n < 0){
+        fail_conn(c, "502 Bad Gateway");
+        return;
+    }
+    for(i = 0; i < n; i++){
+        if((fd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK, addrs[i].protocol)) < 0){
+            continue;
+        }
+        if(connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 || errno == EINPROGRESS){
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    if(fd < 0){
+        fail_conn(c, "502 Bad Gateway");
+        return;
+    }
+    c->server_fd = fd;
+    c->state = ST_CONNECT;
+    c->started = c->last_io = upstream_now();
+    track(c);
+    // the client stays registered only for hang-ups while we talk upstream
+    set_events(c, 0, 0);
+    set_events(c, 1, EPOLLOUT);
+}
+// connect finished (or failed)
+static void do_connect(Conn *c){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(c->server_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0){
+        fail_conn(c, "502 Bad Gateway");
+        return;
+    }
+    c->state = ST_FORWARD;
+    do_forward(c);
+}
+// write the proxy request to the server
+static void do_forward(Conn *c){
+    ssize_t n;
+    while(c->proff < c->prlen){
+        n = iov_write(c->server_fd, c->pr, c->npr, c->proff);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+            close_conn(c);
+            return;
+        }
+        c->proff += n;
+    }
+    c->state = ST_RELAY;
+    set_events(c, 1, EPOLLIN);
+}
+// read the response headers; the client gets them with our Connection
+// header, the cache without one
+static void do_relay_hdrs(Conn *c){
+    Response resp;
+    char hdrs[MAXBUF];
+    char *end, save;
+    size_t blocklen, rest;
+    ssize_t n;
+    int len;
+    if(c->in == NULL){
+        c->in = Malloc(MAXBUF);
+    }
+    // leave room for the Connection header added in place below
+    if((n = read(c->server_fd, c->in + c->inlen, MAXBUF - 64 - c->inlen)) < 0){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            close_conn(c);
+        }
+        return;
+    }
+    if(n == 0){
+        fail_conn(c, "502 Bad Gateway");
+        return;
+    }
+    c->last_io = upstream_now();
+    c->inlen += n;
+    c->in[c->inlen] = '\0';
+    if((end = strstr(c->in, "\r\n\r\n")) != NULL){
+        blocklen = end + 4 - c->in;
+    }else if((end = strstr(c->in, "\n\n")) != NULL){
+        blocklen = end + 2 - c->in;
+    }else{
+        if(c->inlen >= MAXBUF - 64){
+            fail_conn(c, "502 Bad Gateway");
+        }
+        return;
+    }
+    rest = c->inlen - blocklen;
+    save = c->in[blocklen];
+    c->in[blocklen] = '\0';
+    len = parse_response_hdrs(c->in, c->req->head, &resp, hdrs, sizeof(hdrs) - 64);
+    c->in[blocklen] = save;
+    if(len < 0){
+        fail_conn(c, "502 Bad Gateway");
+        return;
+    }
+    if(c->stale != NULL){
+        if(resp.status == 304){
+            // not modified: the cached copy is good for another while
+            cache_revalidated(c->stale, resp.fresh_until);
+            c->hit = c->stale;
+            c->stale = NULL;
+            switch_to_hit(c);
+            return;
+        }
+        cache_release(c->stale);
+        c->stale = NULL;
+    }
+    // what the origin no longer lets us keep must not linger stale either
+    if(response_invalidates(&resp)){
+        cache_drop(c->req->host, c->req->port, c->req->content);
+    }
+    c->hdrdone = 1;
+    c->cacheable = resp.cacheable;
+    // how the cache tells a whole body from one the origin cut short
+    c->chunk = response_has_body(&resp) && resp.chunked ? CHUNK_SIZE : CHUNK_NONE;
+    c->body_left = !response_has_body(&resp) || resp.chunked ? 0 : resp.length;
+    response_meta(&resp, len, &c->meta);
+    cb_append(&c->body, hdrs, len);
+    cb_append(&c->body, "\r\n", 2);
+    cb_append(&c->body, c->in + blocklen, rest);
+    track_body(c, c->in + blocklen, rest);
+    // rebuild c->in as what the client gets: headers, close, body so far
+    strcat(hdrs, "Connection: close\r\n\r\n");
+    memmove(c->in + strlen(hdrs), c->in + blocklen, rest);
+    memcpy(c->in, hdrs, strlen(hdrs));
+    c->buf = c->in;
+    c->buflen = strlen(hdrs) + rest;
+    c->bufoff = 0;
+    do_relay_write(c);
+}
+// read a chunk of the response from the server, straight into the body
+static void do_relay_read(Conn *c){
+    size_t avail;
+    ssize_t n;
+    char *p;
+    if(!c->hdrdone){
+        do_relay_hdrs(c);
+        return;
+    }
+    if(!c->cacheable && c->client_fd < 0){
+        close_conn(c);
+        return;
+    }
+    // nobody keeps the bytes: they need not enter the proxy at all
+    if(!c->cacheable && (c->pipe.fd[0] >= 0 || splice_open(&c->pipe) == 0)){
+        do_splice_read(c);
+        return;
+    }
+    // once too large for the cache (and without a pipe), keep reusing a single chunk
+    if(!c->cacheable){
+        cb_recycle(&c->body);
+    }
+    p = cb_reserve(&c->body, &avail);
+    if((n = read(c->server_fd, p, avail)) < 0){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            close_conn(c);
+        }
+        return;
+    }
+    if(n == 0){
+        // cache it if it stayed small enough and the origin sent all of it;
+        // a body cut short is dropped (and the waiters fetch it again)
+        if(c->cacheable && body_complete(c)){
+            insert_item(c->req->host, c->req->port, c->req->content, &c->body, &c->meta);
+            c->inserted = 1;
+        }
+        close_conn(c);
+        return;
+    }
+    c->last_io = upstream_now();
+    cb_commit(&c->body, n);
+    track_body(c, p, n);
+    // keep data only while response do not exceed the max object size
+    if(c->body.size >= cache_max_object()){
+        c->cacheable = 0;
+    }
+    c->buf = p;
+    c->buflen = n;
+    c->bufoff = 0;
+    do_relay_write(c);
+}
+// follow the framing of a cacheable response over n more body bytes
+static void track_body(Conn *c, char *p, size_t n){
+    size_t i = 0, take;
+    char ch;
+    if(!c->cacheable){
+        return;
+    }
+    while(i < n){
+        if(c->chunk == CHUNK_NONE || c->chunk == CHUNK_DATA){
+            // Content-Length or chunk data: skip what is due at once
+            if(c->body_left <= 0){
+                return;
+            }
+            take = n - i < (size_t)c->body_left ? n - i : (size_t)c->body_left;
+            c->body_left -= take;
+            i += take;
+            if(c->chunk == CHUNK_DATA && c->body_left == 0){
+                c->chunk = CHUNK_DATA_END;
+            }
+            continue;
+        }
+        ch = p[i++];
+        switch(c->chunk){
+        case CHUNK_SIZE:
+        case CHUNK_EXT:
+            if(ch == '\n'){
+                // a size of 0 is the last chunk: the trailers follow
+                c->chunk = c->body_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                c->linelen = 0;
+            }else if(c->chunk == CHUNK_SIZE && isxdigit((unsigned char)ch)){
+                // larger than any cacheable object already: stop growing
+                if(c->body_left < (1L << 40)){
+                    c->body_left = c->body_left * 16 + (isdigit((unsigned char)ch) ? ch - '0' : tolower(ch) - 'a' + 10);
+                }
+            }else if(ch != '\r'){
+                c->chunk = CHUNK_EXT;
+            }
+            break;
+        case CHUNK_DATA_END:
+            if(ch == '\n'){
+                c->chunk = CHUNK_SIZE;
+            }
+            break;
+        case CHUNK_TRAILER:
+            if(ch == '\n'){
+                if(c->linelen == 0){
+                    c->chunk = CHUNK_DONE;
+                }
+                c->linelen = 0;
+            }else if(ch != '\r'){
+                c->linelen++;
+            }
+            break;
+        default:
+            // done: anything after the body is no part of it
+            return;
+        }
+    }
+}
+// did the whole body arrive? (one without framing ends at EOF)
+static int body_complete(Conn *c){
+    return c->chunk == CHUNK_NONE ? c->body_left <= 0 : c->chunk == CHUNK_DONE;
+}
+// move a piece of an uncacheable response from the server into the pipe
+static void do_splice_read(Conn *c){
+    ssize_t n;
+    if((n = splice_in(&c->pipe, c->server_fd, SPLICE_CHUNK, 1)) < 0){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            close_conn(c);
+        }
+        return;
+    }
+    if(n == 0){
+        close_conn(c);
+        return;
+    }
+    c->last_io = upstream_now();
+    do_relay_write(c);
+}
+// send buffered (or piped) response bytes; pause the server while the
+// client is slow
+static void do_relay_write(Conn *c){
+    ssize_t n;
+    while(c->bufoff < c->buflen && c->client_fd >= 0){
+        n = write(c->client_fd, c->buf + c->bufoff, c->buflen - c->bufoff);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+                set_events(c, 1, 0);
+                set_events(c, 0, EPOLLOUT);
+                return;
+            }
+            if(!drop_client(c)){
+                close_conn(c);
+            }
+            return;
+        }
+        c->bufoff += n;
+        c->relayed += n;
+        c->last_io = upstream_now();
+    }
+    while(c->pipe.len > 0){
+        if((n = splice_out(&c->pipe, c->client_fd, 1)) < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+                set_events(c, 1, 0);
+                set_events(c, 0, EPOLLOUT);
+                return;
+            }
+            close_conn(c);
+            return;
+        }
+        c->relayed += n;
+        c->last_io = upstream_now();
+    }
+    if(c->client_fd >= 0){
+        set_events(c, 0, 0);
+    }
+    set_events(c, 1, EPOLLIN);
+}
+// the client of a relay went away: while others wait for the object,
+// read the rest of it for them (returns 1), else give up (returns 0)
+static int drop_client(Conn *c){
+    if(c->state != ST_RELAY || c->waiters == NULL || (c->hdrdone && !c->cacheable)){
+        return 0;
+    }
+    close(c->client_fd);
+    c->client_fd = -1;
+    c->cend.added = 0;
+    c->buflen = c->bufoff = 0;
+    set_events(c, 1, EPOLLIN);
+    return 1;
+}
+// put a connection that waits on its origin on the loop's list
+static void track(Conn *c){
+    c->prev = NULL;
+    c->next = upstreams;
+    if(upstreams != NULL){
+        upstreams->prev = c;
+    }
+    upstreams = c;
+    c->tracked = 1;
+}
+// take it off again
+static void untrack(Conn *c){
+    if(!c->tracked){
+        return;
+    }
+    if(c->prev != NULL){
+        c->prev->next = c->next;
+    }else{
+        upstreams = c->next;
+    }
+    if(c->next != NULL){
+        c->next->prev = c->prev;
+    }
+    c->tracked = 0;
+}
+// give up on origins that missed a deadline
+static void expire_conns(){
+    UpstreamTimeouts *t = &upstream_timeouts;
+    long now = upstream_now();
+    Conn *c, *next;
+    int late;
+    for(c = upstreams; c != NULL; c = next){
+        next = c->next;
+        if(c->state == ST_CONNECT){
+            late = t->connect && now - c->started >= t->connect * 1000L;
+        }else{
+            late = (t->read && now - c->last_io >= t->read * 1000L)
+                || (t->response && now - c->started >= t->response * 1000L);
+        }
+        if(!late){
+            continue;
+        }
+        // past the headers, the client cannot be told any more
+        if(c->hdrdone){
+            close_conn(c);
+        }else{
+            c->timed_out = 1;
+            fail_conn(c, "504 Gateway Timeout");
+        }
+    }
+}
+// (re)register interest in one end of a connection
+static void set_events(Conn *c, int server, unsigned int events){
+    struct epoll_event ev;
+    EventEnd *end = server ? &c->send : &c->cend;
+    int fd = server ? c->server_fd : c->client_fd;
+    ev.events = events;
+    ev.data.ptr = end;
+    if(epoll_ctl(c->epfd, end->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == 0){
+        end->added = 1;
+    }
+}
+// answer the client with an error status and close
+static void fail_conn(Conn *c, char *status){
+    char buf[MAXLINE];
+    // the origin failed us: a stale copy beats an error, unless it must not
+    if(c->stale != NULL && !(c->stale->meta.flags & META_MUST_REVALIDATE)){
+        c->hit = c->stale;
+        c->stale = NULL;
+        switch_to_hit(c);
+        return;
+    }
+    int len = snprintf(buf, sizeof(buf),
+        "HTTP/1.0 %s\r\nContent-length: 0\r\nConnection: close\r\n\r\n", status);
+    // best effort: the client socket is non-blocking
+    rio_writen(c->client_fd, buf, len);
+    close_conn(c);
+}
+// tear down a connection and everything it holds; the ones waiting for
+// its fetch go on
+static void close_conn(Conn *c){
+    Conn *w = NULL, **pp, *next;
+    int inserted = c->inserted, timed_out = c->timed_out;
+    if(c->fetching){
+        w = end_fetch(c);
+    }
+    if(c->leader != NULL){
+        for(pp = &c->leader->waiters; *pp != c; pp = &(*pp)->wnext)
+            ;
+        *pp = c->wnext;
+    }
+    untrack(c);
+    if(c->relayed){
+        cache_count_miss(c->relayed);
+    }
+    if(c->client_fd >= 0){
+        close(c->client_fd);
+    }
+    if(c->server_fd >= 0){
+        close(c->server_fd);
+    }
+    if(c->hit){
+        cache_release(c->hit);
+    }
+    if(c->stale){
+        cache_release(c->stale);
+    }
+    if(c->dhit.seg){
+        disk_release(&c->dhit);
+    }
+    free(c->in);
+    free(c->rq);
+    free(c->req);
+    free(c->cond);
+    free(c->addrs);
+    splice_close(&c->pipe);
+    cb_free(&c->body);
+    c->closed = 1;
+    c->next = closed;
+    closed = c;
+    // the first to miss again fetches it for the others, unless it did
+    // not go to the cache this time
+    for(; w != NULL; w = next){
+        next = w->wnext;
+        w->leader = NULL;
+        if(timed_out){
+            fail_conn(w, "504 Gateway Timeout");
+        }else{
+            serve_request(w, inserted);
+        }
+    }
+}
@@ -0,0 +1,9 @@
+/*
+ * event.h - event-driven (epoll) run mode of the proxy
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void run_event_loops(int listenfd, int nloops);
+
+#endif /* __EVENT_H__ */
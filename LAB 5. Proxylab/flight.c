@@ -0,0 +1,248 @@
+/*
+ * flight.c - coalescing of concurrent cache misses (single flight)
+ *
+ * The first client to miss on an object becomes the leader of a flight
+ * and fetches it from the origin into the flight's body. Clients that
+ * miss on the same object meanwhile join the flight as followers
+ * instead of opening connections of their own:
+ *
+ *   - if the response is known to fit the cache (Content-Length, or no
+ *     body), followers stream the bytes as the leader commits them;
+ *   - otherwise they wait for the end: a cacheable response is then
+ *     sent whole, anything else makes them fetch on their own, except
+ *     an origin that timed out, which they do not wait for again.
+ *
+ * The body only grows while followers read it, and it goes to the cache
+ * when the last client lets go of the flight. The flight stays in the
+ * table until then, so late arrivals are served from it as well.
+ */
+#include "flight.h"
+#include "hash.h"
+
+static struct{
+    pthread_mutex_t lock;
+    Flight *buckets[FLIGHT_BUCKETS];
+} table;
+
+static char *keepalive_hdr = "Connection: keep-alive\r\n";
+static char *close_hdr = "Connection: close\r\n";
+
+static void unregister(Flight *f);
+static void unlink_flight(Flight *f);
+
+// initialize the in-flight table
+void flight_init(){
+    pthread_mutex_init(&table.lock, NULL);
+    memset(table.buckets, 0, sizeof(table.buckets));
+}
+/*
+ * flight_join - attach to the flight for an object, or start one.
+ *     Returns NULL with *hit pinned if the object made it into the cache
+ *     in the meantime; otherwise a flight, with *leader telling whether
+ *     the caller has to fetch it.
+ */
+Flight *flight_join(char *host, char *port, char *content, int *leader, CacheItem **hit){
+    unsigned int h = hash_key(host, port, content);
+    Flight *f;
+
+    *hit = NULL;
+    *leader = 0;
+    pthread_mutex_lock(&table.lock);
+    for(f = table.buckets[h & (FLIGHT_BUCKETS - 1)]; f != NULL; f = f->next){
+        if(f->hash == h && !strcmp(f->host, host) && !strcmp(f->port, port)
+            && !strcmp(f->content, content)){
+            f->refcnt++;
+            pthread_mutex_unlock(&table.lock);
+            return f;
+        }
+    }
+    // a flight that just finished may have been cached meanwhile: check again
+    if((*hit = cache_peek(host, port, content)) != NULL){
+        if(cache_fresh(*hit)){
+            pthread_mutex_unlock(&table.lock);
+            return NULL;
+        }
+        cache_release(*hit);
+        *hit = NULL;
+    }
+    f = Malloc(sizeof(Flight));
+    snprintf(f->host, sizeof(f->host), "%s", host);
+    snprintf(f->port, sizeof(f->port), "%s", port);
+    snprintf(f->content, sizeof(f->content), "%s", content);
+    f->hash = h;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->more, NULL);
+    cb_init(&f->body);
+    memset(&f->meta, 0, sizeof(f->meta));
+    f->state = FLIGHT_RUNNING;
+    f->streamable = 0;
+    f->timedout = 0;
+    f->refcnt = 1;
+    f->registered = 1;
+    f->next = table.buckets[h & (FLIGHT_BUCKETS - 1)];
+    table.buckets[h & (FLIGHT_BUCKETS - 1)] = f;
+    pthread_mutex_unlock(&table.lock);
+    *leader = 1;
+    return f;
+}
+// leader: free space at the end of the body (see cb_reserve)
+char *flight_reserve(Flight *f, size_t *avail){
+    char *p;
+    pthread_mutex_lock(&f->lock);
+    p = cb_reserve(&f->body, avail);
+    pthread_mutex_unlock(&f->lock);
+    return p;
+}
+// leader: publish n bytes written into the reserved space
+void flight_commit(Flight *f, size_t n){
+    pthread_mutex_lock(&f->lock);
+    cb_commit(&f->body, n);
+    if(f->streamable){
+        pthread_cond_broadcast(&f->more);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+// leader: publish a copy of n bytes
+void flight_append(Flight *f, const void *data, size_t n){
+    pthread_mutex_lock(&f->lock);
+    cb_append(&f->body, data, n);
+    if(f->streamable){
+        pthread_cond_broadcast(&f->more);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+/*
+ * flight_share - leader, once the headers are in the body: share > 0
+ *     lets followers stream now, 0 makes them wait for the end, and
+ *     share < 0 (too large for the cache) sends them off on their own.
+ */
+void flight_share(Flight *f, CacheMeta *meta, int share){
+    pthread_mutex_lock(&f->lock);
+    f->meta = *meta;
+    if(share > 0){
+        f->streamable = 1;
+    }else if(share < 0){
+        f->state = FLIGHT_FAILED;
+    }
+    pthread_cond_broadcast(&f->more);
+    pthread_mutex_unlock(&f->lock);
+    if(share < 0){
+        unregister(f);
+    }
+}
+// leader: the fetch is over; ok if the whole response is in the body
+void flight_finish(Flight *f, int ok){
+    pthread_mutex_lock(&f->lock);
+    if(f->state == FLIGHT_RUNNING){
+        f->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+        if(ok){
+            f->streamable = 1;
+        }
+    }
+    pthread_cond_broadcast(&f->more);
+    pthread_mutex_unlock(&f->lock);
+    if(f->state == FLIGHT_FAILED){
+        unregister(f);
+    }
+}
+// leader: the origin missed a deadline before the response got going
+void flight_timeout(Flight *f){
+    pthread_mutex_lock(&f->lock);
+    f->timedout = 1;
+    pthread_mutex_unlock(&f->lock);
+    flight_finish(f, 0);
+}
+/*
+ * flight_follow - follower: send the leader's response to fd as it
+ *     arrives. Returns 1 if the client connection may stay open, 0 if
+ *     it must close, -1 if nothing was sent and the caller should fetch
+ *     the object itself, -2 if nothing was sent because the origin
+ *     timed out on the leader.
+ */
+int flight_follow(Flight *f, int fd, int keep_alive){
+    struct iovec iov[CACHE_IOV];
+    size_t sent;
+    int i, n, keep;
+
+    pthread_mutex_lock(&f->lock);
+    while(!f->streamable && f->state != FLIGHT_FAILED){
+        pthread_cond_wait(&f->more, &f->lock);
+    }
+    if(!f->streamable){
+        n = f->timedout ? -2 : -1;
+        pthread_mutex_unlock(&f->lock);
+        return n;
+    }
+    // headers with our own Connection header first, like a cache hit
+    keep = keep_alive && f->meta.framed;
+    n = cb_iovec(&f->body, 0, f->meta.hdr_len, iov, CACHE_IOV - 1);
+    iov[n].iov_base = keep ? keepalive_hdr : close_hdr;
+    iov[n].iov_len = strlen(iov[n].iov_base);
+    n++;
+    sent = f->meta.hdr_len;
+    while(1){
+        pthread_mutex_unlock(&f->lock);
+        if(iov_writen(fd, iov, n) < 0){
+            cache_count_miss(sent);
+            return 0;
+        }
+        pthread_mutex_lock(&f->lock);
+        // sleep until the leader commits more or ends the flight
+        while(sent == f->body.size && f->state == FLIGHT_RUNNING){
+            pthread_cond_wait(&f->more, &f->lock);
+        }
+        if(sent == f->body.size){
+            break;
+        }
+        // published bytes never move, so they can be written unlocked
+        n = cb_iovec(&f->body, sent, f->body.size - sent, iov, CACHE_IOV);
+        for(i = 0; i < n; i++){
+            sent += iov[i].iov_len;
+        }
+    }
+    // a failed leader left the response cut short
+    if(f->state != FLIGHT_DONE){
+        keep = 0;
+    }
+    pthread_mutex_unlock(&f->lock);
+    cache_count_miss(sent);
+    return keep;
+}
+// let go of a flight; the last one out hands a finished body to the cache
+void flight_release(Flight *f){
+    pthread_mutex_lock(&table.lock);
+    if(--f->refcnt > 0){
+        pthread_mutex_unlock(&table.lock);
+        return;
+    }
+    unlink_flight(f);
+    pthread_mutex_unlock(&table.lock);
+    // outside the table lock: the insert may spill to disk, and misses
+    // on other objects must not wait for that. One on this object in
+    // between fetches it again.
+    if(f->state == FLIGHT_DONE){
+        insert_item(f->host, f->port, f->content, &f->body, &f->meta);
+    }
+    cb_free(&f->body);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->more);
+    free(f);
+}
+
+// take a failed flight out of the table so new misses start afresh
+static void unregister(Flight *f){
+    pthread_mutex_lock(&table.lock);
+    unlink_flight(f);
+    pthread_mutex_unlock(&table.lock);
+}
+// remove f from its bucket if still there (table lock held)
+static void unlink_flight(Flight *f){
+    Flight **pp;
+    if(!f->registered) return;
+    pp = &table.buckets[f->hash & (FLIGHT_BUCKETS - 1)];
+    while(*pp != f){
+        pp = &(*pp)->next;
+    }
+    *pp = f->next;
+    f->registered = 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * flight.h - coalescing of concurrent cache misses (single flight)
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Number of hash buckets of the in-flight table (power of two) */
+#define FLIGHT_BUCKETS 256
+
+typedef enum{
+    FLIGHT_RUNNING,     /* the leader is still fetching */
+    FLIGHT_DONE,        /* complete and cacheable; body is final */
+    FLIGHT_FAILED       /* error or uncacheable; followers fetch alone */
+} FlightState;
+
+/* One origin fetch that several clients of the same object wait on */
+typedef struct Flight{
+    char host[200];
+    char port[10];
+    char content[1000];
+    unsigned int hash;
+    pthread_mutex_t lock;
+    pthread_cond_t more;        /* signalled when bytes or state change */
+    ChunkBuf body;              /* response as the cache will store it */
+    CacheMeta meta;
+    FlightState state;
+    int streamable;             /* followers may send body bytes as they come */
+    int timedout;               /* failed because the origin missed a deadline */
+    int refcnt;                 /* leader and followers; under the table lock */
+    int registered;             /* still found by flight_join */
+    struct Flight *next;
+} Flight;
+
+void flight_init();
+Flight *flight_join(char *host, char *port, char *content, int *leader, CacheItem **hit);
+char *flight_reserve(Flight *f, size_t *avail);
+void flight_commit(Flight *f, size_t n);
+void flight_append(Flight *f, const void *data, size_t n);
+void flight_share(Flight *f, CacheMeta *meta, int share);
+void flight_finish(Flight *f, int ok);
+void flight_timeout(Flight *f);
+int flight_follow(Flight *f, int fd, int keep_alive);
+void flight_release(Flight *f);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,30 @@
+/*
+ * hash.h - FNV-1a string hashes for the hash tables
+ *
+ * Every table (cache, flights, event-loop fetches, upstream pool,
+ * resolver, origins, disk index, and Tiny's file cache) hashes its
+ * keys with these, so the same object or origin always gets the same
+ * hash: "host:port" for an origin, followed by the content for an
+ * object.
+ */
+#ifndef __HASH_H__
+#define __HASH_H__
+
+/* FNV-1a offset basis: the hash of nothing */
+#define HASH_INIT 2166136261u
+
+/* h with the bytes of the string s folded in */
+static inline unsigned int hash_str(unsigned int h, const char *s){
+    for(; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+/* An origin: "host:port" */
+static inline unsigned int hash_origin(const char *host, const char *port){
+    return hash_str(hash_str(hash_str(HASH_INIT, host), ":"), port);
+}
+/* An object: "host:port" followed by the path */
+static inline unsigned int hash_key(const char *host, const char *port, const char *content){
+    return hash_str(hash_origin(host, port), content);
+}
+
+#endif /* __HASH_H__ */
@@ -0,0 +1,331 @@
+/*
+ * http.c - HTTP/1.x response framing for the proxy
+ *
+ * To reuse an origin connection, or keep a client connection open, the
+ * proxy has to know where a response ends, so the status line and
+ * headers are parsed for Content-Length, chunked transfer coding and the
+ * origin's keep-alive decision. Connection headers are hop-by-hop: they
+ * are stripped here and each side gets the proxy's own.
+ *
+ * The caching headers are parsed on the way as well: Cache-Control,
+ * Expires, Date and Age decide whether and how long the response may be
+ * cached, and where ETag and Last-Modified are is noted, so the cache
+ * can revalidate it later.
+ */
+#include "http.h"
+
+/* What to do with one response header line */
+#define HDR_KEEP  1     /* pass it on */
+#define HDR_DROP  0     /* hop-by-hop, the proxy decides */
+#define HDR_END   2     /* blank line */
+#define HDR_BAD  -1     /* not an HTTP/1.x status line */
+
+static void response_init(Response *resp, int head);
+static int response_line(Response *resp, char *buf, int first, size_t at);
+static void response_done(Response *resp);
+static int has_token(char *s, char *tok);
+static void cache_control(Response *resp, char *v);
+static time_t http_date(char *v);
+static char *header_value(char *buf, size_t namelen, size_t *len);
+
+/*
+ * read_response_hdrs - read the status line and headers from the origin
+ *     and parse the framing. The lines are copied to hdrs without the
+ *     hop-by-hop connection headers and without the blank line, so the
+ *     caller can add its own Connection header. head: the request was
+ *     a HEAD, so the response ends with its headers.
+ *     Returns their length, 0 on EOF before any byte, -1 on error.
+ */
+int read_response_hdrs(rio_t *rp, int head, Response *resp, char *hdrs, size_t size){
+    char buf[MAXLINE];
+    size_t len = 0;
+    ssize_t n;
+    int first = 1, rc = HDR_BAD;
+
+    response_init(resp, head);
+    while((n = rio_readlineb(rp, buf, MAXLINE)) > 0){
+        if((rc = response_line(resp, buf, first, len)) == HDR_BAD){
+            return -1;
+        }
+        first = 0;
+        if(rc == HDR_END){
+            break;
+        }
+        if(rc == HDR_KEEP){
+            if(len + n + 1 > size) return -1;
+            memcpy(hdrs + len, buf, n);
+            len += n;
+        }
+    }
+    if(n < 0) return -1;
+    if(first) return 0;
+    if(rc != HDR_END) return -1;   /* EOF inside the headers */
+    hdrs[len] = '\0';
+    response_done(resp);
+    return len;
+}
+/*
+ * parse_response_hdrs - same as read_response_hdrs for a header block
+ *     already in memory (up to and including the blank line).
+ */
+int parse_response_hdrs(char *block, int head, Response *resp, char *hdrs, size_t size){
+    char buf[MAXLINE];
+    char *line = block, *end;
+    size_t len = 0, n;
+    int first = 1, rc = HDR_BAD;
+
+    response_init(resp, head);
+    while(*line){
+        end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+        if((n = end - line) >= MAXLINE) return -1;
+        memcpy(buf, line, n);
+        buf[n] = '\0';
+        line = end;
+        if((rc = response_line(resp, buf, first, len)) == HDR_BAD){
+            return -1;
+        }
+        first = 0;
+        if(rc == HDR_END){
+            break;
+        }
+        if(rc == HDR_KEEP){
+            if(len + n + 1 > size) return -1;
+            memcpy(hdrs + len, buf, n);
+            len += n;
+        }
+    }
+    if(rc != HDR_END) return -1;
+    hdrs[len] = '\0';
+    response_done(resp);
+    return len;
+}
+// responses to HEAD, and 1xx, 204 and 304 responses never carry a body
+int response_has_body(Response *resp){
+    return !(resp->head || resp->status / 100 == 1 || resp->status == 204 || resp->status == 304);
+}
+// does the response tell the cache to forget the object it holds? only a
+// final 2xx or 3xx that may not be stored does: errors, partial content
+// and a 304 to the client's own validators say nothing about it
+int response_invalidates(Response *resp){
+    return !resp->head && resp->no_store && (resp->status / 100 == 2 || resp->status / 100 == 3)
+        && resp->status != 206 && resp->status != 304;
+}
+// what the cache keeps about the response, whose headers are hdr_len bytes
+void response_meta(Response *resp, size_t hdr_len, CacheMeta *meta){
+    meta->hdr_len = hdr_len;
+    meta->framed = resp->framed;
+    meta->flags = (resp->must_revalidate ? META_MUST_REVALIDATE : 0) | (resp->no_cache ? META_NO_CACHE : 0);
+    meta->expires = resp->fresh_until;
+    // (the headers are shorter than MAXBUF, so offsets fit)
+    meta->etag = resp->etag;
+    meta->etag_len = resp->etag_len;
+    meta->modified = resp->modified;
+    meta->modified_len = resp->modified_len;
+}
+/*
+ * rio_readsome - read at most n bytes: whatever is left in the rio buffer,
+ *     or else a single read() straight into usrbuf (no extra copy).
+ *     Returns bytes read, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readsome(rio_t *rp, void *usrbuf, size_t n){
+    ssize_t rc;
+    if(rp->rio_cnt > 0){
+        rc = n < rp->rio_cnt ? n : rp->rio_cnt;
+        memcpy(usrbuf, rp->rio_bufptr, rc);
+        rp->rio_bufptr += rc;
+        rp->rio_cnt -= rc;
+        return rc;
+    }
+    while((rc = read(rp->rio_fd, usrbuf, n)) < 0 && errno == EINTR)
+        ;
+    return rc;
+}
+// reset framing before the status line
+static void response_init(Response *resp, int head){
+    resp->status = 0;
+    resp->head = head;
+    resp->minor = 0;
+    resp->length = -1;
+    resp->chunked = 0;
+    resp->framed = 0;
+    resp->keep_alive = 0;
+    resp->conn[0] = '\0';
+    resp->max_age = resp->s_maxage = -1;
+    resp->age = 0;
+    resp->date = resp->expires = resp->last_modified = -1;
+    resp->no_store = resp->no_cache = resp->must_revalidate = 0;
+    resp->etag = resp->etag_len = resp->modified = resp->modified_len = 0;
+    resp->cacheable = 0;
+    resp->fresh_until = 0;
+}
+// parse one line of the response head, to be kept at offset at
+static int response_line(Response *resp, char *buf, int first, size_t at){
+    char *v;
+    size_t len;
+    if(first){
+        if(sscanf(buf, "HTTP/1.%d %d", &resp->minor, &resp->status) != 2){
+            return HDR_BAD;
+        }
+    }else if(!strcmp(buf, "\r\n") || !strcmp(buf, "\n")){
+        return HDR_END;
+    }else if(!strncasecmp(buf, "Content-Length:", 15)){
+        resp->length = atol(buf + 15);
+    }else if(!strncasecmp(buf, "Transfer-Encoding:", 18)){
+        resp->chunked = has_token(buf + 18, "chunked");
+    }else if(!strncasecmp(buf, "Connection:", 11)){
+        sscanf(buf + 11, " %31s", resp->conn);
+        return HDR_DROP;
+    }else if(!strncasecmp(buf, "Keep-Alive:", 11) || !strncasecmp(buf, "Proxy-Connection:", 17)){
+        return HDR_DROP;
+    }else if(!strncasecmp(buf, "Cache-Control:", 14)){
+        cache_control(resp, buf + 14);
+    }else if(!strncasecmp(buf, "Pragma:", 7)){
+        resp->no_cache |= has_token(buf + 7, "no-cache");
+    }else if(!strncasecmp(buf, "Expires:", 8)){
+        // an invalid date means already expired
+        if((resp->expires = http_date(header_value(buf, 8, &len))) < 0){
+            resp->expires = 0;
+        }
+    }else if(!strncasecmp(buf, "Date:", 5)){
+        resp->date = http_date(header_value(buf, 5, &len));
+    }else if(!strncasecmp(buf, "Age:", 4)){
+        resp->age = atol(buf + 4);
+    }else if(!strncasecmp(buf, "Set-Cookie:", 11)){
+        resp->no_store = 1;
+    }else if(!strncasecmp(buf, "ETag:", 5)){
+        v = header_value(buf, 5, &len);
+        resp->etag = at + (v - buf);
+        resp->etag_len = len;
+    }else if(!strncasecmp(buf, "Last-Modified:", 14)){
+        v = header_value(buf, 14, &len);
+        resp->last_modified = http_date(v);
+        resp->modified = at + (v - buf);
+        resp->modified_len = len;
+    }
+    return HDR_KEEP;
+}
+// framing and the origin's keep-alive decision, once all headers are in
+static void response_done(Response *resp){
+    time_t now = time(NULL), base;
+    long lifetime;
+    int explicit;
+    resp->framed = !response_has_body(resp) || resp->chunked || resp->length >= 0;
+    // 1.1 persists unless told otherwise, 1.0 the reverse
+    if(resp->minor >= 1){
+        resp->keep_alive = strcasecmp(resp->conn, "close") != 0;
+    }else{
+        resp->keep_alive = strcasecmp(resp->conn, "keep-alive") == 0;
+    }
+    // without framing the body runs until EOF
+    if(!resp->framed){
+        resp->keep_alive = 0;
+    }
+
+    // cacheable: statuses cacheable by default, or anything with an
+    // explicit lifetime; never 206 (the key has no range) or 304 (an
+    // answer to someone's validators)
+    explicit = resp->s_maxage >= 0 || resp->max_age >= 0 || resp->expires >= 0;
+    switch(resp->status){
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        resp->cacheable = 1;
+        break;
+    default:
+        resp->cacheable = explicit && resp->status != 206 && resp->status != 304;
+    }
+    // the headers alone are no answer to the GET the cache key stands for
+    if(resp->no_store || resp->head){
+        resp->cacheable = 0;
+    }
+    // freshness lifetime, counted from the origin's clock where it says
+    base = resp->date >= 0 ? resp->date : now;
+    if(resp->s_maxage >= 0){
+        lifetime = resp->s_maxage;
+    }else if(resp->max_age >= 0){
+        lifetime = resp->max_age;
+    }else if(resp->expires >= 0){
+        lifetime = resp->expires - base;
+    }else if(resp->last_modified >= 0 && resp->last_modified <= base){
+        lifetime = (base - resp->last_modified) / 10;
+        if(lifetime > HTTP_HEURISTIC_MAX){
+            lifetime = HTTP_HEURISTIC_MAX;
+        }
+    }else{
+        lifetime = HTTP_DEFAULT_TTL;
+    }
+    if(resp->no_cache || lifetime < 0){
+        lifetime = 0;
+    }
+    resp->fresh_until = now + lifetime - (resp->age > 0 ? resp->age : 0);
+}
+// case-insensitive search for tok in s
+static int has_token(char *s, char *tok){
+    size_t n = strlen(tok);
+    for(; *s; s++){
+        if(!strncasecmp(s, tok, n)) return 1;
+    }
+    return 0;
+}
+// the directives of a Cache-Control header that matter to a shared cache
+// (v is left as it is: the line is forwarded)
+static void cache_control(Response *resp, char *v){
+    char *d, *arg;
+    size_t n;
+    for(d = v; *d; d += n){
+        d += strspn(d, ", \t\r\n");
+        n = strcspn(d, ", \t\r\n=");
+        arg = d[n] == '=' ? d + n + 1 + (d[n + 1] == '"') : NULL;
+        if(n == 8 && !strncasecmp(d, "no-store", 8)){
+            resp->no_store = 1;
+        }else if(n == 7 && !strncasecmp(d, "private", 7)){
+            resp->no_store = 1;
+        }else if(n == 8 && !strncasecmp(d, "no-cache", 8)){
+            resp->no_cache = 1;
+        }else if((n == 15 && !strncasecmp(d, "must-revalidate", 15))
+            || (n == 16 && !strncasecmp(d, "proxy-revalidate", 16))){
+            resp->must_revalidate = 1;
+        }else if(arg && n == 7 && !strncasecmp(d, "max-age", 7)){
+            resp->max_age = atol(arg);
+        }else if(arg && n == 8 && !strncasecmp(d, "s-maxage", 8)){
+            resp->s_maxage = atol(arg);
+        }
+        // skip an argument, quoted ones with their commas
+        if(d[n] == '='){
+            n++;
+            if(d[n] == '"'){
+                arg = strchr(d + n + 1, '"');
+                n = arg ? arg + 1 - d : strlen(d);
+            }else{
+                n += strcspn(d + n, ", \t\r\n");
+            }
+        }
+    }
+}
+// an HTTP date (IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT"), -1 if it is none
+static time_t http_date(char *v){
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4], *m;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if(sscanf(v, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, mon, &tm.tm_year,
+        &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 || strlen(mon) != 3
+        || (m = strstr(months, mon)) == NULL || (m - months) % 3){
+        return -1;
+    }
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+// the value of a header line whose name (and colon) take namelen bytes,
+// without surrounding blanks; *len is its length
+static char *header_value(char *buf, size_t namelen, size_t *len){
+    char *v = buf + namelen, *end;
+    while(*v == ' ' || *v == '\t'){
+        v++;
+    }
+    for(end = v + strlen(v); end > v && isspace((unsigned char)end[-1]); end--)
+        ;
+    *len = end - v;
+    return v;
+}
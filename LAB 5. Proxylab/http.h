@@ -0,0 +1,49 @@
+/*
+ * http.h - HTTP/1.x response framing for the proxy
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Seconds a response without Cache-Control or Expires stays fresh ... */
+#define HTTP_DEFAULT_TTL 300
+/* ... or, with Last-Modified, a tenth of its age, up to this */
+#define HTTP_HEURISTIC_MAX 86400
+
+/* Framing and caching of a response, from its status line and headers */
+typedef struct{
+    int status;
+    int minor;          /* HTTP/1.<minor> */
+    int head;           /* answers a HEAD request: no body, whatever it says */
+    long length;        /* Content-Length, -1 if absent */
+    int chunked;        /* Transfer-Encoding: chunked */
+    int framed;         /* the end of the body is known without EOF */
+    int keep_alive;     /* origin keeps the connection open afterwards */
+    char conn[32];      /* value of the Connection header */
+    /* caching headers */
+    long max_age;       /* Cache-Control: max-age and s-maxage, -1 if absent */
+    long s_maxage;
+    long age;           /* Age, seconds the response spent in caches */
+    time_t date;        /* Date, Expires and Last-Modified, -1 if absent */
+    time_t expires;     /* (an Expires that is no date is 0: expired) */
+    time_t last_modified;
+    int no_store;       /* no-store, private or Set-Cookie: not for a shared cache */
+    int no_cache;       /* may be stored, but revalidated before every use */
+    int must_revalidate;
+    size_t etag, etag_len;          /* validators, as offsets of their values */
+    size_t modified, modified_len;  /* in the copied headers; 0 length if absent */
+    /* what response_done makes of them */
+    int cacheable;
+    time_t fresh_until;
+} Response;
+
+int read_response_hdrs(rio_t *rp, int head, Response *resp, char *hdrs, size_t size);
+int parse_response_hdrs(char *block, int head, Response *resp, char *hdrs, size_t size);
+int response_has_body(Response *resp);
+int response_invalidates(Response *resp);
+void response_meta(Response *resp, size_t hdr_len, CacheMeta *meta);
+ssize_t rio_readsome(rio_t *rp, void *usrbuf, size_t n);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,315 @@
+/*
+ * origin.c - per-origin limits on requests in flight, fairly scheduled
+ *
+ * A fetch takes a slot of its origin before it goes upstream and gives
+ * it back when the response is through, so a slow origin cannot hold
+ * more than limits.per_origin workers in fetches. A request that finds
+ * no slot waits in its origin's FIFO queue; one that finds the queue
+ * full (limits.queue), or waits longer than ORIGIN_QUEUE_TIMEOUT, is
+ * turned away and its client gets a 503, which frees the worker.
+ *
+ * limits.total caps the fetches in flight to all origins together.
+ * Freed slots go round-robin over the origins with waiting requests:
+ * the scheduler keeps them on a ring and, after granting one request
+ * of an origin, moves on to the next, so an origin with a long queue
+ * gets no more turns than one with a single waiting request.
+ *
+ * An origin with nothing in flight or queued goes on an idle list and
+ * stays in the table with its statistics (origin_report) until it is
+ * used again, or until it is the oldest of more than ORIGIN_IDLE_MAX
+ * idle origins: then it is freed, its counts added to those of the
+ * retired origins, so a proxy that sees many origins does not grow.
+ */
+#include "origin.h"
+#include "hash.h"
+
+static struct{
+    pthread_mutex_t lock;
+    int enabled;                /* origin_init was called */
+    Origin *buckets[ORIGIN_BUCKETS];
+    OriginLimits limits;
+    int inflight;               /* over all origins */
+    int count;                  /* origins in the table */
+    Origin *ring;               /* origin to be served next */
+    Origin *idle_head;          /* idle origins, least recently used first */
+    Origin *idle_tail;
+    int nidle;
+    long retired;               /* origins freed, and their counts */
+    long retired_requests;
+    long retired_waited;
+    long retired_rejected;
+} sched = {PTHREAD_MUTEX_INITIALIZER};
+
+static Origin *find_origin(char *host, char *port);
+static int has_slot(Origin *o);
+static void grant(Origin *o);
+static void dispatch();
+static void ring_add(Origin *o);
+static void ring_remove(Origin *o);
+static void check_idle(Origin *o);
+static void idle_remove(Origin *o);
+static void retire(Origin *o);
+static long now_ms();
+
+// initialize the table with these limits (0: no limit)
+void origin_init(int per_origin, int queue, int total){
+    pthread_mutex_lock(&sched.lock);
+    sched.limits.per_origin = per_origin;
+    sched.limits.queue = queue;
+    sched.limits.total = total;
+    sched.enabled = 1;
+    pthread_mutex_unlock(&sched.lock);
+}
+/*
+ * origin_acquire - take a slot for a fetch from host:port, waiting in
+ *     the origin's queue if there is none. Returns the origin, to be
+ *     given to origin_release, or NULL if the request was turned away.
+ */
+Origin *origin_acquire(char *host, char *port){
+    OriginWaiter w, *p, *prev = NULL;
+    struct timespec ts;
+    long start, waited;
+    Origin *o;
+    int rc = 0;
+
+    pthread_mutex_lock(&sched.lock);
+    o = find_origin(host, port);
+    // nobody ahead of us: go
+    if(o->head == NULL && has_slot(o)){
+        o->inflight++;
+        sched.inflight++;
+        o->requests++;
+        pthread_mutex_unlock(&sched.lock);
+        return o;
+    }
+    if(sched.limits.queue && o->queued >= sched.limits.queue){
+        o->rejected++;
+        pthread_mutex_unlock(&sched.lock);
+        return NULL;
+    }
+    // wait at the end of the origin's queue until dispatch grants a slot
+    pthread_cond_init(&w.granted_cond, NULL);
+    w.granted = 0;
+    w.next = NULL;
+    if(o->tail != NULL){
+        o->tail->next = &w;
+    }else{
+        o->head = &w;
+    }
+    o->tail = &w;
+    if(++o->queued > o->max_queued){
+        o->max_queued = o->queued;
+    }
+    ring_add(o);
+    start = now_ms();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ORIGIN_QUEUE_TIMEOUT;
+    while(!w.granted && rc != ETIMEDOUT){
+        rc = pthread_cond_timedwait(&w.granted_cond, &sched.lock, &ts);
+    }
+    if(!w.granted){
+        // out of time: leave the queue
+        for(p = o->head; p != &w; prev = p, p = p->next);
+        if(prev != NULL){
+            prev->next = w.next;
+        }else{
+            o->head = w.next;
+        }
+        if(o->tail == &w){
+            o->tail = prev;
+        }
+        o->queued--;
+        if(o->head == NULL){
+            ring_remove(o);
+        }
+        o->rejected++;
+        check_idle(o);
+        o = NULL;
+    }else{
+        waited = now_ms() - start;
+        o->waited++;
+        o->wait_ms += waited;
+        if(waited > o->max_wait_ms){
+            o->max_wait_ms = waited;
+        }
+    }
+    pthread_mutex_unlock(&sched.lock);
+    pthread_cond_destroy(&w.granted_cond);
+    return o;
+}
+// give back a slot taken by origin_acquire; it goes to the next in turn
+void origin_release(Origin *o){
+    pthread_mutex_lock(&sched.lock);
+    o->inflight--;
+    sched.inflight--;
+    dispatch();
+    check_idle(o);
+    pthread_mutex_unlock(&sched.lock);
+}
+// print the queues and waits of every origin (nothing if not in use)
+void origin_report(FILE *fp){
+    Origin *o;
+    int i;
+    pthread_mutex_lock(&sched.lock);
+    if(!sched.enabled){
+        pthread_mutex_unlock(&sched.lock);
+        return;
+    }
+    fprintf(fp, "origins: %d (%d idle), %d requests in flight (limits: %d per origin, %d queued, %d in all)\n",
+        sched.count, sched.nidle, sched.inflight, sched.limits.per_origin, sched.limits.queue, sched.limits.total);
+    if(sched.retired){
+        fprintf(fp, "  %ld retired origins: %ld requests, %ld waited, %ld rejected\n",
+            sched.retired, sched.retired_requests, sched.retired_waited, sched.retired_rejected);
+    }
+    for(i = 0; i < ORIGIN_BUCKETS; i++){
+        for(o = sched.buckets[i]; o != NULL; o = o->next){
+            fprintf(fp, "  %s:%s: %d in flight, %d queued (max %d), %ld requests, %ld waited"
+                " (avg %.1f ms, max %ld ms), %ld rejected\n",
+                o->host, o->port, o->inflight, o->queued, o->max_queued, o->requests, o->waited,
+                o->waited ? (double)o->wait_ms / o->waited : 0.0, o->max_wait_ms, o->rejected);
+        }
+    }
+    pthread_mutex_unlock(&sched.lock);
+}
+
+// the origin host:port, added on first sight, no longer idle; under the lock
+static Origin *find_origin(char *host, char *port){
+    unsigned int h = hash_origin(host, port);
+    Origin *o;
+    for(o = sched.buckets[h & (ORIGIN_BUCKETS - 1)]; o != NULL; o = o->next){
+        if(o->hash == h && !strcmp(o->host, host) && !strcmp(o->port, port)){
+            if(o->idle){
+                idle_remove(o);
+            }
+            return o;
+        }
+    }
+    o = Calloc(1, sizeof(Origin));
+    snprintf(o->host, sizeof(o->host), "%s", host);
+    snprintf(o->port, sizeof(o->port), "%s", port);
+    o->hash = h;
+    o->next = sched.buckets[h & (ORIGIN_BUCKETS - 1)];
+    sched.buckets[h & (ORIGIN_BUCKETS - 1)] = o;
+    sched.count++;
+    return o;
+}
+// may a fetch from o start now?
+static int has_slot(Origin *o){
+    return (!sched.limits.per_origin || o->inflight < sched.limits.per_origin)
+        && (!sched.limits.total || sched.inflight < sched.limits.total);
+}
+// hand a slot of o to its first waiting request
+static void grant(Origin *o){
+    OriginWaiter *w = o->head;
+    if((o->head = w->next) == NULL){
+        o->tail = NULL;
+    }
+    o->queued--;
+    o->inflight++;
+    sched.inflight++;
+    o->requests++;
+    w->granted = 1;
+    pthread_cond_signal(&w->granted_cond);
+}
+// grant free slots round-robin, one request per origin per turn
+static void dispatch(){
+    Origin *o;
+    while(sched.ring != NULL && (!sched.limits.total || sched.inflight < sched.limits.total)){
+        // the next origin on the ring that may start a fetch
+        o = sched.ring;
+        while(!has_slot(o)){
+            if((o = o->rnext) == sched.ring){
+                return;
+            }
+        }
+        grant(o);
+        sched.ring = o->rnext;
+        if(o->head == NULL){
+            ring_remove(o);
+        }
+    }
+}
+// put o on the ring, just behind the origin served next (its turn comes last)
+static void ring_add(Origin *o){
+    if(o->on_ring){
+        return;
+    }
+    o->on_ring = 1;
+    if(sched.ring == NULL){
+        o->rnext = o->rprev = o;
+        sched.ring = o;
+        return;
+    }
+    o->rnext = sched.ring;
+    o->rprev = sched.ring->rprev;
+    o->rprev->rnext = o;
+    sched.ring->rprev = o;
+}
+// take o off the ring once nobody waits for it
+static void ring_remove(Origin *o){
+    o->on_ring = 0;
+    if(o->rnext == o){
+        sched.ring = NULL;
+        return;
+    }
+    o->rprev->rnext = o->rnext;
+    o->rnext->rprev = o->rprev;
+    if(sched.ring == o){
+        sched.ring = o->rnext;
+    }
+}
+// once nothing is in flight to o or waits for it, put it on the idle
+// list, and free the oldest idle origin if that makes too many
+static void check_idle(Origin *o){
+    if(o->inflight || o->head != NULL){
+        return;
+    }
+    o->idle = 1;
+    o->inext = NULL;
+    o->iprev = sched.idle_tail;
+    if(sched.idle_tail != NULL){
+        sched.idle_tail->inext = o;
+    }else{
+        sched.idle_head = o;
+    }
+    sched.idle_tail = o;
+    if(++sched.nidle > ORIGIN_IDLE_MAX){
+        retire(sched.idle_head);
+    }
+}
+// take o off the idle list, in use again or retired
+static void idle_remove(Origin *o){
+    if(o->iprev != NULL){
+        o->iprev->inext = o->inext;
+    }else{
+        sched.idle_head = o->inext;
+    }
+    if(o->inext != NULL){
+        o->inext->iprev = o->iprev;
+    }else{
+        sched.idle_tail = o->iprev;
+    }
+    o->idle = 0;
+    sched.nidle--;
+}
+// free an idle origin, keeping its counts in the retired totals
+static void retire(Origin *o){
+    Origin **pp = &sched.buckets[o->hash & (ORIGIN_BUCKETS - 1)];
+    while(*pp != o){
+        pp = &(*pp)->next;
+    }
+    *pp = o->next;
+    idle_remove(o);
+    sched.count--;
+    sched.retired++;
+    sched.retired_requests += o->requests;
+    sched.retired_waited += o->waited;
+    sched.retired_rejected += o->rejected;
+    Free(o);
+}
+// monotonic clock in milliseconds, for wait times
+static long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
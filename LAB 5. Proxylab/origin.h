@@ -0,0 +1,56 @@
+/*
+ * origin.h - per-origin limits on requests in flight, fairly scheduled
+ */
+#ifndef __ORIGIN_H__
+#define __ORIGIN_H__
+
+#include "csapp.h"
+
+/* Number of hash buckets of the origin table (power of two) */
+#define ORIGIN_BUCKETS 256
+/* Idle origins kept for their statistics; older ones are freed */
+#define ORIGIN_IDLE_MAX 256
+/* Seconds a request may wait for a slot before it is turned away */
+#define ORIGIN_QUEUE_TIMEOUT 10
+
+/* Limits; 0 means no limit */
+typedef struct{
+    int per_origin;     /* requests in flight to one origin */
+    int queue;          /* requests waiting for one origin */
+    int total;          /* requests in flight to all origins */
+} OriginLimits;
+
+/* A request waiting for a slot */
+typedef struct OriginWaiter{
+    pthread_cond_t granted_cond;
+    int granted;
+    struct OriginWaiter *next;
+} OriginWaiter;
+
+/* An origin server, with its queue of waiting requests */
+typedef struct Origin{
+    char host[200];
+    char port[10];
+    unsigned int hash;
+    int inflight;
+    int queued;
+    OriginWaiter *head, *tail;  /* FIFO of waiting requests */
+    int on_ring;                /* has waiters, is on the scheduler's ring */
+    struct Origin *rnext, *rprev;
+    long requests;              /* slots granted */
+    long waited;                /* ... after waiting in the queue */
+    long wait_ms;               /* total and longest wait */
+    long max_wait_ms;
+    int max_queued;
+    long rejected;              /* queue full or wait too long: 503 */
+    int idle;                   /* nothing in flight or queued, on the idle list */
+    struct Origin *inext, *iprev;
+    struct Origin *next;        /* next origin in the bucket */
+} Origin;
+
+void origin_init(int per_origin, int queue, int total);
+Origin *origin_acquire(char *host, char *port);
+void origin_release(Origin *o);
+void origin_report(FILE *fp);
+
+#endif /* __ORIGIN_H__ */
@@ -0,0 +1,236 @@
+/*
+ * policy.c - admission and eviction policies of the proxy cache
+ *
+ *   clock    CLOCK (second chance), an approximation of LRU
+ *   s3fifo   S3-FIFO: new objects go through a small FIFO queue and only
+ *            move to the main queue if hit there, so a scan of one-hit
+ *            objects cannot flush the main queue
+ *   tinylfu  CLOCK eviction behind a TinyLFU admission filter: a new
+ *            object gets in only if it was asked for more often than the
+ *            object it would evict (count-min sketch with aging)
+ *   gdsf     Greedy-Dual-Size-Frequency: evicts the object with the least
+ *            frequency per byte, among a sample of the oldest objects
+ *
+ * Hits run under the shard's reader lock, so all a hit does is bump a
+ * counter; queues are only reordered when something has to be evicted.
+ * Counters are updated with relaxed atomics and may lose an increment
+ * under contention, which is fine for a frequency estimate.
+ */
+#include "policy.h"
+
+/* S3-FIFO: share of the shard for the small queue */
+#define S3FIFO_SMALL (cache.shard_size / 10)
+#define S3FIFO_MAX_FREQ 3
+/* TinyLFU: counters saturate at 15 and halve every SKETCH_RESET adds */
+#define SKETCH_MAX 15
+#define SKETCH_RESET (SKETCH_WIDTH * 10)
+/* GDSF: fixed-point scale of frequency / size, and the eviction sample */
+#define GDSF_SCALE (1UL << 24)
+#define GDSF_MAX_FREQ 255
+#define GDSF_SAMPLES 16
+
+static void no_reset(CacheShard *sh){
+}
+// saturating increment; returns the new value
+static int counter_inc(int *c, int max){
+    int v = __atomic_load_n(c, __ATOMIC_RELAXED);
+    if(v < max){
+        __atomic_store_n(c, ++v, __ATOMIC_RELAXED);
+    }
+    return v;
+}
+// move item to the young end of its queue
+static void requeue(CacheShard *sh, CacheItem *item, int list){
+    cache_list_unlink(sh, item);
+    cache_list_push(sh, list, item);
+}
+
+/* ---------------- clock ---------------- */
+
+static void clock_hit(CacheShard *sh, CacheItem *item){
+    if(!__atomic_load_n(&item->referenced, __ATOMIC_RELAXED)){
+        __atomic_store_n(&item->referenced, 1, __ATOMIC_RELAXED);
+    }
+}
+static void clock_insert(CacheShard *sh, CacheItem *item){
+    item->referenced = 0;
+    cache_list_push(sh, 0, item);
+}
+// the clock hand: referenced items get a second chance
+static CacheItem *clock_victim(CacheShard *sh){
+    CacheItem *cur;
+    while((cur = sh->lists[0].head) != sh->lists[0].tail){
+        if(!__atomic_exchange_n(&cur->referenced, 0, __ATOMIC_RELAXED)){
+            break;
+        }
+        requeue(sh, cur, 0);
+    }
+    return cur;
+}
+
+static CachePolicy clock_policy = {
+    "clock", no_reset, clock_hit, NULL, clock_insert, clock_victim, NULL
+};
+
+/* ---------------- s3fifo ---------------- */
+
+static void s3fifo_reset(CacheShard *sh){
+    memset(sh->ghost, 0, sizeof(sh->ghost));
+    sh->ghost_next = 0;
+}
+static void s3fifo_hit(CacheShard *sh, CacheItem *item){
+    counter_inc(&item->freq, S3FIFO_MAX_FREQ);
+}
+static int ghost_has(CacheShard *sh, unsigned int hash){
+    int i;
+    for(i = 0; i < GHOST_SIZE; i++){
+        if(sh->ghost[i] == hash) return 1;
+    }
+    return 0;
+}
+// small queue (0) for new objects, main queue (1) if evicted recently
+static void s3fifo_insert(CacheShard *sh, CacheItem *item){
+    item->freq = 0;
+    cache_list_push(sh, ghost_has(sh, item->hash) ? 1 : 0, item);
+}
+static CacheItem *s3fifo_victim(CacheShard *sh){
+    CacheItem *cur;
+    while(1){
+        if(sh->lists[0].size > S3FIFO_SMALL || sh->lists[1].head == NULL){
+            // small queue: hit objects move on, the rest leave a ghost
+            cur = sh->lists[0].head;
+            if(cur->freq > 0){
+                cur->freq = 0;
+                requeue(sh, cur, 1);
+                continue;
+            }
+            sh->ghost[sh->ghost_next] = cur->hash;
+            sh->ghost_next = (sh->ghost_next + 1) % GHOST_SIZE;
+            return cur;
+        }
+        // main queue: FIFO with reinsertion while the frequency lasts
+        cur = sh->lists[1].head;
+        if(cur->freq > 0 && cur != sh->lists[1].tail){
+            cur->freq--;
+            requeue(sh, cur, 1);
+            continue;
+        }
+        return cur;
+    }
+}
+
+static CachePolicy s3fifo_policy = {
+    "s3fifo", s3fifo_reset, s3fifo_hit, NULL, s3fifo_insert, s3fifo_victim, NULL
+};
+
+/* ---------------- tinylfu ---------------- */
+
+static unsigned int sketch_index(unsigned int hash, int row){
+    static const unsigned int mult[SKETCH_ROWS] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+    return ((hash * mult[row]) >> 16) & (SKETCH_WIDTH - 1);
+}
+static void tinylfu_reset(CacheShard *sh){
+    memset(sh->sketch, 0, sizeof(sh->sketch));
+    sh->sketch_adds = 0;
+}
+// count an access; every SKETCH_RESET accesses all counts halve (aging)
+static void sketch_add(CacheShard *sh, unsigned int hash){
+    unsigned char *c, v;
+    int r, i;
+    for(r = 0; r < SKETCH_ROWS; r++){
+        c = &sh->sketch[r][sketch_index(hash, r)];
+        if((v = __atomic_load_n(c, __ATOMIC_RELAXED)) < SKETCH_MAX){
+            __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(__atomic_add_fetch(&sh->sketch_adds, 1, __ATOMIC_RELAXED) == SKETCH_RESET){
+        for(r = 0; r < SKETCH_ROWS; r++){
+            for(i = 0; i < SKETCH_WIDTH; i++){
+                c = &sh->sketch[r][i];
+                __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&sh->sketch_adds, 0, __ATOMIC_RELAXED);
+    }
+}
+static int sketch_estimate(CacheShard *sh, unsigned int hash){
+    int r, v, min = SKETCH_MAX;
+    for(r = 0; r < SKETCH_ROWS; r++){
+        v = __atomic_load_n(&sh->sketch[r][sketch_index(hash, r)], __ATOMIC_RELAXED);
+        if(v < min) min = v;
+    }
+    return min;
+}
+static void tinylfu_hit(CacheShard *sh, CacheItem *item){
+    clock_hit(sh, item);
+    sketch_add(sh, item->hash);
+}
+static void tinylfu_miss(CacheShard *sh, unsigned int hash){
+    sketch_add(sh, hash);
+}
+static int tinylfu_admit(CacheShard *sh, CacheItem *item, CacheItem *victim){
+    return sketch_estimate(sh, item->hash) > sketch_estimate(sh, victim->hash);
+}
+
+static CachePolicy tinylfu_policy = {
+    "tinylfu", tinylfu_reset, tinylfu_hit, tinylfu_miss, clock_insert, clock_victim, tinylfu_admit
+};
+
+/* ---------------- gdsf ---------------- */
+
+static unsigned long gdsf_prio(CacheShard *sh, CacheItem *item, int freq){
+    return __atomic_load_n(&sh->inflation, __ATOMIC_RELAXED)
+        + freq * GDSF_SCALE / (item->size ? item->size : 1);
+}
+static void gdsf_reset(CacheShard *sh){
+    sh->inflation = 0;
+}
+static void gdsf_hit(CacheShard *sh, CacheItem *item){
+    int freq = counter_inc(&item->freq, GDSF_MAX_FREQ);
+    __atomic_store_n(&item->prio, gdsf_prio(sh, item, freq), __ATOMIC_RELAXED);
+}
+static void gdsf_insert(CacheShard *sh, CacheItem *item){
+    item->freq = 1;
+    item->prio = gdsf_prio(sh, item, 1);
+    cache_list_push(sh, 0, item);
+}
+// least priority among the oldest GDSF_SAMPLES items; the others rotate
+// to the back so the next eviction looks at fresh ones
+static CacheItem *gdsf_victim(CacheShard *sh){
+    CacheItem *sample[GDSF_SAMPLES], *cur, *min;
+    int i, n = 0;
+    for(cur = sh->lists[0].head; cur && n < GDSF_SAMPLES; cur = cur->next){
+        sample[n++] = cur;
+    }
+    min = sample[0];
+    for(i = 1; i < n; i++){
+        if(sample[i]->prio < min->prio) min = sample[i];
+    }
+    for(i = 0; i < n; i++){
+        if(sample[i] != min) requeue(sh, sample[i], 0);
+    }
+    // later priorities start from here, so old popularity fades
+    sh->inflation = min->prio;
+    return min;
+}
+
+static CachePolicy gdsf_policy = {
+    "gdsf", gdsf_reset, gdsf_hit, NULL, gdsf_insert, gdsf_victim, NULL
+};
+
+CachePolicy *cache_policies[] = {
+    &clock_policy, &s3fifo_policy, &tinylfu_policy, &gdsf_policy, NULL
+};
+
+// policy by name, NULL if unknown
+CachePolicy *policy_find(char *name){
+    int i;
+    for(i = 0; cache_policies[i] != NULL; i++){
+        if(!strcmp(cache_policies[i]->name, name)){
+            return cache_policies[i];
+        }
+    }
+    return NULL;
+}
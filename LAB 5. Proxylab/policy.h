@@ -0,0 +1,29 @@
+/*
+ * policy.h - admission and eviction policies of the proxy cache
+ */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+/*
+ * A cache policy. hit and miss run under the shard's reader lock, so
+ * they may only touch per-item or per-shard counters atomically; the
+ * rest run under the writer lock.
+ */
+typedef struct CachePolicy{
+    char *name;
+    void (*reset)(CacheShard *sh);                      /* empty shard */
+    void (*hit)(CacheShard *sh, CacheItem *item);
+    void (*miss)(CacheShard *sh, unsigned int hash);
+    void (*insert)(CacheShard *sh, CacheItem *item);    /* link a new item */
+    CacheItem *(*victim)(CacheShard *sh);               /* next to evict, still linked */
+    int (*admit)(CacheShard *sh, CacheItem *item, CacheItem *victim);  /* optional */
+} CachePolicy;
+
+/* Policies in the order they are listed by the proxy */
+extern CachePolicy *cache_policies[];
+
+CachePolicy *policy_find(char *name);
+
+#endif /* __POLICY_H__ */
@@ -1,70 +1,87 @@
 #include <stdio.h>
 #include <string.h>
+#include <sys/prctl.h>
 #include "csapp.h"
+#include "cache.h"
+#include "sbuf.h"
+#include "request.h"
+#include "event.h"
+#include "http.h"
+#include "upstream.h"
+#include "flight.h"
+#include "policy.h"
+#include "disk.h"
+#include "dns.h"
+#include "slab.h"
+#include "splice.h"
+#include "snapshot.h"
+#include "origin.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
 /* Port number */
 #define MAX_PORT_NUM 64999
 #define MIN_PORT_NUM 4501
+/* Worker pool defaults */
+#define NTHREADS 16
+#define SBUFSIZE 64
+/* Seconds a keep-alive client may stay idle between requests */
+#define CLIENT_IDLE_TIMEOUT 5
 
-/* Structure */
-typedef struct{
-    char method[10];
-    char url[200];
-    char protocol[20];
-    char host[200];
-    char port[10];
-    char content[1000];
-    char version[10];
-} Request;
-/*  Cache for holding responses
-  * doubly linked list
-  * sorted in time order
-  * eviction in LRU policy
-*/
-typedef struct CacheItem{
-    char host[200];
-    char content[1000];
-    size_t size;
-    char* data;
-    struct CacheItem* next;
-    struct CacheItem* prev;
-    clock_t time;
-}CacheItem;
+/* Connection header of responses to the client */
+static char *client_close_hdr = "Connection: close\r\n";
+static char *client_keepalive_hdr = "Connection: keep-alive\r\n";
 
+/* Outcome of relaying one response from the origin */
+#define RESP_DONE   0   /* relayed, origin connection reusable */
+#define RESP_CLOSE  1   /* relayed, origin connection must be closed */
+#define RESP_NONE  -1   /* origin sent nothing */
+#define RESP_ERROR -2   /* failed part way */
+#define RESP_TIMEOUT -3 /* origin missed a deadline before sending anything */
+#define RESP_BUSY  -4   /* origin at its limit, with a full queue */
+
+/* Response on its way from the origin to the client (and the cache) */
 typedef struct{
-    CacheItem *head;
-    CacheItem *tail;
-    size_t size;
-} CacheList;
+    Upstream *up;
+    rio_t *rp;
+    int client_fd;
+    ChunkBuf *body;     /* own buffer, or the flight's */
+    Flight *flight;     /* clients waiting on the same object, if any */
+    int cacheable;
+    int client_dead;    /* client gone: the body only goes to the flight */
+    size_t sent;        /* bytes sent to the client */
+} Relay;
 
-CacheList cache;
+/* Connected descriptors waiting for a worker */
+sbuf_t sbuf;
 
-/* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char *connection_hdr = "Connection: close\r\n";
-static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
-static const char *version = "HTTP/1.0\r\n";
+/* Cache image saved on SIGTERM and every snapshot_period seconds; none if NULL */
+static char *snapshot_path;
+static int snapshot_period = SNAPSHOT_PERIOD;
 
 /* Function Declarations */
+void usage(char *prog);
+void run_processes(int nprocs);
+pid_t fork_worker();
+int wait_signal(sigset_t *mask);
+void save_snapshot();
+int open_reuseport_listenfd(char *port);
 void *proxy_thread(void *vargp);
-void read_request(int fd, Request *req, char *pr);
-void parse_line(Request *req, char *buf);
-void set_host_port(char* hp, char *h, char *p);
-void print_request(Request *req);
-void send_response(int server_fd, int client_fd, Request *req);
-char* xstrncpy(char * dst, const char *src, size_t n);
+void *report_thread(void *vargp);
+void serve_client(int client_fd);
+int fetch_shared(int client_fd, Request *req);
+int revalidate(int client_fd, Request *req, CacheItem *stale);
+int fetch_response(int client_fd, Request *req, Flight *f, CacheItem *stale);
+int send_response(Upstream *up, int client_fd, Request *req, Flight *f, CacheItem **stale, int *keep);
+int relay_write(Relay *r, char *buf, size_t n);
+int relay_emit(Relay *r, char *buf, size_t n);
+int relay_body(Relay *r, long n);
+int relay_splice(Relay *r, long n);
+int relay_chunked(Relay *r);
+char *relay_reserve(Relay *r, size_t *avail);
+void relay_commit(Relay *r, size_t n);
+void send_error(int fd, char *status);
 
-void init_cache();
-CacheItem *cache_check(Request *req);
-void send_cached_response(int fd, CacheItem *item);
-void cache_update(CacheItem *item);
-void insert_item(Request *req, char *data, int size);
-void evict_LRU();
-void delete_item(CacheItem *item);
-void print_cache();
+int send_cached_response(int fd, CacheItem *item, int keep_alive);
+int send_disk_response(int fd, DiskHit *hit, int keep_alive);
 
 
 int main(int argc, char **argv)
@@ -72,313 +89,824 @@ int main(int argc, char **argv)
     //ignore SIGPIPE
     Signal(SIGPIPE, SIG_IGN);
 
-    char *port = argv[1];
+    char *port;
     struct sockaddr_in clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
-    int listenfd;
+    socklen_t clientlen;
+    int listenfd, connfd, i, c;
+    int nthreads = NTHREADS, sbufsize = SBUFSIZE, nloops = 0, nprocs = 1;
+    char *worker_opt = NULL;
     pthread_t tid;
-
-    // initialize cache
-    init_cache();
+    sigset_t mask;
+    char *disk_dir = NULL;
+    size_t mem_capacity = MAX_CACHE_SIZE, mem_max = MAX_OBJECT_SIZE;
+    size_t disk_capacity = DISK_CAPACITY, disk_max = DISK_MAX_OBJECT;
 
     //argument check
-    if(argc != 2){
-        printf("ERROR(main): wrong argument!\n");
+    int idle_timeout = UPSTREAM_IDLE_TIMEOUT, dns_ttl = DNS_TTL;
+    UpstreamTimeouts timeouts = upstream_timeouts;
+    OriginLimits limits = {-1, -1, 0};
+    while((c = getopt(argc, argv, "t:q:e:k:c:m:o:d:D:O:T:P:s:S:L:N:")) != -1){
+        switch(c){
+        case 't':   /* number of worker threads */
+            nthreads = atoi(optarg);
+            worker_opt = "-t";
+            break;
+        case 'q':   /* depth of the connection queue */
+            sbufsize = atoi(optarg);
+            worker_opt = "-q";
+            break;
+        case 'e':   /* event-driven mode with this many epoll loops */
+            nloops = atoi(optarg);
+            if(nloops <= 0) usage(argv[0]);
+            break;
+        case 'k':   /* idle timeout of pooled upstream connections, 0: off */
+            idle_timeout = atoi(optarg);
+            worker_opt = "-k";
+            break;
+        case 'c':   /* cache admission/eviction policy */
+            if(cache_set_policy(optarg) < 0) usage(argv[0]);
+            break;
+        case 'm':   /* bytes of the memory tier */
+            mem_capacity = atol(optarg);
+            break;
+        case 'o':   /* objects in memory must be smaller than this */
+            mem_max = atol(optarg);
+            break;
+        case 'd':   /* directory of the disk tier; no disk tier without */
+            disk_dir = optarg;
+            break;
+        case 'D':   /* bytes of the disk tier */
+            disk_capacity = atol(optarg);
+            break;
+        case 'O':   /* objects on disk must be smaller than this */
+            disk_max = atol(optarg);
+            break;
+        case 'P':   /* worker processes sharing the port and the cache */
+            nprocs = atoi(optarg);
+            if(nprocs <= 0) usage(argv[0]);
+            break;
+        case 's':   /* cache image restored at startup, saved on SIGTERM */
+            snapshot_path = optarg;
+            break;
+        case 'S':   /* seconds between snapshots, 0: only on SIGTERM */
+            snapshot_period = atoi(optarg);
+            if(snapshot_period < 0) usage(argv[0]);
+            break;
+        case 'L':   /* origin limits: in flight per origin[:queued[:in flight in all]] */
+            if(sscanf(optarg, "%d:%d:%d", &limits.per_origin, &limits.queue, &limits.total) < 1
+                || limits.per_origin < 0 || limits.queue < -1 || limits.total < 0){
+                usage(argv[0]);
+            }
+            worker_opt = "-L";
+            break;
+        case 'T':   /* origin deadlines: connect:read:response seconds */
+            if(sscanf(optarg, "%d:%d:%d", &timeouts.connect, &timeouts.read, &timeouts.response) != 3
+                || timeouts.connect < 0 || timeouts.read < 0 || timeouts.response < 0){
+                usage(argv[0]);
+            }
+            break;
+        case 'N':   /* seconds an origin's addresses are used */
+            dns_ttl = atoi(optarg);
+            if(dns_ttl <= 0) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1 || nthreads <= 0 || sbufsize <= 0 || idle_timeout < 0){
+        usage(argv[0]);
+    }
+    // the event loops have no worker threads, upstream pool or origin limits
+    if(nloops && worker_opt != NULL){
+        printf("ERROR(main): %s does not apply to -e\n", worker_opt);
         exit(1);
     }
+    port = argv[optind];
     //port check
     if(atoi(port) < MIN_PORT_NUM || atoi(port) > MAX_PORT_NUM){
         printf("ERROR(main): invalid port number!\n");
         exit(1);
     }
-    //handling concurrent requests
-    listenfd = Open_listenfd(port);
+
+    // SIGUSR1 prints cache statistics, SIGTERM saves a snapshot first
+    // (handled by a thread of its own; blocked first, so every thread and
+    // process started from here on inherits that)
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if(snapshot_path != NULL){
+        sigaddset(&mask, SIGTERM);
+    }
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // initialize cache
+    if(cache_set_limits(mem_capacity, mem_max) < 0){
+        printf("ERROR(main): every cache shard must fit an object (-m >= %d * -o)\n", CACHE_SHARDS);
+        exit(1);
+    }
+    if(nprocs > 1){
+        // the disk tier's index is private to a process
+        if(disk_dir != NULL){
+            printf("ERROR(main): -d cannot be used with -P\n");
+            exit(1);
+        }
+        cache_share(nprocs);
+    }
+    init_cache();
+    // warm restart: the hot set of the last run, before anyone can miss it
+    if(snapshot_path != NULL){
+        long start = upstream_now();
+        int n = snapshot_load(snapshot_path);
+        if(n >= 0){
+            fprintf(stderr, "snapshot: %d objects restored from %s in %ld ms\n",
+                n, snapshot_path, upstream_now() - start);
+        }
+    }
+    if(disk_dir != NULL){
+        if(disk_init(disk_dir, disk_capacity, disk_max) < 0){
+            printf("ERROR(main): cannot use %s as a disk cache of %zu bytes\n", disk_dir, disk_capacity);
+            exit(1);
+        }
+        // what memory evicts goes to disk
+        cache_set_spill(disk_put, disk_drop, disk_max_object());
+    }
+    // fork before any thread starts; only the workers return
+    if(nprocs > 1){
+        run_processes(nprocs);
+    }
+    Pthread_create(&tid, NULL, report_thread, NULL);
+
+    // origin addresses are cached, and refreshed in the background
+    dns_init(dns_ttl);
+    upstream_set_timeouts(timeouts.connect, timeouts.read, timeouts.response);
+
+    //event-driven mode: a few epoll loops instead of a thread per client
+    if(nloops){
+        // its non-blocking connects do not use the pool
+        upstream_init(0);
+        listenfd = nprocs > 1 ? open_reuseport_listenfd(port) : Open_listenfd(port);
+        run_event_loops(listenfd, nloops);
+        return 0;
+    }
+    upstream_init(idle_timeout);
+    flight_init();
+    // by default a slow origin may hold half the workers in fetches and
+    // a quarter more waiting; the rest are left for the others
+    if(limits.per_origin < 0){
+        limits.per_origin = nthreads > 1 ? nthreads / 2 : 1;
+    }
+    if(limits.queue < 0){
+        limits.queue = limits.per_origin ? (nthreads + 3) / 4 : 0;
+    }
+    origin_init(limits.per_origin, limits.queue, limits.total);
+    //prethreaded workers fed by a bounded queue of connected fds
+    sbuf_init(&sbuf, sbufsize);
+    for(i = 0; i < nthreads; i++){
+        Pthread_create(&tid, NULL, proxy_thread, NULL);
+    }
+    listenfd = nprocs > 1 ? open_reuseport_listenfd(port) : Open_listenfd(port);
     while(1) {
-        int *connfdp = Malloc(sizeof(int));
-        *connfdp =Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, proxy_thread, connfdp);
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
+        // blocks while the queue is full, so accept backs off
+        sbuf_insert(&sbuf, connfd);
     }
 
     return 0;
 }
+// print usage and exit
+void usage(char *prog){
+    int i;
+    printf("usage: %s [-t nthreads] [-q queue depth] [-e nloops] [-k idle secs] [-c policy]\n"
+        "       [-m mem bytes] [-o mem max object] [-d disk dir] [-D disk bytes] [-O disk max object]\n"
+        "       [-T connect:read:response secs] [-L per origin[:queued[:total]]] [-P nprocs]\n"
+        "       [-s snapshot file] [-S snapshot secs] [-N dns secs] <port>\n", prog);
+    printf("policies:");
+    for(i = 0; cache_policies[i] != NULL; i++){
+        printf(" %s", cache_policies[i]->name);
+    }
+    printf("\n");
+    exit(1);
+}
+/*
+ * run_processes - fork nprocs workers and return in each of them. The
+ *     parent stays behind: it replaces workers that die, and prints the
+ *     statistics of the shared cache on SIGUSR1. Workers go when it does.
+ *     It sees the shared cache too, so it is the one saving snapshots.
+ *     A worker may die holding a lock of the shared cache, half way
+ *     through an update or with items pinned, which would sooner or
+ *     later wedge the others: when one dies, all of them are started
+ *     over on an empty cache.
+ */
+void run_processes(int nprocs){
+    pid_t *workers = Calloc(nprocs, sizeof(pid_t));
+    sigset_t mask;
+    pid_t pid;
+    int i, sig, status, died;
+
+    // SIGCHLD is waited for, like SIGUSR1 (already blocked)
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    for(i = 0; i < nprocs; i++){
+        if((workers[i] = fork_worker()) == 0){
+            return;
+        }
+    }
+    sigaddset(&mask, SIGUSR1);
+    if(snapshot_path != NULL){
+        sigaddset(&mask, SIGTERM);
+    }
+    while(1){
+        sig = wait_signal(&mask);
+        if(sig == SIGUSR1){
+            cache_report(stderr);
+            slab_report(stderr);
+        }
+        died = 0;
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0){
+            fprintf(stderr, "worker %d exited (status %d)\n", (int)pid, status);
+            for(i = 0; i < nprocs; i++){
+                if(workers[i] == pid){
+                    workers[i] = 0;
+                }
+            }
+            died = 1;
+        }
+        if(!died){
+            continue;
+        }
+        // nothing in the shared cache can be trusted now
+        fprintf(stderr, "restarting %d workers on an empty cache\n", nprocs);
+        for(i = 0; i < nprocs; i++){
+            if(workers[i] > 0){
+                kill(workers[i], SIGKILL);
+                waitpid(workers[i], NULL, 0);
+            }
+        }
+        cache_rebuild();
+        for(i = 0; i < nprocs; i++){
+            if((workers[i] = fork_worker()) == 0){
+                return;
+            }
+        }
+    }
+}
+// fork a worker process: 0 in the worker, its pid in the parent
+pid_t fork_worker(){
+    sigset_t mask;
+    pid_t pid;
+    if((pid = Fork()) == 0){
+        // SIGTERM kills workers again: the parent saves the snapshots
+        snapshot_path = NULL;
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    }
+    return pid;
+}
+// a listening socket on port that other processes may bind as well;
+// the kernel spreads connections over them
+int open_reuseport_listenfd(char *port){
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0){
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        exit(1);
+    }
+    for(p = listp; p; p = p->ai_next){
+        if((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0){
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if(bind(listenfd, p->ai_addr, p->ai_addrlen) == 0){
+            break;
+        }
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if(p == NULL || listen(listenfd, LISTENQ) < 0){
+        unix_error("open_reuseport_listenfd error");
+    }
+    return listenfd;
+}
+/*
+ * wait_signal - wait for one of the signals in mask and return it. With
+ *     a snapshot file, a snapshot is saved every snapshot_period seconds
+ *     meanwhile, and on SIGTERM a last one before the process exits.
+ */
+int wait_signal(sigset_t *mask){
+    static time_t next;
+    struct timespec ts = {0, 0};
+    time_t now;
+    int sig;
+
+    while(1){
+        if(snapshot_path == NULL || snapshot_period == 0){
+            if(sigwait(mask, &sig) != 0){
+                continue;
+            }
+        }else{
+            now = time(NULL);
+            if(next == 0){
+                next = now + snapshot_period;
+            }
+            ts.tv_sec = next > now ? next - now : 0;
+            if((sig = sigtimedwait(mask, NULL, &ts)) < 0){
+                if(errno == EAGAIN){
+                    save_snapshot();
+                    next = time(NULL) + snapshot_period;
+                }
+                continue;
+            }
+        }
+        if(sig == SIGTERM){
+            save_snapshot();
+            exit(0);
+        }
+        return sig;
+    }
+}
+// write the cache to the snapshot file, and say how it went
+void save_snapshot(){
+    long start = upstream_now();
+    int n = snapshot_save(snapshot_path);
+    if(n < 0){
+        fprintf(stderr, "snapshot: cannot save %s: %s\n", snapshot_path, strerror(errno));
+        return;
+    }
+    fprintf(stderr, "snapshot: %d objects saved to %s in %ld ms\n", n, snapshot_path, upstream_now() - start);
+}
+// print cache statistics on every SIGUSR1 (and save snapshots)
+void *report_thread(void *vargp){
+    sigset_t mask;
+    Pthread_detach(pthread_self());
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if(snapshot_path != NULL){
+        sigaddset(&mask, SIGTERM);
+    }
+    while(1){
+        wait_signal(&mask);
+        cache_report(stderr);
+        disk_report(stderr);
+        slab_report(stderr);
+        dns_report(stderr);
+        origin_report(stderr);
+        splice_report(stderr);
+    }
+    return NULL;
+}
+// worker thread: serve connections from the queue forever
+void *proxy_thread(void *vargp){
+    Pthread_detach(pthread_self());
+    while(1){
+        int client_fd = sbuf_remove(&sbuf);
+        serve_client(client_fd);
+    }
+    return NULL;
+}
 /*
 1. read and parse request
 2. forward request to server
 3. forward response to client
 4. add cache
+repeated while the client keeps the connection open; pipelined
+requests wait in client_rio and are answered in order. Each request is
+parsed where it lies in client_rio's buffer, which holds still until the
+next one is read.
 */
-void *proxy_thread(void *vargp){
-    int client_fd = *((int *) vargp);
-    int server_fd;
+void serve_client(int client_fd){
+    rio_t client_rio;
     CacheItem *cache_hit;
-    char proxy_request[MAXBUF];
-    Request *Requestp = Malloc(sizeof(Request));
-    Pthread_detach(pthread_self());
-    free(vargp);
-    // analysize request and build proxy request
-    read_request(client_fd, Requestp, proxy_request);
-    //check cache
-    cache_hit = cache_check(Requestp);
-    if(cache_hit){      /* cache hit */
-        //send cached response and update cache
-        send_cached_response(client_fd, cache_hit);
-    }else{              /* cache miss */
-        server_fd = Open_clientfd(Requestp->host, Requestp->port);
-        // forward request to server
-        Rio_writen(server_fd, proxy_request, strlen(proxy_request));
-        // forward response to client and insert cache
-        send_response(server_fd, client_fd, Requestp);
-        Close(server_fd);
+    DiskHit disk_hit;
+    Request request, *Requestp = &request;
+    struct timeval idle = {CLIENT_IDLE_TIMEOUT, 0};
+    char *block, *err;
+    ssize_t len;
+    int keep = 1;
+    // an idle keep-alive client must not hold on to a worker forever
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    Rio_readinitb(&client_rio, client_fd);
+    while(keep && (len = rio_readrequest(&client_rio, &block)) != 0){
+        if(len < 0){
+            send_error(client_fd, "431 Request Header Fields Too Large");
+            break;
+        }
+        if((err = parse_request(Requestp, block, len)) != NULL){
+            send_error(client_fd, err);
+            break;
+        }
+        if(Requestp->head){
+            // the cache only answers GETs: HEAD goes to the origin, alone
+            keep = fetch_response(client_fd, Requestp, NULL, NULL);
+            continue;
+        }
+        //check cache
+        cache_hit = cache_check(Requestp->host, Requestp->port, Requestp->content);
+        if(cache_hit && !cache_fresh(cache_hit)){
+            // stale: ask the origin whether it changed
+            keep = revalidate(client_fd, Requestp, cache_hit);
+        }else if(cache_hit){      /* cache hit */
+            //send cached response and update cache
+            keep = send_cached_response(client_fd, cache_hit, Requestp->keep_alive);
+        }else if(disk_check(Requestp->host, Requestp->port, Requestp->content, &disk_hit)){
+            keep = send_disk_response(client_fd, &disk_hit, Requestp->keep_alive);
+        }else{              /* cache miss */
+            // forward request to server, response to client and insert cache
+            keep = fetch_shared(client_fd, Requestp);
+        }
     }
     Close(client_fd);
-    free(Requestp);
     //print_cache();
-    return NULL;
+    return;
 }
-// read request from client and build proxy request(to server)
-void read_request(int fd, Request *req, char *pr){
-    rio_t client_rio;
-    char buf[MAXLINE];
-    char host_port[20];
-    strcpy(host_port, "");
-    // read and parse request line
-    Rio_readinitb(&client_rio, fd);
-    Rio_readlineb(&client_rio, buf, MAXLINE);
-    parse_line(req, buf);
-    memset(buf, 0, sizeof(buf));
-    // read and cnstruct proxy request
-    strcpy(pr, req->method);
-    strcat(pr, " ");
-    strcat(pr, req->content);
-    strcat(pr, " ");
-    strcat(pr, version);
-    // add headers
-    // if host was declared in request line
-    if(strlen(req->host)){
-        strcat(pr, "Host: ");
-        strcat(pr, req->host);
-        strcat(pr, ":");
-        strcat(pr, req->port);
-        strcat(pr, "\r\n");
-    }
-    strcat(pr, user_agent_hdr);
-    strcat(pr, connection_hdr);
-    strcat(pr, proxy_connection_hdr);
-    //add other headers 
-    while(Rio_readlineb(&client_rio, buf, MAXLINE)>0){
-        if(strstr(buf, "\r\n")){
+// on a miss, fetch the object once however many clients want it now
+int fetch_shared(int client_fd, Request *req){
+    CacheItem *hit;
+    Flight *f;
+    int leader, keep;
+    if((f = flight_join(req->host, req->port, req->content, &leader, &hit)) == NULL){
+        // cached since our miss
+        return send_cached_response(client_fd, hit, req->keep_alive);
+    }
+    if(leader){
+        keep = fetch_response(client_fd, req, f, NULL);
+    }else if((keep = flight_follow(f, client_fd, req->keep_alive)) == -2){
+        // the origin just timed out on the leader: do not wait for it again
+        send_error(client_fd, "504 Gateway Timeout");
+        keep = 0;
+    }else if(keep < 0){
+        // not shareable: go to the origin like before
+        keep = fetch_response(client_fd, req, NULL, NULL);
+    }
+    flight_release(f);
+    return keep;
+}
+// on a stale hit, ask the origin with the validators the item kept; one
+// without validators (or a client with validators of its own) is a miss
+int revalidate(int client_fd, Request *req, CacheItem *stale){
+    char cond[CACHE_COND_MAX];
+    if(req->conditional || cache_validators(stale, cond, sizeof(cond)) == 0){
+        cache_release(stale);
+        return fetch_shared(client_fd, req);
+    }
+    return fetch_response(client_fd, req, NULL, stale);
+}
+// forward request to the origin over a pooled connection if there is one
+// returns whether the client connection stays open; f (if any) ends failed
+// unless a complete, cacheable response went through it. With stale set,
+// the request is conditional and a 304 sends stale (which is released).
+// An origin that misses a deadline before answering gets the client a 504
+int fetch_response(int client_fd, Request *req, Flight *f, CacheItem *stale){
+    struct iovec iov[REQ_IOV];
+    char cond[CACHE_COND_MAX];
+    Upstream *up;
+    Origin *o;
+    int n, reused, rc = RESP_BUSY, attempt, keep = 0;
+    if(stale){
+        cache_validators(stale, cond, sizeof(cond));
+    }
+    // wait for a slot of the origin; a busy one turns the request away
+    o = origin_acquire(req->host, req->port);
+    for(attempt = 0; o != NULL && attempt < 2; attempt++){
+        if((up = upstream_get(req->host, req->port, &reused)) == NULL){
+            rc = errno == ETIMEDOUT ? RESP_TIMEOUT : RESP_NONE;
             break;
-        }else if(strstr(buf, "User-Agent:") || strstr(buf, "Connection:") || strstr(buf, "Proxy-Connection:")){
-        }else if(strstr(buf, "Host")){
-            // if host is given by header
-            if(!strlen(req->host)){
-                sscanf(buf, "Host: %s", host_port);
-                set_host_port(host_port, req->host, req->port);
-                // strcpy(req->protocol, protocol);
-                strcpy(req->host, host_port);
-                strcat(pr, "Host: ");
-                strcat(pr, req->host);
-                strcat(pr, ":");
-                strcat(pr, req->port);
-                strcat(pr, "\r\n");
-            }
+        }
+        // forward request to server, in one gather write
+        n = request_iovec(req, upstream_pooling(), stale ? cond : NULL, iov);
+        if(iov_writen(up->fd, iov, n) < 0){
+            rc = RESP_NONE;
         }else{
-            // other additional headers
-            strcat(pr, buf);
+            rc = send_response(up, client_fd, req, f, &stale, &keep);
+        }
+        if(rc == RESP_DONE){
+            upstream_put(up);
+            break;
+        }
+        upstream_close(up);
+        // the origin may have dropped a pooled connection: retry on a new one
+        if(rc != RESP_NONE || !reused){
+            break;
         }
-        memset(buf, 0, sizeof(buf));
     }
-    strcat(pr, "\r\n");
-    return;
+    if(o != NULL){
+        origin_release(o);
+    }
+    if(stale){
+        // no answer from the origin: a stale copy beats an error, unless it must not
+        if((rc == RESP_NONE || rc == RESP_TIMEOUT || rc == RESP_BUSY) && !(stale->meta.flags & META_MUST_REVALIDATE)){
+            return send_cached_response(client_fd, stale, req->keep_alive);
+        }
+        cache_release(stale);
+    }
+    if(rc == RESP_DONE){
+        return keep;
+    }
+    if(f && rc == RESP_TIMEOUT){
+        flight_timeout(f);
+    }else if(f){
+        flight_finish(f, 0);
+    }
+    if(rc == RESP_TIMEOUT){
+        send_error(client_fd, "504 Gateway Timeout");
+        return 0;
+    }
+    if(rc == RESP_NONE){
+        send_error(client_fd, "502 Bad Gateway");
+        return 0;
+    }
+    if(rc == RESP_BUSY){
+        send_error(client_fd, "503 Service Unavailable");
+        return 0;
+    }
+    return rc == RESP_CLOSE ? keep : 0;
 }
-// parse request line and set request characteristics
-void parse_line(Request *req, char *buf){
-    char host_port[220];
-    sscanf(buf, "%s %s %s \n", req->method, req->url, req->version);
-    //method check
-    if(strcmp(req->method, "GET") != 0){
-        printf("ERROR(parse_line): Proxy does not implement the method\n");
-    }
-    //parsing url
-    strcpy(req->content, "/");
-    if(strstr(req->url, "://")){
-        sscanf(req->url, "%[^:]://%[^/]%s", req->protocol, host_port, req->content);
+//send response to the client, reading exactly one response from the origin
+//*keep tells whether the client connection can stay open afterwards; on a
+//304 to a conditional request *stale is sent instead (and set to NULL)
+int send_response(Upstream *up, int client_fd, Request *req, Flight *f, CacheItem **stale, int *keep){
+    Response resp;
+    CacheMeta meta;
+    ChunkBuf body;
+    Relay r;
+    char hdrs[MAXBUF];
+    char *connhdr;
+    long total;
+    int n, rc = 0;
+
+    errno = 0;
+    if((n = read_response_hdrs(&up->rio, req->head, &resp, hdrs, sizeof(hdrs) - 64)) <= 0){
+        // a read that outlived SO_RCVTIMEO fails with EAGAIN
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return RESP_TIMEOUT;
+        }
+        return n == 0 ? RESP_NONE : RESP_ERROR;
+    }
+    if(upstream_expired(up)){
+        return RESP_TIMEOUT;
+    }
+    if(*stale != NULL && resp.status == 304){
+        // not modified: the cached copy is good for another while
+        cache_revalidated(*stale, resp.fresh_until);
+        *keep = send_cached_response(client_fd, *stale, req->keep_alive);
+        *stale = NULL;
+        return resp.keep_alive ? RESP_DONE : RESP_CLOSE;
+    }
+    // what the origin no longer lets us keep must not linger stale either
+    if(response_invalidates(&resp)){
+        cache_drop(req->host, req->port, req->content);
+    }
+    r.up = up;
+    r.rp = &up->rio;
+    r.client_fd = client_fd;
+    r.cacheable = resp.cacheable;
+    r.client_dead = 0;
+    r.flight = f;
+    r.sent = 0;
+    cb_init(&body);
+    r.body = f ? &f->body : &body;
+    // the cache keeps the headers without a Connection header ...
+    response_meta(&resp, n, &meta);
+    strcpy(hdrs + n, "\r\n");
+    if(f){
+        flight_append(f, hdrs, n + 2);
+        // followers stream along only if the whole thing will be cached
+        total = !response_has_body(&resp) ? n + 2 : resp.length >= 0 ? n + 2 + resp.length : -1;
+        flight_share(f, &meta, !resp.cacheable || total >= (long)cache_max_object() ? -1 : total < 0 ? 0 : 1);
     }else{
-        sscanf(req->url, "%[^/]%s", host_port, req->content);
+        cb_append(&body, hdrs, n + 2);
     }
-    set_host_port(host_port, req->host, req->port);
-
-    //print_request(req);
-    return;
+    // ... the client gets ours: keep-alive only if it can find the end
+    *keep = req->keep_alive && resp.framed;
+    connhdr = *keep ? client_keepalive_hdr : client_close_hdr;
+    sprintf(hdrs + n, "%s\r\n", connhdr);
+    if(relay_write(&r, hdrs, strlen(hdrs)) < 0){
+        rc = -1;
+    }
+    // counted as the cache would store it, without our Connection header
+    r.sent = n + 2;
+    if(rc == 0 && response_has_body(&resp)){
+        if(resp.chunked){
+            rc = relay_chunked(&r);
+        }else{
+            rc = relay_body(&r, resp.length);
+        }
+    }
+    // cache if it's small enough for some tier (the cache takes the chunks);
+    // a flight hands its body over once the followers are done with it
+    if(f){
+        flight_finish(f, rc == 0 && r.cacheable);
+    }else if(rc == 0 && r.cacheable){
+        insert_item(req->host, req->port, req->content, &body, &meta);
+    }
+    cb_free(&body);
+    cache_count_miss(r.sent);
+    if(r.client_dead){
+        *keep = 0;
+    }
+    if(rc < 0){
+        return RESP_ERROR;
+    }
+    return resp.keep_alive ? RESP_DONE : RESP_CLOSE;
 }
-// separate host and post from host:port
-void set_host_port(char* hp, char *h, char *p){
-    char *tmp = strstr(hp, ":");
-    if(tmp){
-        *tmp = '\0';
-        strcpy(p, tmp+1);
-    }else{
-        //default port (80)
-        strcpy(p, "80");
+// send bytes to the client; a client that goes away while followers wait
+// on the flight only stops getting them, the origin is read to the end
+int relay_write(Relay *r, char *buf, size_t n){
+    if(r->client_dead){
+        return 0;
     }
-    strcpy(h, hp);
-    return;
+    if(rio_writen(r->client_fd, buf, n) < 0){
+        if(r->flight == NULL || !r->cacheable){
+            return -1;
+        }
+        r->client_dead = 1;
+    }
+    return 0;
 }
-// printing requests for debugging
-void print_request(Request *req){
-    printf("-----------printing parsed request----------\n");
-    printf("method: %s\n", req->method);
-    printf("uri: %s\n", req->url);
-    printf("protocol: %s\n", req->protocol);
-    printf("host: %s\n", req->host);
-    printf("port: %s\n", req->port);
-    printf("content: %s\n", req->content);
-    printf("version: %s\n", req->version);
-    printf("----------------done parsing!----------------\n");
+// send a piece of protocol text (headers, chunk lines) to the client
+int relay_emit(Relay *r, char *buf, size_t n){
+    if(relay_write(r, buf, n) < 0){
+        return -1;
+    }
+    r->sent += n;
+    if(r->cacheable){
+        if(r->flight){
+            flight_append(r->flight, buf, n);
+        }else{
+            cb_append(r->body, buf, n);
+        }
+        if(r->body->size >= cache_max_object()){
+            r->cacheable = 0;
+        }
+    }
+    return 0;
 }
-//send response to the client
-void send_response(int server_fd, int client_fd, Request *req){
-    rio_t server_rio;
-    char buf[MAXLINE];
-    char data[MAX_OBJECT_SIZE];
-    unsigned int data_size = 0;
-    unsigned int size;
-    // read request and send to client
-    Rio_readinitb(&server_rio, server_fd);
-    while((size = Rio_readnb(&server_rio, buf, MAXLINE)) > 0){
-        // forward to client
-        Rio_writen(client_fd, buf, size);
-        // accumulate to data only if response do not exceed MAX_OBJECT_SIZE
-        if(data_size + size < MAX_OBJECT_SIZE){
-            if(data_size){
-                strncat(data, buf, size);
-            }else{
-                xstrncpy(data, buf, size);
+// relay n body bytes (n < 0: until EOF), read straight into the body
+int relay_body(Relay *r, long n){
+    char *p;
+    size_t avail;
+    ssize_t size;
+    int rc;
+    while(n != 0){
+        if(!r->cacheable){
+            if(r->client_dead){
+                return -1;
             }
+            // no one keeps the bytes: past what rio buffered, they can
+            // go socket to socket without passing through the proxy
+            if(r->rp->rio_cnt == 0 && (rc = relay_splice(r, n)) <= 0){
+                return rc;
+            }
+            // without a pipe, keep reusing a single chunk (followers
+            // only read bodies that fit, so never a recycled one)
+            cb_recycle(r->body);
+        }
+        p = relay_reserve(r, &avail);
+        if(n > 0 && avail > n){
+            avail = n;
+        }
+        if((size = rio_readsome(r->rp, p, avail)) < 0){
+            return -1;
+        }
+        if(size == 0){
+            // EOF ends the body only when it has no length
+            return n < 0 ? 0 : -1;
+        }
+        if(upstream_expired(r->up)){
+            return -1;
+        }
+        // forward to client
+        if(relay_write(r, p, size) < 0){
+            return -1;
+        }
+        r->sent += size;
+        relay_commit(r, size);
+        // keep data only while response do not exceed the max object size
+        if(r->body->size >= cache_max_object()){
+            r->cacheable = 0;
+        }
+        if(n > 0){
+            n -= size;
         }
-        data_size += size;
-    }
-    // cache if it's smaller than MAX_OBJECT_SIZE
-    if(data_size < MAX_OBJECT_SIZE){
-        insert_item(req, data, data_size);
     }
-    return;
-}
-
-// Cache Functions
-// initialize cache
-void init_cache(){
-    cache.size = 0;
-    cache.head = malloc(sizeof(struct CacheItem));
-    CacheItem *item = cache.head;
-    strcpy(item->host, "");
-    strcpy(item->content, "");
-    item->size = 0;
-    item->data = NULL;
-    item->next = NULL;
-    item->prev = NULL;
-    item->time = clock();
-    cache.tail = item;
-    return;
+    return 0;
 }
-// check cache hit for the request
-CacheItem *cache_check(Request *req){
-    CacheItem *cur = cache.head;
-    while(cur != NULL){
-        // Cache hit!
-        if((strcmp(cur->host, req->host)==0) && (strcmp(cur->content, req->content)==0)){
-            break;
+// relay n body bytes (n < 0: until EOF) through this thread's pipe
+// with splice; 0 when done, -1 on error, 1 if there is no pipe
+int relay_splice(Relay *r, long n){
+    static __thread SplicePipe sp = {{-1, -1}, 0};
+    ssize_t size;
+    if(sp.fd[0] < 0 && splice_open(&sp) < 0){
+        return 1;
+    }
+    while(n != 0){
+        if((size = splice_in(&sp, r->rp->rio_fd, n > 0 ? n : SPLICE_CHUNK, 0)) < 0){
+            return -1;
+        }
+        if(size == 0){
+            // EOF ends the body only when it has no length
+            return n < 0 ? 0 : -1;
+        }
+        if(upstream_expired(r->up)){
+            // the pipe holds bytes for no one now
+            splice_close(&sp);
+            return -1;
+        }
+        if(splice_out(&sp, r->client_fd, 0) < 0){
+            // the pipe may hold bytes for no one now
+            splice_close(&sp);
+            return -1;
+        }
+        r->sent += size;
+        if(n > 0){
+            n -= size;
         }
-        cur = cur->next;
     }
-    return cur;
+    return 0;
 }
-// access cached response and update cache
-void send_cached_response(int fd, CacheItem *item){
-    Rio_writen(fd, item->data, item->size);
-    // update access time and location for the request
-    cache_update(item);
-    return;
+// free space at the end of the body, shared with followers or not
+char *relay_reserve(Relay *r, size_t *avail){
+    return r->flight ? flight_reserve(r->flight, avail) : cb_reserve(r->body, avail);
 }
-// change location in cachelist
-void cache_update(CacheItem *item){
-    item->time = clock();
-    CacheItem *cur = item;
-    if(cache.tail == item) return;
-    while((cur->next != NULL) && ((cur->next)->time <= item->time)){
-        cur = cur->next;
-    }
-    //insert between cur and cur_next
-    item->prev->next = item->next;
-    item->next->prev = item->prev;
-    item->next = cur->next;
-    cur->next = item;
-    item->prev = cur;
-    if(cur->next == NULL){
-        cache.tail = item;
+// n bytes of the reserved space are in use (and visible to followers)
+void relay_commit(Relay *r, size_t n){
+    if(r->flight){
+        flight_commit(r->flight, n);
     }else{
-        cur->next->prev = item;
+        cb_commit(r->body, n);
     }
-    return;
-}
-// insert new item
-void insert_item(Request *req, char *data, int size){
-    char *new_data = malloc(sizeof(char)*size);
-    strcpy(new_data, data);
-    // evict until there exist enough space
-    while(cache.size + size > MAX_CACHE_SIZE){
-        evict_LRU();
-    }
-    // generate new item
-    CacheItem *item = malloc(sizeof(struct CacheItem));
-    item->time = clock();
-    strcpy(item->host, req->host);
-    strcpy(item->content, req->content);
-    item->size = size;
-    item->data = new_data;
-    // insert new item
-    cache.tail->next = item;
-    item->prev = cache.tail;
-    item->next = NULL;
-    // update cache info
-    cache.tail = item;
-    cache.size += size;
-    return;
 }
-// evict LRU element (front element)
-void evict_LRU(){
-    if(cache.tail == cache.head){
-        printf("EROR(evict_LRU): Cannot evict from empty cache.");
-        return;
+// relay a chunked body as is: size line, data, CRLF ... then the trailers
+int relay_chunked(Relay *r){
+    char buf[MAXLINE];
+    ssize_t n;
+    long size;
+    while(1){
+        if((n = rio_readlineb(r->rp, buf, MAXLINE)) <= 0 || upstream_expired(r->up)
+            || relay_emit(r, buf, n) < 0){
+            return -1;
+        }
+        if((size = strtol(buf, NULL, 16)) <= 0){
+            break;
+        }
+        // chunk data and its CRLF
+        if(relay_body(r, size + 2) < 0){
+            return -1;
+        }
     }
-    delete_item(cache.head->next);
-    return;
+    // trailers up to the blank line
+    do{
+        if((n = rio_readlineb(r->rp, buf, MAXLINE)) <= 0 || relay_emit(r, buf, n) < 0){
+            return -1;
+        }
+    }while(strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+    return 0;
 }
-// delete item from the list
-void delete_item(CacheItem *item){
-    item->prev->next = item->next;
-    if(item == cache.tail){
-        cache.tail = item->prev;
-    }else{
-        item->next->prev = item->prev;
-    }
-    cache.size -= item->size;
-    free(item->data);
-    free(item);
+// answer the client with an empty error response
+void send_error(int fd, char *status){
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+        "HTTP/1.0 %s\r\nContent-length: 0\r\nConnection: close\r\n\r\n", status);
+    rio_writen(fd, buf, len);
     return;
 }
-// safe strcpy
-char* xstrncpy(char * dst, const char *src, size_t n){
-    dst[0] = '\0';
-    return strncat(dst, src, n);
+
+// send cached response and release it; returns whether the client stays
+int send_cached_response(int fd, CacheItem *item, int keep_alive){
+    struct iovec iov[CACHE_IOV];
+    int n, keep = keep_alive && item->meta.framed;
+    char *hdr = keep ? client_keepalive_hdr : client_close_hdr;
+    size_t off, total = item->size + strlen(hdr);
+    ssize_t rc;
+    // gather writes: headers, our Connection header, blank line and body
+    for(off = 0; off < total; off += rc){
+        n = cache_iovec(item, hdr, off, iov);
+        if((rc = iov_writen(fd, iov, n)) < 0){
+            keep = 0;
+            break;
+        }
+    }
+    // unpin the item (the hit itself already marked it referenced)
+    cache_release(item);
+    return keep;
 }
-// printing cache for debugging
-void print_cache(){
-    printf("--------------printinf cache contents--------------\n");
-    CacheItem *cur = cache.head;
-    while(cur != NULL){
-        printf("cache content: host(%s), content(%s)\n", cur->host, cur->content);
-        cur = cur->next;
+// send a response from the disk tier and release it; returns whether the client stays
+int send_disk_response(int fd, DiskHit *hit, int keep_alive){
+    struct iovec iov[3];
+    int n, keep = keep_alive && hit->meta.framed;
+    // straight from the segment's mapping
+    n = disk_iovec(hit, keep ? client_keepalive_hdr : client_close_hdr, 0, iov);
+    if(iov_writen(fd, iov, n) < 0){
+        keep = 0;
     }
-    return;
-}
\ No newline at end of file
+    disk_release(hit);
+    return keep;
+}
@@ -0,0 +1,290 @@
+/*
+ * request.c - single-pass, in-place parser of client requests
+ *
+ * The whole header block is parsed where it was read (the client's rio
+ * buffer, or the event loop's input buffer), in one pass and without
+ * copying or allocating: the request line and every header line become
+ * views into that buffer. The few strings the proxy needs as C strings
+ * (host, port and path, the cache key) are NUL-terminated in place.
+ *
+ * The request to the origin is never assembled either: request_iovec
+ * describes it as the proxy's own request line and headers plus the
+ * client's header lines in runs, for one gather write.
+ */
+#include "request.h"
+
+/* You won't lose style points for including this long line in your code */
+static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *connection_hdr = "Connection: close\r\n";
+static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static const char *version = " HTTP/1.0\r\n";
+/* Used instead when upstream connections are pooled */
+static const char *keepalive_hdr = "Connection: keep-alive\r\n";
+static const char *version_11 = " HTTP/1.1\r\n";
+
+static char *line_end(char *line, char *nl);
+static int header_is(char *line, size_t namelen, char *name);
+static int has_token(char *s, char *end, char *tok);
+static void set_host_port(Request *req, char *hp);
+
+// length of the header block at buf (through the blank line), 0 while
+// incomplete; from: length already scanned by an earlier call
+size_t request_end(char *buf, size_t len, size_t from){
+    char *p = buf, *end = buf + len, *nl;
+    // blank lines before a request do not end it
+    while(p < end && (*p == '\r' || *p == '\n')){
+        p++;
+    }
+    if(from > 2 && buf + from - 2 > p){
+        p = buf + from - 2;
+    }
+    while((nl = memchr(p, '\n', end - p)) != NULL){
+        p = nl + 1;
+        if(p < end && *p == '\n'){
+            return p + 1 - buf;
+        }
+        if(p + 1 < end && p[0] == '\r' && p[1] == '\n'){
+            return p + 2 - buf;
+        }
+    }
+    return 0;
+}
+/*
+ * parse_request - parse the header block of len bytes at block in place
+ *     returns NULL, or the status to refuse the request with: only GET
+ *     and HEAD without a body are served
+ */
+char *parse_request(Request *req, char *block, size_t len){
+    char *p = block, *end = block + len, *eol, *next, *url, *urlend, *ver, *a, *path, *colon, *v;
+    struct iovec *run;
+
+    req->host = NULL;
+    req->nruns = 0;
+    req->conditional = 0;
+    while(p < end && (*p == '\r' || *p == '\n')){
+        p++;
+    }
+    // request line: method SP url SP version
+    if((next = memchr(p, '\n', end - p)) == NULL){
+        return "400 Bad Request";
+    }
+    eol = line_end(p, next);
+    if((url = memchr(p, ' ', eol - p)) == NULL){
+        return "400 Bad Request";
+    }
+    req->method.iov_base = p;
+    req->method.iov_len = url - p;
+    // only methods without a request body, whose responses the cache
+    // key can stand for
+    req->head = req->method.iov_len == 4 && !memcmp(p, "HEAD", 4);
+    if(!req->head && (req->method.iov_len != 3 || memcmp(p, "GET", 3))){
+        return "501 Not Implemented";
+    }
+    url++;
+    if((urlend = memchr(url, ' ', eol - url)) == NULL){
+        urlend = eol;
+    }
+    ver = urlend < eol ? urlend + 1 : eol;
+    // HTTP/1.1 clients keep the connection unless they say otherwise
+    req->keep_alive = ver < eol && !(eol - ver == 8 && !memcmp(ver, "HTTP/1.0", 8));
+
+    // url: [scheme://]host[:port][/path] or /path
+    path = url;
+    if(url < urlend && *url != '/'){
+        for(a = url; a < urlend && *a != '/'; a++)
+            ;
+        if(a > url && a[-1] == ':' && a + 1 < urlend && a[1] == '/'){
+            a += 2;
+        }else{
+            a = url;
+        }
+        for(path = a; path < urlend && *path != '/'; path++)
+            ;
+        // slide host[:port] one byte left, over the '/' or ' ' before
+        // it, to make room for its NUL without touching the path
+        memmove(a - 1, a, path - a);
+        path[-1] = '\0';
+        set_host_port(req, a - 1);
+    }
+    if(path < urlend){
+        *urlend = '\0';
+        req->content = path;
+    }else{
+        req->content = "/";
+    }
+
+    // headers: drop the ones the proxy sets itself, forward the rest
+    for(p = next + 1; p < end; p = next + 1){
+        if((next = memchr(p, '\n', end - p)) == NULL || (eol = line_end(p, next)) == p){
+            break;
+        }
+        colon = memchr(p, ':', eol - p);
+        if(colon == NULL){
+            colon = p;
+        }
+        if(header_is(p, colon - p, "Connection") || header_is(p, colon - p, "Proxy-Connection")){
+            // the client's keep-alive wish
+            if(has_token(colon, eol, "close")){
+                req->keep_alive = 0;
+            }else if(has_token(colon, eol, "keep-alive")){
+                req->keep_alive = 1;
+            }
+        }else if(header_is(p, colon - p, "User-Agent")){
+        }else if(header_is(p, colon - p, "Host")){
+            // the host of the url wins over the Host header
+            if(req->host == NULL){
+                for(v = colon + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+                    ;
+                while(eol > v && (eol[-1] == ' ' || eol[-1] == '\t')){
+                    eol--;
+                }
+                *eol = '\0';
+                set_host_port(req, v);
+            }
+        }else if(header_is(p, colon - p, "Transfer-Encoding")
+            || (header_is(p, colon - p, "Content-Length") && strtol(colon + 1, NULL, 10) != 0)){
+            // a body is not read: it would be taken for the next request
+            return "501 Not Implemented";
+        }else{
+            if(header_is(p, colon - p, "If-None-Match") || header_is(p, colon - p, "If-Modified-Since")){
+                req->conditional = 1;
+            }
+            // other headers, as they are; adjacent lines share a run
+            run = req->nruns > 0 ? &req->runs[req->nruns - 1] : NULL;
+            if(run != NULL && (char *)run->iov_base + run->iov_len == p){
+                run->iov_len += next + 1 - p;
+            }else if(req->nruns == REQ_MAX_RUNS){
+                return "431 Request Header Fields Too Large";
+            }else{
+                run = &req->runs[req->nruns++];
+                run->iov_base = p;
+                run->iov_len = next + 1 - p;
+            }
+        }
+    }
+    if(req->host == NULL){
+        req->host = "";
+        req->port = "80";
+    }
+    if(strlen(req->host) >= REQ_MAX_HOST || strlen(req->port) >= REQ_MAX_PORT
+        || strlen(req->content) >= REQ_MAX_CONTENT){
+        return "414 URI Too Long";
+    }
+    return NULL;
+}
+// describe the request to the origin in at most REQ_IOV iovecs, with
+// the header lines in extra (if not NULL) added; returns the count
+int request_iovec(Request *req, int pooled, char *extra, struct iovec *iov){
+    char *parts[9];
+    int i, n = 0, np = 0;
+    iov[n++] = req->method;
+    parts[np++] = " ";
+    parts[np++] = req->content;
+    parts[np++] = (char *)(pooled ? version_11 : version);
+    if(req->host[0]){
+        parts[np++] = "Host: ";
+        parts[np++] = req->host;
+        parts[np++] = ":";
+        parts[np++] = req->port;
+        parts[np++] = "\r\n";
+    }
+    for(i = 0; i < np; i++){
+        iov[n].iov_base = parts[i];
+        iov[n++].iov_len = strlen(parts[i]);
+    }
+    iov[n].iov_base = (char *)user_agent_hdr;
+    iov[n++].iov_len = strlen(user_agent_hdr);
+    if(pooled){
+        iov[n].iov_base = (char *)keepalive_hdr;
+        iov[n++].iov_len = strlen(keepalive_hdr);
+    }else{
+        iov[n].iov_base = (char *)connection_hdr;
+        iov[n++].iov_len = strlen(connection_hdr);
+        iov[n].iov_base = (char *)proxy_connection_hdr;
+        iov[n++].iov_len = strlen(proxy_connection_hdr);
+    }
+    for(i = 0; i < req->nruns; i++){
+        iov[n++] = req->runs[i];
+    }
+    if(extra != NULL){
+        iov[n].iov_base = extra;
+        iov[n++].iov_len = strlen(extra);
+    }
+    iov[n].iov_base = "\r\n";
+    iov[n++].iov_len = 2;
+    return n;
+}
+/*
+ * rio_readrequest - read one header block into rp's own buffer
+ *     *block points at it there, valid until the next read from rp.
+ *     returns its length, 0 on EOF or error, -1 if it does not fit
+ */
+ssize_t rio_readrequest(rio_t *rp, char **block){
+    size_t len, scanned = 0;
+    ssize_t n;
+    while((len = request_end(rp->rio_bufptr, rp->rio_cnt, scanned)) == 0){
+        scanned = rp->rio_cnt;
+        // what is there so far moves to the front, the rest reads after it
+        if(rp->rio_bufptr != rp->rio_buf){
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        if(rp->rio_cnt == sizeof(rp->rio_buf)){
+            return -1;
+        }
+        while((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt)) < 0
+            && errno == EINTR)
+            ;
+        if(n <= 0){
+            return 0;
+        }
+        rp->rio_cnt += n;
+    }
+    *block = rp->rio_bufptr;
+    rp->rio_bufptr += len;
+    rp->rio_cnt -= len;
+    return len;
+}
+// printing requests for debugging
+void print_request(Request *req){
+    int i;
+    printf("-----------printing parsed request----------\n");
+    printf("method: %.*s\n", (int)req->method.iov_len, (char *)req->method.iov_base);
+    printf("host: %s\n", req->host);
+    printf("port: %s\n", req->port);
+    printf("content: %s\n", req->content);
+    printf("keep-alive: %d\n", req->keep_alive);
+    for(i = 0; i < req->nruns; i++){
+        printf("%.*s", (int)req->runs[i].iov_len, (char *)req->runs[i].iov_base);
+    }
+    printf("----------------done parsing!----------------\n");
+}
+
+// end of the line whose '\n' is at nl, before the CR if there is one
+static char *line_end(char *line, char *nl){
+    return (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+}
+// is the header line's name (namelen bytes) name? (case-insensitive;
+// the first letter decides most lines)
+static int header_is(char *line, size_t namelen, char *name){
+    return (line[0] | 0x20) == (name[0] | 0x20) && namelen == strlen(name)
+        && !strncasecmp(line, name, namelen);
+}
+// does s..end contain token tok? (case-insensitive)
+static int has_token(char *s, char *end, char *tok){
+    size_t n = strlen(tok);
+    for(; s + n <= end; s++){
+        if(!strncasecmp(s, tok, n)) return 1;
+    }
+    return 0;
+}
+// split host:port in place (default port 80)
+static void set_host_port(Request *req, char *hp){
+    char *colon = strchr(hp, ':');
+    req->host = hp;
+    req->port = "80";
+    if(colon){
+        *colon = '\0';
+        if(colon[1]) req->port = colon + 1;
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * request.h - client requests, parsed in place; shared by the threaded
+ * and event-driven proxy
+ */
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include "csapp.h"
+
+/* Longest host, port and path taken (flight, pool and resolver keys
+   are arrays of these sizes) */
+#define REQ_MAX_HOST 200
+#define REQ_MAX_PORT 10
+#define REQ_MAX_CONTENT 1000
+/* Client header lines are forwarded in runs, split where the proxy drops
+   one; a request with more runs than this is refused */
+#define REQ_MAX_RUNS 16
+/* Max iovecs of a request to the origin */
+#define REQ_IOV (REQ_MAX_RUNS + 14)
+
+/* A request, as views into the buffer it was parsed in (which must
+   outlive it). host, port and content are NUL-terminated in place. */
+typedef struct{
+    struct iovec method;
+    int head;                   /* HEAD: the response has no body */
+    char *host;
+    char *port;
+    char *content;              /* path of the object */
+    int keep_alive;             /* client wants the connection kept open */
+    int conditional;            /* client sent validators of its own */
+    struct iovec runs[REQ_MAX_RUNS];    /* header lines to forward */
+    int nruns;
+} Request;
+
+size_t request_end(char *buf, size_t len, size_t from);
+char *parse_request(Request *req, char *block, size_t len);
+int request_iovec(Request *req, int pooled, char *extra, struct iovec *iov);
+ssize_t rio_readrequest(rio_t *rp, char **block);
+void print_request(Request *req);
+
+#endif /* __REQUEST_H__ */
@@ -0,0 +1,276 @@
+/*
+ * slab.c - size-classed slab allocator for cache memory
+ *
+ * One pool is mapped up front and handed out in SLAB_SIZE slabs, each
+ * slab to one size class on demand and cut into objects of that size.
+ * Freed objects go back on their slab's free list, so an object of a
+ * class always reuses the place of an earlier one instead of leaving
+ * holes in the heap. The classes are 25% apart, which bounds the space
+ * lost to rounding up.
+ *
+ * A slab stays with its class while any of its objects is in use; once
+ * the last one is freed, the slab goes back to the pool for any class
+ * to take. When a class needs memory and the pool has no slab left,
+ * or before slab_init, the object comes from malloc (still in its class
+ * size, so what it is charged stays the same); slab_free tells the two
+ * apart by address.
+ *
+ * A shared pool (for proxy processes forked after slab_init) keeps its
+ * bookkeeping at the start of the MAP_SHARED mapping, under process-
+ * shared locks. It maps at the same address in every process, so the
+ * pointers in it hold everywhere; objects from malloc do not, and
+ * slab_owns tells which ones may go into shared structures.
+ */
+#include "slab.h"
+
+/* What the pool knows about one slab (under its class's lock while the
+   class has it, else under the pool's) */
+typedef struct{
+    void *free;                 /* freed objects, linked through them */
+    int carved;                 /* objects cut from the slab so far */
+    int used;                   /* ... of them in use */
+    int cls;
+    long prev, next;            /* on the class's list of slabs with room,
+                                   or (next) on the pool's of free slabs */
+} SlabInfo;
+
+typedef struct{
+    char *base;                 /* the pool, NULL before slab_init */
+    size_t nslabs;
+    size_t next_slab;           /* slabs never handed out start here */
+    long free_slabs;            /* slabs given back, -1 if none */
+    size_t nfree;               /* ... how many */
+    pthread_mutex_t lock;
+    SlabInfo *info;             /* one for each slab */
+    SlabClass classes[SLAB_CLASSES];
+    long fallbacks;
+} SlabPool;
+
+static SlabPool local_pool = {NULL, 0, 0, -1, 0, PTHREAD_MUTEX_INITIALIZER};
+static SlabPool *slab = &local_pool;
+
+static int class_of(size_t size);
+static int grow(int cls);
+static void unlink_slab(SlabClass *sc, long n);
+
+// map a pool of pool_size bytes (rounded down to whole slabs); once.
+// shared: one pool for this process and the ones it forks from now on
+void slab_init(size_t pool_size, int shared){
+    pthread_mutexattr_t attr;
+    size_t base, nslabs = pool_size / SLAB_SIZE, meta;
+    char *m;
+    int i;
+    if(slab->classes[0].size != 0){
+        return;
+    }
+    pthread_mutexattr_init(&attr);
+    if(shared){
+        // bookkeeping, what it knows of each slab, then the slabs (page aligned)
+        meta = (sizeof(SlabPool) + nslabs * sizeof(SlabInfo) + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE;
+        m = Mmap(NULL, meta + nslabs * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        slab = (SlabPool *)m;
+        slab->info = (SlabInfo *)(slab + 1);
+        slab->base = nslabs ? m + meta : NULL;
+        slab->free_slabs = -1;
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&slab->lock, &attr);
+    }
+    for(i = 0; i < SLAB_CLASSES; i++){
+        // 64, 80, 96, 112, 128, 160, ... 28672, 32768
+        base = (size_t)SLAB_MIN << (i / 4);
+        slab->classes[i].size = base + base * (i % 4) / 4;
+        slab->classes[i].partial = -1;
+        pthread_mutex_init(&slab->classes[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    slab->nslabs = nslabs;
+    if(shared || nslabs == 0){
+        return;
+    }
+    // pages are only backed by memory once touched
+    slab->base = Mmap(NULL, nslabs * SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    slab->info = Calloc(nslabs, sizeof(SlabInfo));
+}
+// take every object back into a shared pool, whose users are all gone
+// (even if one of them died holding a lock of it)
+void slab_reset(){
+    pthread_mutexattr_t attr;
+    int i;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&slab->lock, &attr);
+    slab->next_slab = 0;
+    slab->free_slabs = -1;
+    slab->nfree = 0;
+    for(i = 0; i < SLAB_CLASSES; i++){
+        pthread_mutex_init(&slab->classes[i].lock, &attr);
+        slab->classes[i].partial = -1;
+        slab->classes[i].used = 0;
+        slab->classes[i].slabs = 0;
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+// an object of at least size bytes (slab_size(size) of them, really)
+void *slab_alloc(size_t size){
+    SlabClass *sc;
+    SlabInfo *si;
+    void *p;
+    long n;
+    int cls = class_of(size);
+    if(cls < 0){
+        return Malloc(size);
+    }
+    sc = &slab->classes[cls];
+    pthread_mutex_lock(&sc->lock);
+    if(sc->partial < 0 && !grow(cls)){
+        pthread_mutex_unlock(&sc->lock);
+        __atomic_add_fetch(&slab->fallbacks, 1, __ATOMIC_RELAXED);
+        return Malloc(sc->size);
+    }
+    n = sc->partial;
+    si = &slab->info[n];
+    // a freed object first; else the next one never cut from the slab
+    if((p = si->free) != NULL){
+        si->free = *(void **)p;
+    }else{
+        p = slab->base + n * SLAB_SIZE + si->carved++ * sc->size;
+    }
+    si->used++;
+    sc->used++;
+    if(si->free == NULL && si->carved == SLAB_SIZE / sc->size){
+        unlink_slab(sc, n);
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return p;
+}
+// give back an object of slab_alloc; its slab goes back to the pool
+// with the last one
+void slab_free(void *p){
+    SlabClass *sc;
+    SlabInfo *si;
+    long n;
+    int full;
+    if(!slab_owns(p)){
+        free(p);
+        return;
+    }
+    // the slab cannot change class while p is in use
+    n = ((char *)p - slab->base) / SLAB_SIZE;
+    si = &slab->info[n];
+    sc = &slab->classes[si->cls];
+    pthread_mutex_lock(&sc->lock);
+    full = si->free == NULL && si->carved == SLAB_SIZE / sc->size;
+    *(void **)p = si->free;
+    si->free = p;
+    si->used--;
+    sc->used--;
+    if(si->used == 0){
+        if(!full){
+            unlink_slab(sc, n);
+        }
+        sc->slabs--;
+        pthread_mutex_lock(&slab->lock);
+        si->next = slab->free_slabs;
+        slab->free_slabs = n;
+        slab->nfree++;
+        pthread_mutex_unlock(&slab->lock);
+    }else if(full){
+        // room again: first in line for the next allocation
+        si->prev = -1;
+        si->next = sc->partial;
+        if(sc->partial >= 0){
+            slab->info[sc->partial].prev = n;
+        }
+        sc->partial = n;
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+// is p in the pool (not from malloc)?
+int slab_owns(void *p){
+    return slab->base != NULL && (char *)p >= slab->base && (char *)p < slab->base + slab->nslabs * SLAB_SIZE;
+}
+// slabs no class has: never handed out, or given back
+size_t slab_spare(){
+    size_t n;
+    pthread_mutex_lock(&slab->lock);
+    n = slab->nslabs - slab->next_slab + slab->nfree;
+    pthread_mutex_unlock(&slab->lock);
+    return n;
+}
+// bytes an allocation of size really takes
+size_t slab_size(size_t size){
+    int cls = class_of(size);
+    return cls < 0 ? size : slab->classes[cls].size;
+}
+// one line of statistics
+void slab_report(FILE *fp){
+    size_t used = 0;
+    int i;
+    for(i = 0; i < SLAB_CLASSES; i++){
+        pthread_mutex_lock(&slab->classes[i].lock);
+        used += slab->classes[i].used * slab->classes[i].size;
+        pthread_mutex_unlock(&slab->classes[i].lock);
+    }
+    pthread_mutex_lock(&slab->lock);
+    fprintf(fp, "slab: %zu/%zu slabs handed out, %zu bytes in use, %ld allocations past the pool\n",
+        slab->next_slab - slab->nfree, slab->nslabs, used, __atomic_load_n(&slab->fallbacks, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&slab->lock);
+}
+
+// smallest class that fits size, -1 if none does
+static int class_of(size_t size){
+    int lo = 0, hi = SLAB_CLASSES - 1, mid;
+    if(size > SLAB_MAX || slab->classes[0].size == 0){
+        return -1;
+    }
+    while(lo < hi){
+        mid = (lo + hi) / 2;
+        if(slab->classes[mid].size < size) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+// give class cls a free slab, one given back or else a fresh one (class
+// lock held); 0 if the pool is used up
+static int grow(int cls){
+    SlabClass *sc = &slab->classes[cls];
+    SlabInfo *si;
+    long n;
+    pthread_mutex_lock(&slab->lock);
+    if(slab->free_slabs >= 0){
+        n = slab->free_slabs;
+        slab->free_slabs = slab->info[n].next;
+        slab->nfree--;
+    }else if(slab->next_slab < slab->nslabs){
+        n = slab->next_slab++;
+    }else{
+        pthread_mutex_unlock(&slab->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&slab->lock);
+    // objects are cut from it as they are needed
+    si = &slab->info[n];
+    si->free = NULL;
+    si->carved = 0;
+    si->used = 0;
+    si->cls = cls;
+    si->prev = -1;
+    si->next = sc->partial;
+    if(sc->partial >= 0){
+        slab->info[sc->partial].prev = n;
+    }
+    sc->partial = n;
+    sc->slabs++;
+    return 1;
+}
+// take slab n off the list of class sc's slabs with room (class lock held)
+static void unlink_slab(SlabClass *sc, long n){
+    SlabInfo *si = &slab->info[n];
+    if(si->prev >= 0){
+        slab->info[si->prev].next = si->next;
+    }else{
+        sc->partial = si->next;
+    }
+    if(si->next >= 0){
+        slab->info[si->next].prev = si->prev;
+    }
+}
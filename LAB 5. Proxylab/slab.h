@@ -0,0 +1,34 @@
+/*
+ * slab.h - size-classed slab allocator for cache memory
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+/* The pool is handed to size classes in slabs of this many bytes */
+#define SLAB_SIZE (64 << 10)
+/* Size classes: 4 per power of two from SLAB_MIN up to SLAB_MAX */
+#define SLAB_MIN 64
+#define SLAB_MAX (32 << 10)
+#define SLAB_CLASSES 37
+
+/* One size class: the slabs its objects come from */
+typedef struct{
+    pthread_mutex_t lock;
+    size_t size;
+    long partial;               /* first of its slabs with room left, -1 if none */
+    long used;                  /* objects handed out */
+    long slabs;
+} SlabClass;
+
+void slab_init(size_t pool_size, int shared);
+void slab_reset();
+void *slab_alloc(size_t size);
+void slab_free(void *p);
+int slab_owns(void *p);
+size_t slab_spare();
+size_t slab_size(size_t size);
+void slab_report(FILE *fp);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,202 @@
+/*
+ * snapshot.c - cache image for warm restarts
+ *
+ * snapshot_save writes every object of the memory cache to one file:
+ * a header, then a record per object with the CacheMeta the cache kept,
+ * the key and the response bytes. Objects are pinned a shard at a time
+ * and written outside the shard lock, oldest first, to a temporary file
+ * that is synced to disk and renamed over the image, and the directory
+ * is synced after the rename, so neither a crash nor a power loss
+ * leaves half of one.
+ *
+ * snapshot_load maps an image read-only and inserts its objects in the
+ * same order, so the youngest end up where the policy keeps them
+ * longest. Nothing is parsed again: the metadata is used as saved.
+ * Expired objects come back only if they kept validators, to be
+ * revalidated on their first hit; the rest are skipped.
+ *
+ * Image layout: SnapHeader, then per object SnapRecord, key
+ * ("host\0port\0content\0"), response bytes, padded to 8 bytes. An
+ * image of another build (CacheMeta size) is ignored.
+ */
+#include "snapshot.h"
+
+#define SNAP_MAGIC 0x50585331u     /* "PXS1" */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct{
+    unsigned int magic;
+    unsigned int meta_size;     /* sizeof(CacheMeta) of the build that wrote it */
+    unsigned long count;
+    long saved;                 /* time() of the snapshot */
+} SnapHeader;
+
+typedef struct{
+    unsigned int keylen;        /* host, port and content, with their NULs */
+    unsigned int hostlen;
+    unsigned int portlen;
+    unsigned long size;
+    CacheMeta meta;
+} SnapRecord;
+
+static int write_item(FILE *fp, CacheItem *item);
+static int sync_dir(char *path);
+
+// write the memory cache to path; the number of objects, -1 on error
+int snapshot_save(char *path){
+    char tmp[MAXLINE];
+    SnapHeader h = {SNAP_MAGIC, sizeof(CacheMeta), 0, 0};
+    CacheItem **items, *item;
+    CacheShard *sh;
+    FILE *fp;
+    int i, l, n, k, rc = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if((fp = fopen(tmp, "w")) == NULL){
+        return -1;
+    }
+    h.saved = time(NULL);
+    // the count is filled in at the end
+    if(fwrite(&h, sizeof(h), 1, fp) != 1){
+        rc = -1;
+    }
+    for(i = 0; i < CACHE_SHARDS && rc == 0; i++){
+        // pin the shard's objects, then write them without the lock
+        sh = &cache.shards[i];
+        pthread_rwlock_rdlock(&sh->lock);
+        items = Malloc((sh->count + 1) * sizeof(CacheItem *));
+        n = 0;
+        for(l = 0; l < 2; l++){
+            for(item = sh->lists[l].head; item != NULL; item = item->next){
+                __atomic_add_fetch(&item->refcnt, 1, __ATOMIC_RELAXED);
+                items[n++] = item;
+            }
+        }
+        pthread_rwlock_unlock(&sh->lock);
+        for(k = 0; k < n; k++){
+            if(rc == 0 && write_item(fp, items[k]) < 0){
+                rc = -1;
+            }
+            cache_release(items[k]);
+        }
+        free(items);
+        h.count += n;
+    }
+    if(rc == 0 && (fseek(fp, 0, SEEK_SET) < 0 || fwrite(&h, sizeof(h), 1, fp) != 1)){
+        rc = -1;
+    }
+    // the data must be on disk before the rename can be
+    if(rc == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) < 0)){
+        rc = -1;
+    }
+    if(fclose(fp) != 0 || rc < 0 || rename(tmp, path) < 0){
+        unlink(tmp);
+        return -1;
+    }
+    if(sync_dir(path) < 0){
+        return -1;
+    }
+    return h.count;
+}
+
+// map the image at path and insert its objects into the (empty) cache;
+// the number restored, -1 if there is no usable image
+int snapshot_load(char *path){
+    SnapHeader h;
+    SnapRecord r;
+    ChunkBuf body;
+    struct stat st;
+    char *map, *p, *end, *host;
+    time_t now = time(NULL);
+    unsigned long i;
+    int fd, n = 0;
+
+    if((fd = open(path, O_RDONLY)) < 0){
+        return -1;
+    }
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(h)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED){
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    // read in order, once
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    memcpy(&h, map, sizeof(h));
+    if(h.magic != SNAP_MAGIC || h.meta_size != sizeof(CacheMeta)){
+        munmap(map, st.st_size);
+        return -1;
+    }
+    p = map + sizeof(h);
+    end = map + st.st_size;
+    for(i = 0; i < h.count && end - p >= (long)sizeof(r); i++){
+        memcpy(&r, p, sizeof(r));
+        if(r.keylen > end - p - sizeof(r) || r.size > end - p - sizeof(r) - r.keylen
+            || r.hostlen + r.portlen >= r.keylen || p[sizeof(r) + r.keylen - 1] != '\0'){
+            break;
+        }
+        host = p + sizeof(r);
+        p += ALIGN8(sizeof(r) + r.keylen + r.size);
+        // an expired object is only worth its validators
+        if(now >= r.meta.expires && !r.meta.etag_len && !r.meta.modified_len){
+            continue;
+        }
+        cb_init(&body);
+        cb_append(&body, host + r.keylen, r.size);
+        insert_item(host, host + r.hostlen, host + r.hostlen + r.portlen, &body, &r.meta);
+        n++;
+    }
+    munmap(map, st.st_size);
+    return n;
+}
+
+// one record: header, key, response bytes, padding
+static int write_item(FILE *fp, CacheItem *item){
+    static const char pad[8];
+    struct iovec iov[CACHE_IOV];
+    SnapRecord r;
+    size_t off, len;
+    int i, cnt;
+
+    r.hostlen = strlen(item->host) + 1;
+    r.portlen = strlen(item->port) + 1;
+    r.keylen = r.hostlen + r.portlen + strlen(item->content) + 1;
+    r.size = item->size;
+    r.meta = item->meta;
+    if(fwrite(&r, sizeof(r), 1, fp) != 1 || fwrite(item->key, r.keylen, 1, fp) != 1){
+        return -1;
+    }
+    for(off = 0; off < item->size; off += len){
+        cnt = cb_iovec(&item->body, off, item->size - off, iov, CACHE_IOV);
+        for(i = 0, len = 0; i < cnt; i++){
+            if(fwrite(iov[i].iov_base, iov[i].iov_len, 1, fp) != 1){
+                return -1;
+            }
+            len += iov[i].iov_len;
+        }
+    }
+    len = ALIGN8(sizeof(r) + r.keylen + r.size) - (sizeof(r) + r.keylen + r.size);
+    if(len && fwrite(pad, len, 1, fp) != 1){
+        return -1;
+    }
+    return 0;
+}
+// make a rename in the directory of path durable
+static int sync_dir(char *path){
+    char dir[MAXLINE], *slash;
+    int fd, rc;
+    snprintf(dir, sizeof(dir), "%s", path);
+    if((slash = strrchr(dir, '/')) == NULL){
+        strcpy(dir, ".");
+    }else if(slash == dir){
+        dir[1] = '\0';
+    }else{
+        *slash = '\0';
+    }
+    if((fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0){
+        return -1;
+    }
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
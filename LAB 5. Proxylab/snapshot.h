@@ -0,0 +1,16 @@
+/*
+ * snapshot.h - cache image for warm restarts
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Default seconds between two periodic snapshots */
+#define SNAPSHOT_PERIOD 300
+
+int snapshot_save(char *path);
+int snapshot_load(char *path);
+
+#endif /* __SNAPSHOT_H__ */
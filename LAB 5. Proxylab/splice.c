@@ -0,0 +1,86 @@
+/*
+ * splice.c - zero-copy relay between sockets through a pipe
+ *
+ * splice() moves bytes between a socket and a pipe inside the kernel,
+ * so a response that no one keeps can go from the origin's socket to
+ * the client's without being read into the proxy and written out again:
+ * socket -> pipe (splice_in), pipe -> socket (splice_out). The pipe
+ * only holds page references on the way.
+ *
+ * splice() is a GNU extension, and csapp.h does not build with
+ * _GNU_SOURCE, so this file stands alone.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "splice.h"
+
+static long spliced;    /* bytes moved out of pipes, by all threads */
+
+// open the pipe; -1 if there is none to be had
+int splice_open(SplicePipe *sp){
+    sp->len = 0;
+    if(pipe2(sp->fd, O_CLOEXEC) < 0){
+        sp->fd[0] = sp->fd[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+// close the pipe, dropping whatever is still in it
+void splice_close(SplicePipe *sp){
+    if(sp->fd[0] >= 0){
+        close(sp->fd[0]);
+        close(sp->fd[1]);
+    }
+    sp->fd[0] = sp->fd[1] = -1;
+    sp->len = 0;
+}
+/*
+ * splice_in - move up to n bytes from socket fd into the pipe, no more
+ *     than fit (so it never waits for room). Returns the count, 0 on
+ *     EOF, -1 on error (EAGAIN with nonblock).
+ */
+ssize_t splice_in(SplicePipe *sp, int fd, size_t n, int nonblock){
+    ssize_t rc;
+    if(n > SPLICE_CHUNK - sp->len){
+        n = SPLICE_CHUNK - sp->len;
+    }
+    while((rc = splice(fd, NULL, sp->fd[1], NULL, n,
+        SPLICE_F_MOVE | (nonblock ? SPLICE_F_NONBLOCK : 0))) < 0 && errno == EINTR)
+        ;
+    if(rc > 0){
+        sp->len += rc;
+    }
+    return rc;
+}
+/*
+ * splice_out - move the bytes in the pipe to socket fd; blocking, all
+ *     of them, else as many as the socket takes. Returns the count, -1
+ *     on error (EAGAIN with nonblock and nothing moved).
+ */
+ssize_t splice_out(SplicePipe *sp, int fd, int nonblock){
+    size_t done = 0;
+    ssize_t rc;
+    while(sp->len > 0){
+        rc = splice(sp->fd[0], NULL, fd, NULL, sp->len,
+            SPLICE_F_MOVE | (nonblock ? SPLICE_F_NONBLOCK : 0));
+        if(rc < 0 && errno == EINTR){
+            continue;
+        }
+        if(rc <= 0){
+            if(done > 0 && nonblock){
+                break;
+            }
+            return -1;
+        }
+        sp->len -= rc;
+        done += rc;
+    }
+    __atomic_add_fetch(&spliced, done, __ATOMIC_RELAXED);
+    return done;
+}
+// one line of statistics
+void splice_report(FILE *fp){
+    fprintf(fp, "splice: %ld bytes relayed\n", __atomic_load_n(&spliced, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,25 @@
+/*
+ * splice.h - zero-copy relay between sockets through a pipe
+ */
+#ifndef __SPLICE_H__
+#define __SPLICE_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Most bytes moved into a pipe per call (the default pipe capacity) */
+#define SPLICE_CHUNK (64 << 10)
+
+/* A pipe that bytes pass through on their way between two sockets */
+typedef struct{
+    int fd[2];          /* read end, write end; -1 while closed */
+    size_t len;         /* bytes in the pipe, not yet moved out */
+} SplicePipe;
+
+int splice_open(SplicePipe *sp);
+void splice_close(SplicePipe *sp);
+ssize_t splice_in(SplicePipe *sp, int fd, size_t n, int nonblock);
+ssize_t splice_out(SplicePipe *sp, int fd, int nonblock);
+void splice_report(FILE *fp);
+
+#endif /* __SPLICE_H__ */
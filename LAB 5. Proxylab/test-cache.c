@@ -0,0 +1,476 @@
+/*
+ * test-cache.c - multi-threaded stress test for the proxy cache
+ *
+ * Many threads hammer the cache with a mix of lookups and inserts over a
+ * shared key space. Every object's size and bytes are a function of its
+ * key, so a reader can verify each hit while it holds the item. Any
+ * mismatch, or a cache over its byte budget, fails the test. With -d,
+ * evicted objects go to a small disk tier in that directory, and lookups
+ * that miss in memory verify what the disk returns. With -P, the cache
+ * is shared and that many processes run the threads; the parent then
+ * verifies every object they left. With -s, the cache left by the
+ * stress run is saved to that snapshot file and restored into an empty
+ * cache, which must then hold the same objects. Before the stress run,
+ * responses with caching headers check freshness and validators; once
+ * the cache is cleared, slabs one size class emptied must serve another,
+ * and with -P, a pool taken by one size must still cache another.
+ * usage: ./test-cache [-t threads] [-n ops per thread] [-k keys] [-w insert %]
+ *                    [-p policy] [-d disk dir] [-P processes] [-s snapshot]
+ */
+#include <getopt.h>
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+#include "http.h"
+#include "slab.h"
+#include "snapshot.h"
+
+#define TEST_DISK_CAPACITY (512 << 10)
+
+static int nthreads = 16;
+static long nops = 200000;
+static int nkeys = 2000;
+static int write_pct = 10;
+static int nprocs = 1;
+static long errors = 0;
+static long total_hits = 0;
+static long disk_hits = 0;
+
+static int object_size(int key){
+    return 16 + (key * 37) % 4080;
+}
+static char object_byte(int key, int i){
+    return (char)((key * 131 + i) & 0xff);
+}
+// does a cached item hold exactly the object of key?
+static int item_ok(CacheItem *item, int key){
+    int size = object_size(key), j = 0, k;
+    Chunk *chunk;
+    if(item->size != size || item->body.size != size){
+        return 0;
+    }
+    for(chunk = item->body.head; chunk; chunk = chunk->next){
+        for(k = 0; k < chunk->len; k++, j++){
+            if(chunk->data[k] != object_byte(key, j)){
+                return 0;
+            }
+        }
+    }
+    return j == size;
+}
+
+// parse a response head and cache it; the item, pinned, or NULL if the
+// response may not be cached
+static CacheItem *cache_head(char *path, char *head){
+    char hdrs[MAXBUF];
+    Response resp;
+    CacheMeta meta;
+    ChunkBuf body;
+    int n;
+    if((n = parse_response_hdrs(head, 0, &resp, hdrs, sizeof(hdrs))) < 0 || !resp.cacheable){
+        return NULL;
+    }
+    response_meta(&resp, n, &meta);
+    cb_init(&body);
+    cb_append(&body, hdrs, n);
+    cb_append(&body, "\r\n", 2);
+    insert_item("fresh.example.com", "80", path, &body, &meta);
+    return cache_check("fresh.example.com", "80", path);
+}
+// does a response with this head make the cache forget its copy?
+static int head_invalidates(char *head){
+    char hdrs[MAXBUF];
+    Response resp;
+    return parse_response_hdrs(head, 0, &resp, hdrs, sizeof(hdrs)) >= 0 && response_invalidates(&resp);
+}
+static void check(int ok, char *what){
+    if(!ok){
+        printf("FAIL: %s\n", what);
+        errors++;
+    }
+}
+// freshness from caching headers, validators and revalidation
+static void check_freshness(){
+    char cond[CACHE_COND_MAX];
+    CacheItem *item;
+    time_t now = time(NULL);
+
+    item = cache_head("/etag", "HTTP/1.1 200 OK\r\nCache-Control: max-age=0\r\nETag: \"v1\"\r\n"
+        "Last-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n");
+    check(item != NULL && !cache_fresh(item), "max-age=0 is cached, stale");
+    if(item != NULL){
+        check(cache_validators(item, cond, sizeof(cond)) > 0 && !strcmp(cond,
+            "If-None-Match: \"v1\"\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"),
+            "validators become conditional headers");
+        cache_revalidated(item, now + 60);
+        check(cache_fresh(item), "a 304 makes it fresh");
+        cache_release(item);
+    }
+
+    item = cache_head("/max-age", "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=\"600\"\r\n"
+        "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n\r\n");
+    check(item != NULL && cache_fresh(item) && item->meta.expires >= now + 599,
+        "max-age wins over Expires");
+    check(item != NULL && cache_validators(item, cond, sizeof(cond)) == 0, "no validators, no headers");
+    if(item) cache_release(item);
+
+    item = cache_head("/expired", "HTTP/1.0 200 OK\r\nExpires: 0\r\n\r\n");
+    check(item != NULL && !cache_fresh(item), "an invalid Expires has expired");
+    if(item) cache_release(item);
+
+    item = cache_head("/no-cache", "HTTP/1.1 200 OK\r\nCache-Control: no-cache, max-age=600\r\nETag: \"x\"\r\n\r\n");
+    check(item != NULL && !cache_fresh(item), "no-cache is always stale");
+    if(item){
+        cache_revalidated(item, now + 60);
+        check(!cache_fresh(item), "no-cache stays stale after a 304");
+        cache_release(item);
+    }
+
+    item = cache_head("/default", "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n");
+    check(item != NULL && cache_fresh(item) && item->meta.expires <= now + HTTP_DEFAULT_TTL + 1,
+        "no caching headers: the default lifetime");
+    if(item) cache_release(item);
+
+    check(cache_head("/no-store", "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, no-store\r\n\r\n") == NULL,
+        "no-store is not cached");
+    check(cache_head("/private", "HTTP/1.1 200 OK\r\nCache-Control: private\r\n\r\n") == NULL,
+        "private is not cached");
+    check(cache_head("/cookie", "HTTP/1.1 200 OK\r\nSet-Cookie: id=1\r\n\r\n") == NULL,
+        "Set-Cookie is not cached");
+    check(cache_head("/error", "HTTP/1.1 500 Internal Server Error\r\n\r\n") == NULL,
+        "a 500 without a lifetime is not cached");
+
+    check(head_invalidates("HTTP/1.1 200 OK\r\nCache-Control: no-store\r\n\r\n")
+        && head_invalidates("HTTP/1.1 301 Moved Permanently\r\nCache-Control: private\r\n\r\n"),
+        "a 2xx or 3xx that may not be stored drops the cached copy");
+    check(!head_invalidates("HTTP/1.1 500 Internal Server Error\r\nCache-Control: no-store\r\n\r\n")
+        && !head_invalidates("HTTP/1.1 503 Service Unavailable\r\n\r\n")
+        && !head_invalidates("HTTP/1.1 206 Partial Content\r\nCache-Control: no-store\r\n\r\n")
+        && !head_invalidates("HTTP/1.1 304 Not Modified\r\nCache-Control: no-store\r\n\r\n")
+        && !head_invalidates("HTTP/1.1 302 Found\r\n\r\n"),
+        "errors, partial content and 304s leave it alone");
+    clear_cache();
+}
+// an object in memory, with a copy spilled to disk; 0 if that failed
+static int both_tiers(char *path){
+    CacheMeta meta = {0, 1};
+    CacheItem *item;
+    ChunkBuf body;
+    DiskHit dh;
+    int found;
+    meta.expires = time(NULL) + 3600;
+    cb_init(&body);
+    cb_append(&body, "xxxxxxxx", 8);
+    insert_item("origin.example.com", "80", path, &body, &meta);
+    if((item = cache_peek("origin.example.com", "80", path)) == NULL){
+        return 0;
+    }
+    disk_put(item);
+    cache_release(item);
+    if((found = disk_check("origin.example.com", "80", path, &dh)) != 0){
+        disk_release(&dh);
+    }
+    return found;
+}
+// dropping or replacing an object in memory forgets its disk copy
+static void check_drop(){
+    CacheMeta meta = {0, 1};
+    CacheItem *item;
+    ChunkBuf body;
+    DiskHit dh;
+
+    check(both_tiers("/drop"), "an object can be in both tiers");
+    cache_drop("origin.example.com", "80", "/drop");
+    check(cache_peek("origin.example.com", "80", "/drop") == NULL
+        && !disk_check("origin.example.com", "80", "/drop", &dh), "a dropped object is gone from both tiers");
+
+    check(both_tiers("/replace"), "an object can be in both tiers");
+    meta.expires = time(NULL) + 3600;
+    cb_init(&body);
+    cb_append(&body, "yyyy", 4);
+    insert_item("origin.example.com", "80", "/replace", &body, &meta);
+    check(!disk_check("origin.example.com", "80", "/replace", &dh), "a replaced object is gone from disk");
+    if((item = cache_peek("origin.example.com", "80", "/replace")) != NULL){
+        check(item->size == 4, "the new copy is in memory");
+        cache_release(item);
+    }
+    clear_cache();
+}
+
+void *stress_thread(void *vargp){
+    unsigned int seed = (unsigned int)(long)vargp;
+    char path[64], data[4096];
+    long i, hits = 0, dhits = 0;
+    DiskHit dh;
+    int j;
+    ChunkBuf body;
+    CacheMeta meta = {0, 1};
+    meta.expires = time(NULL) + 3600;
+    for(i = 0; i < nops; i++){
+        int key = rand_r(&seed) % nkeys;
+        int size = object_size(key);
+        sprintf(path, "/object/%d", key);
+        if(rand_r(&seed) % 100 < write_pct){
+            for(j = 0; j < size; j++){
+                data[j] = object_byte(key, j);
+            }
+            cb_init(&body);
+            cb_append(&body, data, size);
+            insert_item("origin.example.com", "80", path, &body, &meta);
+        }else{
+            CacheItem *item = cache_check("origin.example.com", "80", path);
+            if(item == NULL && disk_check("origin.example.com", "80", path, &dh)){
+                dhits++;
+                for(j = 0; j < size && j < dh.size; j++){
+                    if(dh.data[j] != object_byte(key, j)) break;
+                }
+                if(dh.size != size || j != size){
+                    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+                }
+                disk_release(&dh);
+            }
+            if(item == NULL) continue;
+            hits++;
+            if(!item_ok(item, key)){
+                __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+            }
+            cache_release(item);
+        }
+    }
+    __atomic_add_fetch(&total_hits, hits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&disk_hits, dhits, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// run the stress threads; 0 if no hit was corrupted
+static int stress(){
+    pthread_t *tids = Malloc(nthreads * sizeof(pthread_t));
+    int i;
+    for(i = 0; i < nthreads; i++){
+        Pthread_create(&tids[i], NULL, stress_thread, (void *)(long)(i + 1 + getpid()));
+    }
+    for(i = 0; i < nthreads; i++){
+        Pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    return errors != 0;
+}
+// parent of -P: every object the processes left must be intact
+static void check_shared(){
+    char path[64];
+    CacheItem *item;
+    int key, found = 0;
+    for(key = 0; key < nkeys; key++){
+        sprintf(path, "/object/%d", key);
+        if((item = cache_peek("origin.example.com", "80", path)) != NULL){
+            found++;
+            check(item_ok(item, key), "objects inserted by other processes are intact");
+            cache_release(item);
+        }
+    }
+    check(found > 0 && found == cache_count(), "objects inserted by other processes are found");
+    printf("processes %d, %d objects seen by the parent\n", nprocs, found);
+}
+
+// save the cache to path and load it back into an empty cache: every
+// object comes back intact, except the expired one without validators
+static void check_snapshot(char *path){
+    char path_key[64];
+    CacheMeta meta = {2, 1};
+    ChunkBuf body;
+    CacheItem *item;
+    int key, count, found = 0, saved;
+
+    meta.expires = 1;
+    cb_init(&body);
+    cb_append(&body, "x\r\n", 3);
+    insert_item("origin.example.com", "80", "/expired", &body, &meta);
+    meta.etag_len = 1;
+    cb_init(&body);
+    cb_append(&body, "x\r\n", 3);
+    insert_item("origin.example.com", "80", "/stale", &body, &meta);
+    count = cache_count();
+    saved = snapshot_save(path);
+    check(saved == count, "the snapshot holds every object");
+    clear_cache();
+    check(snapshot_load(path) == count - 1, "the snapshot loads all but the expired object");
+    check(cache_count() == count - 1, "restored objects are cached");
+    for(key = 0; key < nkeys; key++){
+        sprintf(path_key, "/object/%d", key);
+        if((item = cache_peek("origin.example.com", "80", path_key)) != NULL){
+            found++;
+            check(item_ok(item, key), "restored objects are intact");
+            cache_release(item);
+        }
+    }
+    check(cache_peek("origin.example.com", "80", "/expired") == NULL, "expired objects are not restored");
+    if((item = cache_peek("origin.example.com", "80", "/stale")) != NULL){
+        check(!cache_fresh(item), "stale objects with validators stay stale");
+        cache_release(item);
+    }else{
+        check(0, "stale objects with validators are restored");
+    }
+    printf("snapshot: %d objects saved, %d restored\n", saved, found + 1);
+    unlink(path);
+}
+
+// take objects of size until one comes from past the pool, at most max
+// of them; how many were taken (the last one from malloc if the pool ran out)
+static long fill_pool(void **objs, long max, size_t size){
+    long n = 0;
+    while(n < max && slab_owns(objs[n++] = slab_alloc(size)))
+        ;
+    return n;
+}
+// with the cache empty, take the whole pool in the smallest objects and
+// free them: the slabs go back to the pool, for objects of another size
+static void check_slabs(){
+    long max = SLAB_SIZE / SLAB_MIN * (MAX_CACHE_SIZE / SLAB_SIZE * 4), n, i;
+    void **objs = Malloc(max * sizeof(void *)), *p;
+    n = fill_pool(objs, max, SLAB_MIN);
+    check(!slab_owns(objs[n - 1]), "small objects use up the slab pool");
+    for(i = 0; i < n; i++){
+        slab_free(objs[i]);
+    }
+    p = slab_alloc(SLAB_MAX);
+    check(slab_owns(p), "freed slabs go to another size class");
+    slab_free(p);
+    free(objs);
+}
+// fill the cache twice over with objects of one size, and what is left
+// of the pool with small buffers (as if in flight); then cache objects
+// of another size: the last ones must still get in (TinyLFU may turn
+// some away)
+static void check_sizes(){
+    static char data[20000];
+    long max = SLAB_SIZE / SLAB_MIN * (MAX_CACHE_SIZE / SLAB_SIZE * 4), held = 0, k;
+    void **objs = Malloc(max * sizeof(void *));
+    int sizes[2] = {700, 20000}, i, j, n, cached = 0;
+    CacheMeta meta = {0, 1};
+    ChunkBuf body;
+    CacheItem *item;
+    char path[64];
+    meta.expires = time(NULL) + 3600;
+    for(i = 0; i < 2; i++){
+        n = 2 * MAX_CACHE_SIZE / sizes[i];
+        for(j = 0; j < n; j++){
+            sprintf(path, "/size/%d/%d", sizes[i], j);
+            cb_init(&body);
+            cb_append(&body, data, sizes[i]);
+            insert_item("origin.example.com", "80", path, &body, &meta);
+        }
+        if(i == 0){
+            held = fill_pool(objs, max, SLAB_MIN);
+        }
+    }
+    for(j = n - 4; j < n; j++){
+        sprintf(path, "/size/%d/%d", sizes[1], j);
+        if((item = cache_peek("origin.example.com", "80", path)) != NULL){
+            cached++;
+            cache_release(item);
+        }
+    }
+    check(cached > 0, "objects of a new size are cached in a full cache");
+    for(k = 0; k < held; k++){
+        slab_free(objs[k]);
+    }
+    free(objs);
+}
+
+int main(int argc, char **argv)
+{
+    struct timespec start, end;
+    double secs;
+    int c, i, status;
+
+    char *policy = "clock", *dir = NULL, *snap = NULL;
+
+    while((c = getopt(argc, argv, "t:n:k:w:p:d:P:s:")) != -1){
+        switch(c){
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': nops = atol(optarg); break;
+        case 'k': nkeys = atoi(optarg); break;
+        case 'w': write_pct = atoi(optarg); break;
+        case 'p': policy = optarg; break;
+        case 'd': dir = optarg; break;
+        case 'P': nprocs = atoi(optarg); break;
+        case 's': snap = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-n ops] [-k keys] [-w insert %%] [-p policy] [-d dir] [-P procs] [-s snapshot]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if(cache_set_policy(policy) < 0){
+        fprintf(stderr, "unknown policy %s\n", policy);
+        exit(1);
+    }
+    if(nprocs > 1){
+        cache_share(nprocs);
+    }
+    init_cache();
+    check_freshness();
+    if(dir != NULL){
+        if(disk_init(dir, TEST_DISK_CAPACITY, MAX_OBJECT_SIZE) < 0){
+            fprintf(stderr, "cannot use %s as a disk tier\n", dir);
+            exit(1);
+        }
+        cache_set_spill(disk_put, disk_drop, disk_max_object());
+        check_drop();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(nprocs > 1){
+        for(i = 0; i < nprocs; i++){
+            if(Fork() == 0){
+                exit(stress());
+            }
+        }
+        for(i = 0; i < nprocs; i++){
+            if(wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+                check(0, "no process saw a corrupted hit");
+            }
+        }
+    }else{
+        stress();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if(nprocs > 1){
+        check_shared();
+    }else{
+        printf("policy %s, threads %d, ops %ld, %.0f ops/s, hit ratio %.3f\n", policy, nthreads, nthreads * nops,
+            nthreads * nops / secs, (double)total_hits / (nthreads * nops * (100 - write_pct) / 100));
+    }
+    printf("cached objects %d, cached bytes %zu\n", cache_count(), cache_size());
+    if(dir != NULL){
+        printf("disk hits %ld\n", disk_hits);
+        disk_report(stdout);
+    }
+    if(cache_size() > MAX_CACHE_SIZE){
+        printf("FAIL: cache holds %zu bytes, over the %d byte budget\n", cache_size(), MAX_CACHE_SIZE);
+        exit(1);
+    }
+    if(snap != NULL){
+        check_snapshot(snap);
+    }
+    if(errors){
+        printf("FAIL: %ld corrupted hits\n", errors);
+        exit(1);
+    }
+    clear_cache();
+    if(cache_count() != 0 || cache_size() != 0){
+        printf("FAIL: cache not empty after clear\n");
+        exit(1);
+    }
+    check_slabs();
+    if(nprocs > 1){
+        check_sizes();
+    }
+    if(errors){
+        printf("FAIL: slab pool not shared out\n");
+        exit(1);
+    }
+    printf("PASS\n");
+    return 0;
+}
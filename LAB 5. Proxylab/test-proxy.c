@@ -0,0 +1,817 @@
+/*
+ * test-proxy.c - end-to-end tests of the proxy, from client to origin
+ *
+ * The test plays both ends. Its origin is a thread per connection that
+ * speaks HTTP/1.1 with keep-alive and counts the connections and the
+ * requests it gets; its clients talk to a ./proxy started for each case
+ * with the options the case needs. An object's size and bytes are a
+ * function of its number (/obj/<n>), so a client can verify every body
+ * it gets, and the origin's counters tell what the proxy answered from
+ * its cache. The origin can be made slow (origin_delay), for the cases
+ * that need requests to overlap, or close halfway through a body
+ * (origin_cut); what only the proxy knows (resolver,
+ * origin table, splice) is read from the statistics it prints to
+ * PROXY_LOG on SIGUSR1. A response that does not come within
+ * CLIENT_TIMEOUT seconds fails the case.
+ * usage: ./test-proxy
+ */
+#include "csapp.h"
+#include "origin.h"
+
+/* Seconds a client waits for a response */
+#define CLIENT_TIMEOUT 3
+/* Where the proxies the cases start write their messages */
+#define PROXY_LOG "/tmp/test-proxy.log"
+
+/* A client connection to the proxy */
+typedef struct{
+    int fd;
+    rio_t rio;
+} Client;
+
+static char origin_port[8];
+static char proxy_port[8];
+static pid_t proxy_pid;
+static long origin_conns;   /* connections the origin accepted */
+static long origin_reqs;    /* requests it answered */
+static long origin_conds;   /* ... of them with If-None-Match */
+/* How the origin answers GETs, set by the cases: with this status (a
+   body only for 200) and Cache-Control; with origin_validate set, a 200
+   becomes a 304 for If-None-Match */
+static int origin_status = 200;
+static char *origin_cc = "max-age=600";
+static int origin_validate = 0;
+static int origin_delay = 0;    /* ms before each answer */
+static int origin_cut = 0;      /* send half of each body, then close */
+static long errors = 0;
+
+// (from /obj/1000 on, larger than the proxy caches)
+static int object_size(int key){
+    return key >= 1000 ? key * 1000 : 100 + (key * 97) % 5000;
+}
+static char object_byte(int key, int i){
+    return 'a' + (key * 7 + i) % 26;
+}
+// is body exactly the object of key?
+static int body_ok(char *body, long len, int key){
+    int i;
+    if(len != object_size(key)){
+        return 0;
+    }
+    for(i = 0; i < len; i++){
+        if(body[i] != object_byte(key, i)){
+            return 0;
+        }
+    }
+    return 1;
+}
+static void check(int ok, char *what){
+    if(!ok){
+        printf("FAIL: %s\n", what);
+        errors++;
+    }
+}
+// a port no one listens on right now
+static void free_port(char *port){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = Socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Bind(fd, (SA *)&addr, sizeof(addr));
+    getsockname(fd, (SA *)&addr, &len);
+    sprintf(port, "%d", ntohs(addr.sin_port));
+    Close(fd);
+}
+
+// answer requests on one origin connection until the proxy closes it
+static void *origin_conn(void *vargp){
+    int fd = (int)(long)vargp;
+    char line[MAXLINE], method[16], path[MAXLINE], hdrs[MAXLINE], *body;
+    char version[16];
+    int key, size, cond, last, status, i;
+    rio_t rio;
+
+    Pthread_detach(pthread_self());
+    Rio_readinitb(&rio, fd);
+    while(rio_readlineb(&rio, line, MAXLINE) > 0){
+        if(sscanf(line, "%15s %s %15s", method, path, version) != 3){
+            break;
+        }
+        cond = 0;
+        last = !strcmp(version, "HTTP/1.0");
+        while(rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n")){
+            if(!strncasecmp(line, "If-None-Match:", 14)){
+                cond = 1;
+            }else if(!strncasecmp(line, "Connection:", 11) && strstr(line, "close")){
+                last = 1;
+            }
+        }
+        __atomic_add_fetch(&origin_reqs, 1, __ATOMIC_RELAXED);
+        if(cond){
+            __atomic_add_fetch(&origin_conds, 1, __ATOMIC_RELAXED);
+        }
+        key = strncmp(path, "/obj/", 5) ? 0 : atoi(path + 5);
+        if(origin_delay){
+            usleep(origin_delay * 1000);
+        }
+        status = origin_status == 200 && cond && origin_validate ? 304 : origin_status;
+        size = status == 200 ? object_size(key) : 0;
+        sprintf(hdrs, "HTTP/1.1 %d Whatever\r\nContent-Length: %d\r\nETag: \"%d\"\r\n", status, size, key);
+        if(status == 200 || status == 304){
+            sprintf(hdrs + strlen(hdrs), "Cache-Control: %s\r\n", origin_cc);
+        }
+        strcat(hdrs, "\r\n");
+        if(rio_writen(fd, hdrs, strlen(hdrs)) < 0){
+            break;
+        }
+        if(strcmp(method, "HEAD") && size > 0){
+            body = Malloc(size);
+            for(i = 0; i < size; i++){
+                body[i] = object_byte(key, i);
+            }
+            i = rio_writen(fd, body, origin_cut ? size / 2 : size);
+            Free(body);
+            if(i < 0 || origin_cut){
+                break;
+            }
+        }
+        if(last){
+            break;
+        }
+    }
+    Close(fd);
+    return NULL;
+}
+// the origin: a thread per connection
+static void *origin_thread(void *vargp){
+    int listenfd = (int)(long)vargp, connfd;
+    pthread_t tid;
+    Pthread_detach(pthread_self());
+    while(1){
+        connfd = Accept(listenfd, NULL, NULL);
+        __atomic_add_fetch(&origin_conns, 1, __ATOMIC_RELAXED);
+        Pthread_create(&tid, NULL, origin_conn, (void *)(long)connfd);
+    }
+    return NULL;
+}
+
+// start ./proxy with opts (space separated) on a port of its own
+static void proxy_start(char *opts){
+    char buf[MAXLINE], *argv[32], *tok;
+    int argc = 0, fd, i;
+    free_port(proxy_port);
+    strcpy(buf, opts);
+    argv[argc++] = "./proxy";
+    for(tok = strtok(buf, " "); tok; tok = strtok(NULL, " ")){
+        argv[argc++] = tok;
+    }
+    argv[argc++] = proxy_port;
+    argv[argc] = NULL;
+    if((proxy_pid = Fork()) == 0){
+        fd = Open(PROXY_LOG, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        Dup2(fd, STDOUT_FILENO);
+        Dup2(fd, STDERR_FILENO);
+        execv(argv[0], argv);
+        exit(127);
+    }
+    // until it listens
+    for(i = 0; i < 100; i++){
+        if((fd = open_clientfd("localhost", proxy_port)) >= 0){
+            Close(fd);
+            return;
+        }
+        usleep(20000);
+    }
+    fprintf(stderr, "./proxy %s did not start (see %s)\n", opts, PROXY_LOG);
+    exit(1);
+}
+// the worker processes of a proxy started with -P; how many
+static int proxy_workers(pid_t *pids, int max){
+    char path[64];
+    FILE *fp;
+    int n = 0;
+    sprintf(path, "/proc/%d/task/%d/children", (int)proxy_pid, (int)proxy_pid);
+    if((fp = fopen(path, "r")) == NULL){
+        return 0;
+    }
+    while(n < max && fscanf(fp, "%d", &pids[n]) == 1){
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+static void proxy_stop(){
+    kill(proxy_pid, SIGKILL);
+    waitpid(proxy_pid, NULL, 0);
+}
+
+// connect a client to the proxy; -1 if nothing listens
+static int client_try(Client *c){
+    struct timeval tv = {CLIENT_TIMEOUT, 0};
+    if((c->fd = open_clientfd("localhost", proxy_port)) < 0){
+        return -1;
+    }
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    Rio_readinitb(&c->rio, c->fd);
+    return 0;
+}
+// connect a client to the proxy
+static void client_open(Client *c){
+    if(client_try(c) < 0){
+        unix_error("Open_clientfd error");
+    }
+}
+// send a request for path on the origin, with the header lines in hdrs
+// and body (if not NULL)
+static void client_send(Client *c, char *method, char *path, char *hdrs, char *body){
+    char buf[MAXLINE];
+    sprintf(buf, "%s http://localhost:%s%s HTTP/1.1\r\nHost: localhost:%s\r\n%s\r\n%s",
+        method, origin_port, path, origin_port, hdrs ? hdrs : "", body ? body : "");
+    rio_writen(c->fd, buf, strlen(buf));
+}
+// send request as it is
+static void client_raw(Client *c, char *request){
+    rio_writen(c->fd, request, strlen(request));
+}
+// read one response (to a HEAD if head), the body into body;
+// returns the status, -1 if there was none, or no complete one
+static int client_read(Client *c, int head, char *body, size_t size, long *len){
+    char line[MAXLINE];
+    long length = -1, chunk;
+    int status, chunked = 0;
+    ssize_t n;
+
+    *len = 0;
+    if(rio_readlineb(&c->rio, line, MAXLINE) <= 0 || sscanf(line, "HTTP/1.%*d %d", &status) != 1){
+        return -1;
+    }
+    while((n = rio_readlineb(&c->rio, line, MAXLINE)) > 0 && strcmp(line, "\r\n")){
+        if(!strncasecmp(line, "Content-Length:", 15)){
+            length = atol(line + 15);
+        }else if(!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked")){
+            chunked = 1;
+        }
+    }
+    if(n <= 0){
+        return -1;
+    }
+    if(head || status == 204 || status == 304){
+        return status;
+    }
+    if(chunked){
+        while(rio_readlineb(&c->rio, line, MAXLINE) > 0 && (chunk = strtol(line, NULL, 16)) > 0){
+            if(*len + chunk > size || rio_readnb(&c->rio, body + *len, chunk) != chunk){
+                return -1;
+            }
+            *len += chunk;
+            rio_readlineb(&c->rio, line, MAXLINE);
+        }
+        // trailers
+        while((n = rio_readlineb(&c->rio, line, MAXLINE)) > 0 && strcmp(line, "\r\n"))
+            ;
+        return n > 0 ? status : -1;
+    }
+    if(length >= 0){
+        if(length > size || rio_readnb(&c->rio, body, length) != length){
+            return -1;
+        }
+        *len = length;
+        return status;
+    }
+    // until EOF
+    while((n = rio_readnb(&c->rio, body + *len, size - *len)) > 0){
+        *len += n;
+    }
+    return n < 0 ? -1 : status;
+}
+static void client_close(Client *c){
+    Close(c->fd);
+}
+
+// a HEAD is answered by the origin, without a body, and leaves the
+// connection usable; the GET after it is no cache hit
+static void test_head(){
+    static char body[1 << 16];
+    Client c;
+    long len, reqs;
+    proxy_start("");
+    client_open(&c);
+    reqs = origin_reqs;
+    client_send(&c, "HEAD", "/obj/1", NULL, NULL);
+    check(client_read(&c, 1, body, sizeof(body), &len) == 200, "HEAD is answered");
+    client_send(&c, "GET", "/obj/1", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 1),
+        "GET after HEAD on the same connection");
+    check(origin_reqs == reqs + 2, "HEAD is not cached as the object");
+    client_send(&c, "GET", "/obj/1", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 1)
+        && origin_reqs == reqs + 2, "then GET hits the cache");
+    client_send(&c, "HEAD", "/obj/1", NULL, NULL);
+    check(client_read(&c, 1, body, sizeof(body), &len) == 200 && origin_reqs == reqs + 3,
+        "HEAD of a cached object goes to the origin");
+    client_send(&c, "GET", "/obj/1", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 1),
+        "and leaves the cached object alone");
+    client_close(&c);
+    proxy_stop();
+}
+// misses from different clients reuse one pooled origin connection;
+// with -k 0 each takes a connection of its own
+static void test_upstream(char *opts, int pooled){
+    static char body[1 << 16];
+    Client c;
+    long len, conns;
+    int i, ok = 1;
+    char path[32];
+    proxy_start(opts);
+    conns = origin_conns;
+    for(i = 0; i < 3; i++){
+        sprintf(path, "/obj/%d", 40 + i);
+        client_open(&c);
+        client_send(&c, "GET", path, NULL, NULL);
+        ok = ok && client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 40 + i);
+        client_close(&c);
+    }
+    check(ok, "misses through the upstream pool");
+    // the origin counts a connection once it accepts it
+    check(origin_conns == conns + (pooled ? 1 : 3),
+        pooled ? "misses share a pooled origin connection" : "-k 0 does not pool");
+    proxy_stop();
+}
+// requests pipelined in one write are answered in order, each framed
+// so the next can be told from it: a miss, a HEAD, a hit, an object
+// too large to keep, and a miss again
+static void test_pipeline(){
+    static char body[1 << 16];
+    char buf[4 * MAXLINE];
+    char *paths[] = {"/obj/52", "/obj/51", "/obj/52", "/obj/50", "/obj/53"};
+    int keys[] = {52, 51, 52, 50, 53}, i, ok = 1;
+    long len, reqs;
+    Client c;
+    proxy_start("-o 2048");
+    reqs = origin_reqs;
+    client_open(&c);
+    buf[0] = '\0';
+    for(i = 0; i < 5; i++){
+        sprintf(buf + strlen(buf), "%s http://localhost:%s%s HTTP/1.1\r\nHost: localhost:%s\r\n\r\n",
+            i == 1 ? "HEAD" : "GET", origin_port, paths[i], origin_port);
+    }
+    client_raw(&c, buf);
+    for(i = 0; i < 5; i++){
+        ok = ok && client_read(&c, i == 1, body, sizeof(body), &len) == 200
+            && (i == 1 || body_ok(body, len, keys[i]));
+    }
+    check(ok, "pipelined requests are answered in order");
+    check(origin_reqs == reqs + 4, "and the repeated one from the cache");
+    client_send(&c, "GET", "/obj/52", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 52),
+        "the connection stays open after them");
+    client_close(&c);
+    proxy_stop();
+}
+// methods other than GET and HEAD, and requests with a body, are
+// refused with the connection closed, so a body is never taken for the
+// next request; nothing reaches the origin or the cache
+static void test_refused(){
+    static char body[1 << 16];
+    Client c;
+    long len, reqs;
+    proxy_start("");
+    reqs = origin_reqs;
+    client_open(&c);
+    client_send(&c, "POST", "/obj/2", "Content-Length: 30\r\n",
+        "GET /obj/3 HTTP/1.1\r\nX: y\r\n\r\n");
+    check(client_read(&c, 0, body, sizeof(body), &len) == 501, "POST is not implemented");
+    check(client_read(&c, 0, body, sizeof(body), &len) == -1, "and its body is not a request");
+    client_close(&c);
+    client_open(&c);
+    client_send(&c, "GET", "/obj/2", "Transfer-Encoding: chunked\r\n", "0\r\n\r\n");
+    check(client_read(&c, 0, body, sizeof(body), &len) == 501, "GET with a body is refused");
+    client_close(&c);
+    client_open(&c);
+    client_send(&c, "GET", "/obj/2", "Content-Length: 0\r\n", NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 2),
+        "Content-Length: 0 is no body");
+    client_close(&c);
+    check(origin_reqs == reqs + 1, "refused requests do not reach the origin");
+    proxy_stop();
+}
+// a stale copy survives an error from the origin, and is revalidated
+// later; a 2xx the origin does not let the cache keep drops it
+static void test_drop(char *opts){
+    static char body[1 << 16];
+    Client c;
+    long len, conds;
+    proxy_start(opts);
+    client_open(&c);
+    origin_cc = "max-age=0";
+    origin_validate = 1;
+    client_send(&c, "GET", "/obj/5", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 5), "a stale object is cached");
+    conds = origin_conds;
+    origin_status = 500;
+    client_send(&c, "GET", "/obj/5", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 500 && origin_conds == conds + 1,
+        "the origin fails its revalidation");
+    origin_status = 200;
+    client_send(&c, "GET", "/obj/5", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 5)
+        && origin_conds == conds + 2, "the error left the stale copy, which a 304 revalidates");
+    origin_validate = 0;
+    origin_cc = "no-store";
+    client_send(&c, "GET", "/obj/5", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 5), "no-store is relayed");
+    origin_validate = 1;
+    client_send(&c, "GET", "/obj/5", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 5)
+        && origin_conds == conds + 3, "and the cached copy is gone");
+    origin_cc = "max-age=600";
+    client_close(&c);
+    proxy_stop();
+}
+// a worker of -P that dies takes the others along: they all start
+// over on an empty shared cache, which they share again
+static void test_workers(){
+    static char body[1 << 16];
+    pid_t pids[4];
+    Client c;
+    long len, reqs;
+    int i, n, ok, status = -1;
+    proxy_start("-P 2");
+    reqs = origin_reqs;
+    for(i = 0; i < 4; i++){
+        client_open(&c);
+        client_send(&c, "GET", "/obj/7", NULL, NULL);
+        check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 7), "-P serves");
+        client_close(&c);
+    }
+    check(origin_reqs == reqs + 1, "-P workers share the cache");
+    n = proxy_workers(pids, 4);
+    check(n == 2, "-P 2 runs two workers");
+    if(n > 0){
+        kill(pids[0], SIGKILL);
+    }
+    // until a request misses in a new worker's empty cache: the parent
+    // reaps all the old workers before it forks new ones, so none is left
+    for(i = 0, ok = 0; i < 100 && !ok; i++){
+        if(i > 0){
+            usleep(20000);
+        }
+        reqs = origin_reqs;
+        if(client_try(&c) < 0){
+            continue;
+        }
+        client_send(&c, "GET", "/obj/7", NULL, NULL);
+        status = client_read(&c, 0, body, sizeof(body), &len);
+        ok = status == 200 && body_ok(body, len, 7) && origin_reqs == reqs + 1;
+        client_close(&c);
+    }
+    check(ok, "-P serves after a worker died");
+    reqs = origin_reqs;
+    for(i = 0; i < 3; i++){
+        client_open(&c);
+        client_send(&c, "GET", "/obj/7", NULL, NULL);
+        status = client_read(&c, 0, body, sizeof(body), &len);
+        check(status == 200 && body_ok(body, len, 7), "-P serves after a worker died");
+        client_close(&c);
+    }
+    check(origin_reqs == reqs, "the new workers share a new cache");
+    proxy_stop();
+}
+// n clients miss on /obj/<key> at once, on a slow origin; whether each
+// got the whole object
+static int concurrent_misses(int key, int n){
+    static char body[1 << 16];
+    char path[32];
+    Client c[8];
+    long len;
+    int i, ok = 1;
+    sprintf(path, "/obj/%d", key);
+    origin_delay = 300;
+    for(i = 0; i < n; i++){
+        client_open(&c[i]);
+        client_send(&c[i], "GET", path, NULL, NULL);
+    }
+    for(i = 0; i < n; i++){
+        ok = ok && client_read(&c[i], 0, body, sizeof(body), &len) == 200 && body_ok(body, len, key);
+        client_close(&c[i]);
+    }
+    origin_delay = 0;
+    return ok;
+}
+// the client whose miss started the fetch goes away (with a reset)
+// while another waits on it; whether the other still got the object
+static int leader_gone(int key){
+    static char body[1 << 16];
+    struct linger lg = {1, 0};
+    char path[32];
+    Client leader, c;
+    long len;
+    int ok;
+    sprintf(path, "/obj/%d", key);
+    origin_delay = 300;
+    client_open(&leader);
+    client_send(&leader, "GET", path, NULL, NULL);
+    usleep(50000);
+    client_open(&c);
+    client_send(&c, "GET", path, NULL, NULL);
+    usleep(50000);
+    setsockopt(leader.fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    client_close(&leader);
+    ok = client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, key);
+    client_close(&c);
+    origin_delay = 0;
+    return ok;
+}
+// concurrent misses on one object cost the origin one request, in
+// either mode (opts sets -o 2048), and every client gets the whole
+// object, even when the client that started the fetch goes away; on
+// one too large to cache the others fetch their own
+static void test_coalesce(char *opts){
+    static char body[1 << 16];
+    Client c;
+    long len, reqs;
+    proxy_start(opts);
+    reqs = origin_reqs;
+    check(concurrent_misses(9, 8), "concurrent misses all get the object");
+    check(origin_reqs == reqs + 1, "concurrent misses share one fetch");
+    reqs = origin_reqs;
+    check(concurrent_misses(50, 8), "concurrent misses on a large object all get it");
+    check(origin_reqs == reqs + 8, "which is not shared");
+    reqs = origin_reqs;
+    check(leader_gone(12), "a miss outlives the client that started it");
+    check(origin_reqs == reqs + 1, "and is still shared");
+    // the first one has no address to wait for
+    client_open(&c);
+    client_raw(&c, "GET http://nonexistent.invalid/ HTTP/1.0\r\n\r\n");
+    check(client_read(&c, 0, body, sizeof(body), &len) == 502, "a name that does not resolve is a 502");
+    client_close(&c);
+    proxy_stop();
+}
+// the event loops do not take the options of the worker threads
+static void test_event_options(){
+    char *bad[] = {"-e 1 -L 2", "-e 1 -k 5", "-t 4 -e 1", "-e 1 -q 8"};
+    char cmd[MAXLINE];
+    int i;
+    for(i = 0; i < 4; i++){
+        sprintf(cmd, "./proxy %s 5000 >/dev/null 2>&1", bad[i]);
+        check(system(cmd) != 0, "-e refuses options it would ignore");
+    }
+}
+// a body the origin cuts short reaches the client short and is not
+// cached: the next request goes to the origin and gets all of it
+static void test_cut(char *opts){
+    static char body[1 << 16];
+    Client c;
+    long len, reqs;
+    proxy_start(opts);
+    origin_cut = 1;
+    client_open(&c);
+    client_send(&c, "GET", "/obj/13", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == -1, "a body cut short is cut short for the client");
+    client_close(&c);
+    origin_cut = 0;
+    reqs = origin_reqs;
+    client_open(&c);
+    client_send(&c, "GET", "/obj/13", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 13), "the object after a cut");
+    check(origin_reqs == reqs + 1, "is no cache hit");
+    client_close(&c);
+    proxy_stop();
+}
+// the last line of the proxy's log with what in it; 0 if none
+static int log_line(char *what, char *line){
+    char buf[MAXLINE];
+    FILE *fp = fopen(PROXY_LOG, "r");
+    int found = 0;
+    if(fp == NULL){
+        return 0;
+    }
+    while(fgets(buf, sizeof(buf), fp) != NULL){
+        if(strstr(buf, what) != NULL){
+            strcpy(line, buf);
+            found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+// have the proxy print its statistics to the log
+static void proxy_report(){
+    kill(proxy_pid, SIGUSR1);
+    usleep(300000);
+}
+// the resolver cache's names and counts, from a fresh report; 0 if none
+static int dns_stats(int *names, long *hits, long *lookups, long *negative, long *refreshes){
+    char line[MAXLINE];
+    proxy_report();
+    return log_line("dns: ", line) && sscanf(line, "dns: %d names, hit ratio %*f (%ld/%ld), %*d shared,"
+        " %ld negative hits, %ld refreshes", names, hits, lookups, negative, refreshes) == 5;
+}
+// the resolver cache answers repeated lookups of a name, and failed
+// ones; it refreshes a name in use before its TTL (-N) is up, and
+// drops one that is not used any more
+static void test_dns(){
+    static char body[1 << 16];
+    long len, hits, lookups, negative, refreshes;
+    int i, names, ok = 1;
+    char path[32];
+    Client c;
+    // each miss its own origin connection, so each looks up the name
+    proxy_start("-k 0 -N 4");
+    for(i = 0; i < 2; i++){
+        client_open(&c);
+        client_send(&c, "GET", i ? "/obj/61" : "/obj/60", NULL, NULL);
+        ok = ok && client_read(&c, 0, body, sizeof(body), &len) == 200;
+        client_close(&c);
+        client_open(&c);
+        client_raw(&c, "GET http://nonexistent.invalid/ HTTP/1.0\r\n\r\n");
+        ok = ok && client_read(&c, 0, body, sizeof(body), &len) == 502;
+        client_close(&c);
+    }
+    check(ok, "misses through the resolver cache");
+    check(dns_stats(&names, &hits, &lookups, &negative, &refreshes) && names == 2
+        && lookups == 4 && hits == 2 && negative == 1, "the second lookup of a name is a hit");
+    // in use past its TTL: every lookup still a hit
+    for(i = 0; i < 10; i++){
+        usleep(500000);
+        sprintf(path, "/obj/%d", 62 + i);
+        client_open(&c);
+        client_send(&c, "GET", path, NULL, NULL);
+        ok = ok && client_read(&c, 0, body, sizeof(body), &len) == 200;
+        client_close(&c);
+    }
+    check(dns_stats(&names, &hits, &lookups, &negative, &refreshes) && refreshes > 0
+        && lookups == 14 && hits == 12, "a name in use is refreshed before it expires");
+    // then unused, until the refresher drops it
+    for(i = 0; i < 40 && dns_stats(&names, &hits, &lookups, &negative, &refreshes) && names > 0; i++)
+        ;
+    check(names == 0, "a name no longer in use expires");
+    proxy_stop();
+}
+// bytes the proxy spliced so far, from a fresh report; -1 if none
+static long spliced(){
+    char line[MAXLINE];
+    long n = -1;
+    proxy_report();
+    if(log_line("splice: ", line)){
+        sscanf(line, "splice: %ld", &n);
+    }
+    return n;
+}
+// bodies the proxy does not keep, too large or no-store, are spliced
+// through (but for what came in with the headers) and arrive whole
+static void test_splice(char *opts){
+    static char body[2 << 20];
+    long len, before;
+    Client c;
+    proxy_start(opts);
+    before = spliced();
+    client_open(&c);
+    client_send(&c, "GET", "/obj/1500", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 1500),
+        "a body too large to cache arrives whole");
+    client_close(&c);
+    check(spliced() - before > object_size(1500) / 2, "and most of it is spliced");
+    before = spliced();
+    origin_cc = "no-store";
+    client_open(&c);
+    client_send(&c, "GET", "/obj/1001", NULL, NULL);
+    check(client_read(&c, 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 1001),
+        "a no-store body arrives whole");
+    client_close(&c);
+    origin_cc = "max-age=600";
+    check(spliced() - before > object_size(1001) / 2, "and most of it is spliced");
+    proxy_stop();
+}
+// an origin slower than the read deadline gets the client, and those
+// waiting on the same fetch, a 504; it is asked once, and answers in
+// time again afterwards
+static void test_deadline(char *opts){
+    static char body[1 << 16];
+    Client c[3];
+    long len, reqs;
+    int i, ok = 1;
+    proxy_start(opts);
+    reqs = origin_reqs;
+    origin_delay = 1500;
+    for(i = 0; i < 3; i++){
+        client_open(&c[i]);
+        client_send(&c[i], "GET", "/obj/80", NULL, NULL);
+    }
+    for(i = 0; i < 3; i++){
+        ok = ok && client_read(&c[i], 0, body, sizeof(body), &len) == 504;
+        client_close(&c[i]);
+    }
+    origin_delay = 0;
+    check(ok, "a late origin is a 504 for all waiting on it");
+    check(origin_reqs == reqs + 1, "which is asked once");
+    client_open(&c[0]);
+    client_send(&c[0], "GET", "/obj/80", NULL, NULL);
+    check(client_read(&c[0], 0, body, sizeof(body), &len) == 200 && body_ok(body, len, 80),
+        "then an origin in time is answered");
+    client_close(&c[0]);
+    proxy_stop();
+}
+// with one fetch in flight and one queued per origin, a third
+// concurrent miss on a slow origin is turned away with a 503
+static void test_limits(){
+    static char body[1 << 16];
+    char path[32], line[MAXLINE];
+    int i, status, ok = 0, busy = 0, waited = -1, rejected = -1;
+    Client c[3];
+    long len;
+    proxy_start("-L 1:1");
+    origin_delay = 500;
+    for(i = 0; i < 3; i++){
+        sprintf(path, "/obj/%d", 90 + i);
+        client_open(&c[i]);
+        client_send(&c[i], "GET", path, NULL, NULL);
+        // in this order
+        usleep(50000);
+    }
+    for(i = 0; i < 3; i++){
+        status = client_read(&c[i], 0, body, sizeof(body), &len);
+        ok += status == 200 && body_ok(body, len, 90 + i);
+        busy += status == 503;
+        client_close(&c[i]);
+    }
+    origin_delay = 0;
+    check(ok == 2 && busy == 1, "a full origin queue is a 503");
+    proxy_report();
+    sprintf(path, "localhost:%s:", origin_port);
+    if(log_line(path, line)){
+        sscanf(strstr(line, "requests, "), "requests, %d waited (avg %*f ms, max %*d ms), %d rejected",
+            &waited, &rejected);
+    }
+    check(waited == 1 && rejected == 1, "the origin counts the wait and the rejection");
+    proxy_stop();
+}
+// the origin table keeps no more than ORIGIN_IDLE_MAX idle origins,
+// however many the proxy has seen
+static void test_origins(){
+    char request[MAXLINE], line[MAXLINE], port[8], body[64];
+    int i, count = -1, nidle = -1, answered = 1;
+    long retired = 0, len;
+    Client c;
+    proxy_start("-L 2");
+    for(i = 0; i < ORIGIN_IDLE_MAX + 50; i++){
+        // nobody listens there: a quick 502
+        free_port(port);
+        client_open(&c);
+        sprintf(request, "GET http://localhost:%s/ HTTP/1.0\r\n\r\n", port);
+        client_raw(&c, request);
+        answered = answered && client_read(&c, 0, body, sizeof(body), &len) == 502;
+        client_close(&c);
+    }
+    check(answered, "unreachable origins are a 502");
+    proxy_report();
+    if(log_line(" idle), ", line)){
+        sscanf(line, "origins: %d (%d idle)", &count, &nidle);
+    }
+    if(log_line(" retired origins: ", line)){
+        sscanf(line, "  %ld retired", &retired);
+    }
+    // (a free port may come up twice)
+    check(count == ORIGIN_IDLE_MAX && nidle == ORIGIN_IDLE_MAX, "idle origins are bounded");
+    check(retired > 0 && count + retired <= ORIGIN_IDLE_MAX + 50, "and the oldest are retired");
+    proxy_stop();
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t tid;
+    int listenfd;
+
+    Signal(SIGPIPE, SIG_IGN);
+    unlink(PROXY_LOG);
+    free_port(origin_port);
+    listenfd = Open_listenfd(origin_port);
+    Pthread_create(&tid, NULL, origin_thread, (void *)(long)listenfd);
+
+    test_head();
+    test_upstream("", 1);
+    test_upstream("-k 0", 0);
+    test_pipeline();
+    test_refused();
+    test_drop("");
+    test_drop("-d /tmp/test-proxy-disk");
+    test_workers();
+    test_coalesce("-o 2048");
+    test_coalesce("-e 1 -o 2048");
+    test_event_options();
+    test_cut("");
+    test_cut("-e 1");
+    test_splice("");
+    test_splice("-e 1");
+    test_deadline("-T 1:1:5");
+    test_deadline("-e 1 -T 1:1:5");
+    test_limits();
+    test_origins();
+    test_dns();
+
+    printf("%s\n", errors ? "FAILED" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * bench-static.c - static file throughput of tiny, sendfile vs mmap
+ *
+ * Writes one file per size under ./bench, then starts ./tiny twice on
+ * port: once as is (sendfile) and once with -m (mmap and writev). For
+ * every size, client threads fetch the file over keep-alive
+ * connections, each with one request outstanding, and check every
+ * body byte for byte. Prints requests and megabytes per second of
+ * both paths side by side.
+ * usage: ./bench-static [-t tiny threads] [-c clients] [-n requests]
+ *                       [-s size,size,...] <port>
+ */
+#include <getopt.h>
+#include <time.h>
+#include "csapp.h"
+
+#define MAX_SIZES 16
+#define IOCHUNK 65536           /* bytes per read of a body */
+
+static int tiny_threads = 8;
+static int nclients = 8;
+static long nrequests = 20000;
+static char *port;
+static size_t sizes[MAX_SIZES] = {1024, 16384, 262144, 4194304};
+static int nsizes = 4;
+/* the bytes of every file, from any offset mod 26 on */
+static char pattern[IOCHUNK + 26];
+
+typedef struct{
+    size_t size;                /* of the file to fetch */
+    long n;                     /* requests to send */
+    long errors;
+} Client;
+
+static double now_s(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+// the files to fetch, bench/<size>: "abc...z" over and over
+static void write_files(){
+    char path[MAXLINE];
+    size_t off, n;
+    int i, fd;
+    for(i = 0; i < sizeof(pattern); i++){
+        pattern[i] = 'a' + i % 26;
+    }
+    mkdir("bench", 0755);
+    for(i = 0; i < nsizes; i++){
+        snprintf(path, sizeof(path), "bench/%zu", sizes[i]);
+        fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for(off = 0; off < sizes[i]; off += n){
+            n = sizes[i] - off < IOCHUNK ? sizes[i] - off : IOCHUNK;
+            Rio_writen(fd, pattern + off % 26, n);
+        }
+        Close(fd);
+    }
+}
+// start ./tiny on port, with -m for the mmap path; waits until it listens
+static pid_t start_tiny(int mmap_path){
+    char threads[16];
+    pid_t pid;
+    int fd, i;
+    snprintf(threads, sizeof(threads), "%d", tiny_threads);
+    if((pid = Fork()) == 0){
+        if(mmap_path){
+            execl("./tiny", "tiny", "-t", threads, "-m", port, (char *)NULL);
+        }else{
+            execl("./tiny", "tiny", "-t", threads, port, (char *)NULL);
+        }
+        unix_error("cannot run ./tiny");
+    }
+    for(i = 0; i < 100; i++){
+        if((fd = open_clientfd("localhost", port)) >= 0){
+            close(fd);
+            return pid;
+        }
+        usleep(20000);
+    }
+    fprintf(stderr, "tiny did not start on port %s\n", port);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+// read one response for a file of size; 0 if it is all there and right
+static int read_response(rio_t *rio, size_t size){
+    char buf[IOCHUNK];
+    size_t len = (size_t)-1, off, n;
+    ssize_t rc;
+    if(rio_readlineb(rio, buf, MAXLINE) <= 0 || strncmp(buf, "HTTP/1.1 200", 12)){
+        return -1;
+    }
+    do{
+        if(rio_readlineb(rio, buf, MAXLINE) <= 0){
+            return -1;
+        }
+        if(!strncasecmp(buf, "Content-length:", 15)){
+            len = strtoul(buf + 15, NULL, 10);
+        }
+    }while(strcmp(buf, "\r\n"));
+    if(len != size){
+        return -1;
+    }
+    for(off = 0; off < size; off += n){
+        n = size - off < IOCHUNK ? size - off : IOCHUNK;
+        if((rc = rio_readnb(rio, buf, n)) != n){
+            return -1;
+        }
+        if(memcmp(buf, pattern + off % 26, n)){
+            return -1;
+        }
+    }
+    return 0;
+}
+// fetch the file n times over one keep-alive connection (reopened on errors)
+static void *client_thread(void *vargp){
+    Client *c = vargp;
+    char req[MAXLINE];
+    rio_t rio;
+    int fd = -1;
+    long i;
+    int len = snprintf(req, sizeof(req), "GET /bench/%zu HTTP/1.1\r\nHost: localhost\r\n\r\n", c->size);
+    for(i = 0; i < c->n; i++){
+        if(fd < 0){
+            if((fd = open_clientfd("localhost", port)) < 0){
+                c->errors++;
+                continue;
+            }
+            rio_readinitb(&rio, fd);
+        }
+        if(rio_writen(fd, req, len) != len || read_response(&rio, c->size) < 0){
+            c->errors++;
+            close(fd);
+            fd = -1;
+        }
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+    return NULL;
+}
+// requests per second for files of size; *errors gets the failures
+static double run(size_t size, long *errors){
+    pthread_t tids[nclients];
+    Client clients[nclients];
+    double start, secs;
+    int i;
+    // large files take fewer requests, so every size runs about as long
+    long n = nrequests / nclients;
+    if(size > 65536){
+        n = n * 65536 / size + 1;
+    }
+    start = now_s();
+    for(i = 0; i < nclients; i++){
+        clients[i].size = size;
+        clients[i].n = n;
+        clients[i].errors = 0;
+        Pthread_create(&tids[i], NULL, client_thread, &clients[i]);
+    }
+    *errors = 0;
+    for(i = 0; i < nclients; i++){
+        Pthread_join(tids[i], NULL);
+        *errors += clients[i].errors;
+    }
+    secs = now_s() - start;
+    return n * nclients / secs;
+}
+// parse "size,size,..."
+static int parse_sizes(char *spec){
+    char *p = spec;
+    for(nsizes = 0; *p && nsizes < MAX_SIZES; nsizes++){
+        sizes[nsizes] = strtoul(p, &p, 10);
+        if(*p == ','){
+            p++;
+        }else if(*p){
+            return -1;
+        }
+    }
+    return nsizes > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    double rps[2][MAX_SIZES];
+    long errors, total_errors = 0;
+    pid_t pid;
+    int c, i, path;
+
+    while((c = getopt(argc, argv, "t:c:n:s:")) != -1){
+        switch(c){
+        case 't': tiny_threads = atoi(optarg); break;
+        case 'c': nclients = atoi(optarg); break;
+        case 'n': nrequests = atol(optarg); break;
+        case 's':
+            if(parse_sizes(optarg) < 0) optind = argc;
+            break;
+        default:
+            optind = argc;
+        }
+    }
+    if(optind != argc - 1 || tiny_threads <= 0 || nclients <= 0 || nrequests < nclients){
+        fprintf(stderr, "usage: %s [-t tiny threads] [-c clients] [-n requests] [-s size,size,...] <port>\n", argv[0]);
+        exit(1);
+    }
+    port = argv[optind];
+    Signal(SIGPIPE, SIG_IGN);
+    write_files();
+    // path 0: sendfile, path 1: mmap
+    for(path = 0; path < 2; path++){
+        pid = start_tiny(path);
+        for(i = 0; i < nsizes; i++){
+            rps[path][i] = run(sizes[i], &errors);
+            total_errors += errors;
+        }
+        kill(pid, SIGTERM);
+        Waitpid(pid, NULL, 0);
+    }
+    printf("%10s %14s %14s %14s %14s\n", "size", "sendfile req/s", "MB/s", "mmap req/s", "MB/s");
+    for(i = 0; i < nsizes; i++){
+        printf("%10zu %14.0f %14.1f %14.0f %14.1f\n", sizes[i],
+            rps[0][i], rps[0][i] * sizes[i] / 1e6, rps[1][i], rps[1][i] * sizes[i] / 1e6);
+    }
+    printf("clients %d, tiny threads %d, errors %ld\n", nclients, tiny_threads, total_errors);
+    return total_errors != 0;
+}
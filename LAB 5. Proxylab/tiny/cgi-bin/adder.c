@@ -3,35 +3,39 @@
  */
 /* $begin adder */
 #include "csapp.h"
+#include "tinycgi.h"
 
 int main(void) {
     char *buf, *p;
     char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
-    int n1=0, n2=0;
+    int n1, n2;
 
-    /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
-	*p = '\0';
-	strcpy(arg1, buf);
-	strcpy(arg2, p+1);
-	n1 = atoi(arg1);
-	n2 = atoi(arg2);
-    }
+    /* Once as a plain CGI program; as a Tiny pool worker, per request */
+    while (tinycgi_accept()) {
+	/* Extract the two arguments */
+	n1 = n2 = 0;
+	if ((buf = getenv("QUERY_STRING")) != NULL && (p = strchr(buf, '&')) != NULL) {
+	    *p = '\0';
+	    strcpy(arg1, buf);
+	    strcpy(arg2, p+1);
+	    n1 = atoi(arg1);
+	    n2 = atoi(arg2);
+	}
 
-    /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
+	/* Make the response body */
+	sprintf(content, "Welcome to add.com: ");
+	sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
+	sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
+		content, n1, n2, n1 + n2);
+	sprintf(content, "%sThanks for visiting!\r\n", content);
   
-    /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+	/* Generate the HTTP response */
+	printf("Connection: close\r\n");
+	printf("Content-length: %d\r\n", (int)strlen(content));
+	printf("Content-type: text/html\r\n\r\n");
+	printf("%s", content);
+	tinycgi_finish();
+    }
 
     exit(0);
 }
@@ -0,0 +1,116 @@
+/*
+ * tinycgi.c - run a CGI program as a persistent Tiny worker
+ *
+ * In a pool worker, stdout is swapped for a memory stream while a
+ * request is served, so the program prints its response as usual and
+ * tinycgi_finish sends it to Tiny as one frame.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include "tinycgi.h"
+
+static int pooled = -1;     /* Started by Tiny's pool; -1: not known yet */
+static int accepted;        /* Requests taken so far */
+static FILE *real_stdout;   /* While a response is being buffered */
+static char *resp;          /* The buffered response */
+static size_t resp_len;
+
+static int read_full(int fd, void *buf, size_t n);
+static int write_full(int fd, const void *buf, size_t n);
+
+/*
+ * tinycgi_accept - wait for the next request and make its QUERY_STRING
+ *     the environment's; returns 0 when there are no more requests
+ *     (after the first unless in a pool, or when Tiny goes away)
+ */
+int tinycgi_accept(void)
+{
+    static char *query;
+    uint32_t len;
+
+    if (pooled < 0) {
+        pooled = getenv(TINYCGI_ENV) != NULL;
+        if (pooled && write_full(STDOUT_FILENO, TINYCGI_HELLO, 4) < 0)
+            return 0;
+    }
+    if (!pooled)
+        return accepted++ == 0;
+    if (real_stdout)            /* The program did not finish the last one */
+        tinycgi_finish();
+
+    if (read_full(STDIN_FILENO, &len, 4) < 0 || len > TINYCGI_MAXFRAME)
+        return 0;
+    if ((query = realloc(query, len + 1)) == NULL || read_full(STDIN_FILENO, query, len) < 0)
+        return 0;
+    query[len] = '\0';
+    setenv("QUERY_STRING", query, 1);
+
+    real_stdout = stdout;
+    if ((stdout = open_memstream(&resp, &resp_len)) == NULL) {
+        stdout = real_stdout;
+        real_stdout = NULL;
+        return 0;
+    }
+    accepted++;
+    return 1;
+}
+
+/*
+ * tinycgi_finish - the response is complete: flush it to the client,
+ *     or in a pool send it to Tiny as a frame
+ */
+void tinycgi_finish(void)
+{
+    uint32_t len;
+
+    if (!real_stdout) {
+        fflush(stdout);
+        return;
+    }
+    fclose(stdout);
+    stdout = real_stdout;
+    real_stdout = NULL;
+    len = resp_len;
+    /* Tiny is gone if this fails; the next accept finds out */
+    if (write_full(STDOUT_FILENO, &len, 4) == 0)
+        write_full(STDOUT_FILENO, resp, len);
+    free(resp);
+    resp = NULL;
+}
+
+/* Read exactly n bytes; -1 on end of file or error */
+static int read_full(int fd, void *buf, size_t n)
+{
+    char *p = buf;
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = read(fd, p, n)) < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        n -= rc;
+    }
+    return 0;
+}
+
+/* Write exactly n bytes; -1 on error */
+static int write_full(int fd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    ssize_t rc;
+
+    while (n > 0) {
+        if ((rc = write(fd, p, n)) < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            return -1;
+        p += rc;
+        n -= rc;
+    }
+    return 0;
+}
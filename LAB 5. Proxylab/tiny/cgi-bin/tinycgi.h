@@ -0,0 +1,32 @@
+/*
+ * tinycgi.h - run a CGI program as a persistent Tiny worker
+ *
+ * A program written as
+ *
+ *     while (tinycgi_accept()) {
+ *         ... getenv("QUERY_STRING"), printf the headers and body ...
+ *         tinycgi_finish();
+ *     }
+ *
+ * runs once, as a plain CGI program, when Tiny forks and execs it per
+ * request; started by Tiny's worker pool (tiny -w) it stays up and
+ * answers request after request.
+ *
+ * The protocol, over the worker's stdin and stdout (one end of a Unix
+ * socket pair): the worker first writes TINYCGI_HELLO; then for each
+ * request Tiny sends a frame holding the QUERY_STRING and the worker
+ * answers with a frame holding what a CGI program prints (headers, an
+ * empty line, the body). A frame is a 4-byte length in host byte order
+ * followed by that many bytes.
+ */
+#ifndef __TINYCGI_H__
+#define __TINYCGI_H__
+
+#define TINYCGI_ENV "TINYCGI"        /* Set in the environment of pool workers */
+#define TINYCGI_HELLO "TCGI"         /* First bytes a pool worker writes */
+#define TINYCGI_MAXFRAME (16 << 20)  /* Longest frame either side accepts */
+
+int tinycgi_accept(void);
+void tinycgi_finish(void);
+
+#endif /* __TINYCGI_H__ */
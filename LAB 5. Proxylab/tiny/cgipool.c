@@ -0,0 +1,222 @@
+/*
+ * cgipool.c - persistent CGI workers, reused across requests
+ *
+ * Forking and exec'ing a CGI program costs far more than the program
+ * takes to answer a small request. With a pool, each CGI program gets
+ * up to `size` long-lived workers, started on demand, each holding one
+ * end of a Unix socket pair as its stdin and stdout. A request goes to
+ * an idle worker as a frame and its response comes back as one (see
+ * cgi-bin/tinycgi.h); Tiny sends its own status line ahead of it, as
+ * it does for a forked program. Requests beyond `size` at a time wait
+ * for a worker to come back.
+ *
+ * A program that does not greet with TINYCGI_HELLO within
+ * CGIPOOL_HELLO_MS is not a pool program: it is run the classic way
+ * from then on. A worker that dies is reaped and a new one started on
+ * the next request; if it was found dead before it got the request,
+ * the request goes to another worker, otherwise the client gets a 502
+ * (the request may have had effects, so it is not run twice).
+ */
+#include <poll.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include "cgipool.h"
+
+static struct {
+    pthread_mutex_t lock;
+    int size;                   /* Workers per program; 0 turns the pool off */
+    CgiPool *pools;
+} cp = {PTHREAD_MUTEX_INITIALIZER};
+
+static CgiWorker *get_worker(char *filename, CgiPool **pp);
+static void put_worker(CgiPool *p, CgiWorker *w);
+static void drop_worker(CgiPool *p, CgiWorker *w);
+static CgiWorker *spawn_worker(char *filename);
+static int relay(int fd, CgiWorker *w, uint32_t len, char *prefix);
+
+/*
+ * cgipool_init - run CGI programs as pools of up to nworkers workers
+ */
+void cgipool_init(int nworkers)
+{
+    cp.size = nworkers;
+}
+
+/*
+ * cgipool_serve - have a worker of filename answer the request with
+ *     cgiargs, sending prefix (the status line and headers Tiny adds)
+ *     and then the worker's response to fd. Returns CGI_DONE,
+ *     CGI_CLASSIC (the caller runs the program itself) or CGI_FAILED.
+ */
+int cgipool_serve(int fd, char *filename, char *cgiargs, char *prefix)
+{
+    char buf[MAXLINE + 4];
+    uint32_t len = strlen(cgiargs);
+    CgiPool *p;
+    CgiWorker *w;
+    int tries;
+
+    if (cp.size == 0)
+        return CGI_CLASSIC;
+    memcpy(buf, &len, 4);
+    memcpy(buf + 4, cgiargs, len);
+    /* Every idle worker may have died, then a new one is started */
+    for (tries = 0; tries <= cp.size; tries++) {
+        if ((w = get_worker(filename, &p)) == NULL)
+            return CGI_CLASSIC;
+        if (rio_writen(w->fd, buf, len + 4) < 0) {
+            /* Died while idle; it never saw the request */
+            drop_worker(p, w);
+            continue;
+        }
+        if (rio_readn(w->fd, &len, 4) != 4 || len > TINYCGI_MAXFRAME) {
+            drop_worker(p, w);
+            return CGI_FAILED;
+        }
+        if (relay(fd, w, len, prefix) < 0)
+            drop_worker(p, w);
+        else
+            put_worker(p, w);
+        return CGI_DONE;
+    }
+    return CGI_FAILED;
+}
+
+/* An idle worker of filename, started if the pool has room, waited for
+   if not; NULL if the program is not a pool program */
+static CgiWorker *get_worker(char *filename, CgiPool **pp)
+{
+    CgiPool *p;
+    CgiWorker *w;
+
+    pthread_mutex_lock(&cp.lock);
+    for (p = cp.pools; p; p = p->next)
+        if (!strcmp(p->path, filename))
+            break;
+    if (p == NULL) {
+        p = Calloc(1, sizeof(CgiPool));
+        p->path = Malloc(strlen(filename) + 1);
+        strcpy(p->path, filename);
+        pthread_cond_init(&p->idle_cond, NULL);
+        p->next = cp.pools;
+        cp.pools = p;
+    }
+    *pp = p;
+    while (!p->classic && p->idle == NULL && p->workers >= cp.size)
+        pthread_cond_wait(&p->idle_cond, &cp.lock);
+    if (p->classic) {
+        pthread_mutex_unlock(&cp.lock);
+        return NULL;
+    }
+    if ((w = p->idle) != NULL) {
+        p->idle = w->next;
+        pthread_mutex_unlock(&cp.lock);
+        return w;
+    }
+    /* Start one, outside the lock: it may take CGIPOOL_HELLO_MS */
+    p->workers++;
+    pthread_mutex_unlock(&cp.lock);
+    w = spawn_worker(filename);
+    if (w == NULL) {
+        pthread_mutex_lock(&cp.lock);
+        p->workers--;
+        p->classic = 1;
+        pthread_cond_broadcast(&p->idle_cond);
+        pthread_mutex_unlock(&cp.lock);
+    }
+    return w;
+}
+
+/* Back to the idle list after a request */
+static void put_worker(CgiPool *p, CgiWorker *w)
+{
+    pthread_mutex_lock(&cp.lock);
+    w->next = p->idle;
+    p->idle = w;
+    pthread_cond_signal(&p->idle_cond);
+    pthread_mutex_unlock(&cp.lock);
+}
+
+/* Get rid of a dead or confused worker; the next request starts another */
+static void drop_worker(CgiPool *p, CgiWorker *w)
+{
+    int status;
+
+    kill(w->pid, SIGKILL);
+    close(w->fd);
+    waitpid(w->pid, &status, 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGKILL)
+        fprintf(stderr, "cgipool: %s worker %d died, restarting\n", p->path, (int)w->pid);
+    Free(w);
+    pthread_mutex_lock(&cp.lock);
+    p->workers--;
+    pthread_cond_signal(&p->idle_cond);
+    pthread_mutex_unlock(&cp.lock);
+}
+
+/* Fork and exec filename as a worker and wait for its greeting;
+   NULL if it does not greet in time */
+static CgiWorker *spawn_worker(char *filename)
+{
+    char *argv[] = { filename, NULL }, hello[4];
+    struct pollfd pfd;
+    CgiWorker *w;
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return NULL;
+    if ((pid = fork()) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        /* Its end of the socket and nothing else: a worker that kept
+           a client connection open would keep it from closing.
+           close_range(2) through syscall(), as csapp.h clashes with
+           _GNU_SOURCE */
+        dup2(sv[1], STDIN_FILENO);
+        dup2(sv[1], STDOUT_FILENO);
+        syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+        setenv(TINYCGI_ENV, "1", 1);
+        execve(filename, argv, environ);
+        _exit(127);
+    }
+    close(sv[1]);
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGIPOOL_HELLO_MS) != 1 || rio_readn(sv[0], hello, 4) != 4
+        || memcmp(hello, TINYCGI_HELLO, 4)) {
+        kill(pid, SIGKILL);
+        close(sv[0]);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+    w = Malloc(sizeof(CgiWorker));
+    w->pid = pid;
+    w->fd = sv[0];
+    w->next = NULL;
+    return w;
+}
+
+/* Send prefix and the len bytes of the worker's response to the client;
+   -1 if the worker died before it was all there. The response is read
+   to the end even if the client goes away, so the worker stays usable. */
+static int relay(int fd, CgiWorker *w, uint32_t len, char *prefix)
+{
+    char buf[MAXBUF];
+    int client_ok = 1;
+    ssize_t n;
+
+    if (send(fd, prefix, strlen(prefix), MSG_MORE) < 0)
+        client_ok = 0;
+    while (len > 0) {
+        if ((n = rio_readn(w->fd, buf, len < MAXBUF ? len : MAXBUF)) <= 0)
+            return -1;
+        if (client_ok && rio_writen(fd, buf, n) < 0)
+            client_ok = 0;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * cgipool.h - persistent CGI workers, reused across requests
+ */
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+#include "cgi-bin/tinycgi.h"
+
+#define CGIPOOL_HELLO_MS 1000   /* How long a new worker has to greet */
+
+/* What cgipool_serve did */
+#define CGI_DONE 0              /* Answered (or the client went away meanwhile) */
+#define CGI_CLASSIC 1           /* Pool off or not a pool program: fork and exec it */
+#define CGI_FAILED -1           /* The worker died before answering; nothing sent */
+
+/* A running worker, idle in its pool or serving one request */
+typedef struct CgiWorker {
+    pid_t pid;
+    int fd;                     /* Tiny's end of the worker's socket */
+    struct CgiWorker *next;     /* Next idle worker */
+} CgiWorker;
+
+/* The workers of one CGI program */
+typedef struct CgiPool {
+    char *path;                 /* As requested, e.g. "./cgi-bin/adder" */
+    int classic;                /* Did not speak the protocol: fork per request */
+    int workers;                /* Running or being started */
+    CgiWorker *idle;
+    pthread_cond_t idle_cond;   /* A worker came back or went away */
+    struct CgiPool *next;
+} CgiPool;
+
+void cgipool_init(int nworkers);
+int cgipool_serve(int fd, char *filename, char *cgiargs, char *prefix);
+
+#endif /* __CGIPOOL_H__ */
@@ -0,0 +1,211 @@
+/*
+ * filecache.c - open files and prebuilt headers of hot static files
+ *
+ * A bounded table, keyed by path, of static files Tiny has served:
+ * each entry keeps the file open, with its size, mtime and MIME type
+ * and the response headers ready to send, so a repeat request costs
+ * no stat, open, close or header formatting. The least recently used
+ * entry goes when the table is full.
+ *
+ * An entry is trusted for `recheck` seconds after it was last compared
+ * with the file. After that the next request stats the file again: if
+ * it changed (inode, size or mtime) or went away, the entry is dropped
+ * and the file opened afresh. Entries are pinned while a request sends
+ * from them, so eviction never closes a file that is being sent.
+ */
+#include "filecache.h"
+#include "../hash.h"
+
+static struct {
+    pthread_mutex_t lock;
+    FileEntry *buckets[FILECACHE_BUCKETS];
+    FileEntry *head, *tail;     /* LRU list */
+    int count;
+    int max;                    /* Entries; 0 turns the cache off */
+    int recheck;                /* Seconds */
+    filecache_type_fn type_fn;
+    filecache_hdr_fn hdr_fn;
+} fc = {PTHREAD_MUTEX_INITIALIZER};
+
+static FileEntry *open_entry(char *filename, unsigned int h);
+static void unlink_entry(FileEntry *e);
+static void lru_unlink(FileEntry *e);
+static void lru_push(FileEntry *e);
+
+/*
+ * filecache_init - keep up to entries files open, trusting each for
+ *     recheck seconds; type_fn and hdr_fn build what is sent with them
+ */
+void filecache_init(int entries, int recheck, filecache_type_fn type_fn,
+                    filecache_hdr_fn hdr_fn)
+{
+    fc.max = entries;
+    fc.recheck = recheck;
+    fc.type_fn = type_fn;
+    fc.hdr_fn = hdr_fn;
+}
+
+/*
+ * filecache_get - the entry of a readable regular file, pinned, opened
+ *     and added if need be; NULL if the cache is off or the file cannot
+ *     be served (the caller finds out why). Release it when done.
+ */
+FileEntry *filecache_get(char *filename)
+{
+    unsigned int h = hash_str(HASH_INIT, filename);
+    time_t now = time(NULL);
+    FileEntry *e, *old, *victim = NULL;
+    struct stat sb;
+    int cached;
+
+    if (fc.max == 0)
+        return NULL;
+    pthread_mutex_lock(&fc.lock);
+    for (e = fc.buckets[h & (FILECACHE_BUCKETS - 1)]; e; e = e->hnext)
+        if (e->hash == h && !strcmp(e->path, filename))
+            break;
+    if (e) {
+        __atomic_add_fetch(&e->refcnt, 1, __ATOMIC_RELAXED);
+        lru_unlink(e);
+        lru_push(e);
+        if (now - e->checked < fc.recheck) {
+            /* Hot path: no system call at all */
+            pthread_mutex_unlock(&fc.lock);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&fc.lock);
+
+    /* Time to compare the entry with the file */
+    if (e) {
+        if (stat(filename, &sb) == 0 && sb.st_ino == e->ino && sb.st_size == e->size
+            && sb.st_mtim.tv_sec == e->mtime.tv_sec && sb.st_mtim.tv_nsec == e->mtime.tv_nsec) {
+            pthread_mutex_lock(&fc.lock);
+            e->checked = now;
+            pthread_mutex_unlock(&fc.lock);
+            return e;
+        }
+        /* Changed or gone: forget it (unless someone else just did) */
+        pthread_mutex_lock(&fc.lock);
+        cached = e->cached;
+        unlink_entry(e);
+        pthread_mutex_unlock(&fc.lock);
+        if (cached)
+            filecache_release(e);
+        filecache_release(e);
+    }
+
+    if ((e = open_entry(filename, h)) == NULL)
+        return NULL;
+    e->checked = now;
+    pthread_mutex_lock(&fc.lock);
+    /* Another request may have opened it meanwhile */
+    for (old = fc.buckets[h & (FILECACHE_BUCKETS - 1)]; old; old = old->hnext)
+        if (old->hash == h && !strcmp(old->path, filename))
+            break;
+    if (old) {
+        unlink_entry(old);
+        victim = old;
+    }
+    else if (fc.count >= fc.max) {
+        victim = fc.tail;
+        unlink_entry(victim);
+    }
+    e->hnext = fc.buckets[h & (FILECACHE_BUCKETS - 1)];
+    fc.buckets[h & (FILECACHE_BUCKETS - 1)] = e;
+    e->cached = 1;
+    lru_push(e);
+    fc.count++;
+    pthread_mutex_unlock(&fc.lock);
+    /* Close outside the lock; requests still sending keep it open */
+    if (victim)
+        filecache_release(victim);
+    return e;
+}
+
+/*
+ * filecache_release - drop a reference to e; the file is closed once
+ *     e has left the table and no request sends from it anymore
+ */
+void filecache_release(FileEntry *e)
+{
+    if (__atomic_sub_fetch(&e->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(e->fd);
+        Free(e->path);
+        Free(e);
+    }
+}
+
+/* Open filename and describe it, with one reference for the caller and
+   one for the table; NULL unless it is a readable regular file */
+static FileEntry *open_entry(char *filename, unsigned int h)
+{
+    FileEntry *e;
+    struct stat sb;
+    int fd, keep_alive;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return NULL;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || !(S_IRUSR & sb.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    e = Calloc(1, sizeof(FileEntry));
+    e->path = Malloc(strlen(filename) + 1);
+    strcpy(e->path, filename);
+    e->hash = h;
+    e->fd = fd;
+    e->size = sb.st_size;
+    e->mtime = sb.st_mtim;
+    e->ino = sb.st_ino;
+    fc.type_fn(filename, e->filetype);
+    for (keep_alive = 0; keep_alive < 2; keep_alive++)
+        e->hdr_len[keep_alive] = fc.hdr_fn(e->hdr[keep_alive], FILECACHE_HDR,
+                                           e->filetype, e->size, keep_alive);
+    e->refcnt = 2;
+    return e;
+}
+
+/* Take e out of the table and the LRU list (lock held); the table's
+   reference goes to the caller */
+static void unlink_entry(FileEntry *e)
+{
+    FileEntry **pp;
+
+    if (!e->cached)
+        return;
+    for (pp = &fc.buckets[e->hash & (FILECACHE_BUCKETS - 1)]; *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+    lru_unlink(e);
+    e->cached = 0;
+    fc.count--;
+}
+
+/* LRU list, most recently used at head (lock held) */
+static void lru_unlink(FileEntry *e)
+{
+    if (!e->cached)
+        return;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        fc.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        fc.tail = e->prev;
+    e->prev = e->next = NULL;
+}
+static void lru_push(FileEntry *e)
+{
+    if (!e->cached)
+        return;
+    e->prev = NULL;
+    e->next = fc.head;
+    if (fc.head)
+        fc.head->prev = e;
+    else
+        fc.tail = e;
+    fc.head = e;
+}
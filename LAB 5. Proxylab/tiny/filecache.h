@@ -0,0 +1,43 @@
+/*
+ * filecache.h - open files and prebuilt headers of hot static files
+ */
+#ifndef __FILECACHE_H__
+#define __FILECACHE_H__
+
+#include "csapp.h"
+
+#define FILECACHE_ENTRIES 256   /* Default number of files kept open */
+#define FILECACHE_RECHECK 1     /* Default seconds between two stats of a file */
+#define FILECACHE_BUCKETS 1024  /* Hash buckets (power of two) */
+#define FILECACHE_HDR 256       /* Longest prebuilt headers */
+
+/* Derives a file's MIME type from its name */
+typedef void (*filecache_type_fn)(char *filename, char *filetype);
+/* Builds the response headers of a file into buf; returns their length */
+typedef int (*filecache_hdr_fn)(char *buf, size_t size, char *filetype,
+                                off_t filesize, int keep_alive);
+
+/* A static file, open and ready to send */
+typedef struct FileEntry {
+    char *path;                 /* As requested, e.g. "./home.html" */
+    unsigned int hash;
+    int fd;                     /* Open for the entry's lifetime */
+    off_t size;
+    struct timespec mtime;      /* What the file looked like when opened */
+    ino_t ino;
+    time_t checked;             /* Last time it was compared with the file */
+    char filetype[64];          /* MIME type */
+    char hdr[2][FILECACHE_HDR]; /* Headers for Connection: close, keep-alive */
+    int hdr_len[2];
+    int refcnt;                 /* One for the cache, one per request */
+    int cached;                 /* Still in the table */
+    struct FileEntry *hnext;    /* Next in the hash bucket */
+    struct FileEntry *prev, *next; /* LRU list, most recent at head */
+} FileEntry;
+
+void filecache_init(int entries, int recheck, filecache_type_fn type_fn,
+                    filecache_hdr_fn hdr_fn);
+FileEntry *filecache_get(char *filename);
+void filecache_release(FileEntry *e);
+
+#endif /* __FILECACHE_H__ */
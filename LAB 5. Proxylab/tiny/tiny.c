@@ -1,112 +1,294 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.1 Web server that uses the GET method
+ *     to serve static and dynamic content.
+ *
+ *     By default Tiny is iterative and closes the connection after
+ *     each response, as in the book. With -t, a pool of worker threads
+ *     serves connections from a bounded queue and keeps them open
+ *     between requests (HTTP/1.1, or HTTP/1.0 with keep-alive) until
+ *     the client closes or stays idle for IDLE_TIMEOUT seconds.
+ *
+ *     Static bodies go from the page cache to the socket with
+ *     sendfile(), behind headers sent with MSG_MORE so both leave in
+ *     the same segments; -m sends them from an mmap'd copy instead.
+ *     Hot files stay open in a cache (filecache.c) with their headers
+ *     prebuilt, so repeat requests skip stat, open and close.
+ *
+ *     Static files also answer HEAD, and GET with a Range header: one
+ *     range is sent as a 206 with Content-Range, several as a
+ *     multipart/byteranges 206, each part sent with sendfile() from its
+ *     offset; a Range none of whose ranges fits the file gets a 416.
+ *
+ *     With -w, CGI programs built on cgi-bin/tinycgi.c run as pools
+ *     of persistent workers (cgipool.c) instead of a fork and exec
+ *     per request.
  */
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "csapp.h"
+#include "sbuf.h"
+#include "filecache.h"
+#include "cgipool.h"
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+#define SBUFSIZE 256       /* Connections waiting for a worker */
+#define IDLE_TIMEOUT 5     /* Seconds a persistent connection may stay idle */
+#define MAXRANGES 16       /* More ranges than this and the whole file is sent */
+#define BOUNDARY "TINY_BYTERANGES_3d6f1a" /* Separates multipart/byteranges parts */
+
+/* Bytes first..last of a file, both included */
+typedef struct {
+    off_t first, last;
+} range_t;
+
+void serve_conn(int fd);
+void *thread(void *vargp);
+int doit(int fd, rio_t *rp);
+int read_requesthdrs(rio_t *rp, int keep_alive, char *range);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+int serve_static(int fd, char *filename, off_t filesize, int keep_alive,
+		 char *range, int head);
+int static_headers(char *buf, size_t size, char *filetype, off_t filesize, int keep_alive);
+int answer_static(int fd, char *hdr, size_t hdrlen, int srcfd, off_t filesize,
+		  char *filetype, char *range, int head, int keep_alive);
+int send_static(int fd, char *hdr, size_t hdrlen, int srcfd, off_t filesize);
+int parse_ranges(char *spec, off_t filesize, range_t *ranges);
+int send_ranges(int fd, range_t *ranges, int n, int srcfd, off_t filesize,
+		char *filetype, int keep_alive);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
+void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg);
+int writev_all(int fd, struct iovec *iov, int cnt);
+int send_file(int fd, int srcfd, off_t offset, size_t count);
 
-int main(int argc, char **argv) 
+int nthreads = 0;          /* Worker threads; 0: iterative */
+int verbose = 1;           /* Log requests to stdout */
+int use_mmap = 0;          /* Send static bodies from a mapping, not with sendfile */
+sbuf_t sbuf;               /* Connected descriptors waiting for a worker */
+
+int main(int argc, char **argv)
 {
-    int listenfd, connfd;
+    int listenfd, connfd, i, c, sbufsize = SBUFSIZE;
+    int cache_entries = FILECACHE_ENTRIES, recheck = FILECACHE_RECHECK;
+    int cgi_workers = 0;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((c = getopt(argc, argv, "t:q:mc:r:w:v")) != -1) {
+	switch (c) {
+	case 't': /* Serve connections with a pool of this many threads */
+	    nthreads = atoi(optarg);
+	    break;
+	case 'q': /* Connections that may wait for a thread */
+	    sbufsize = atoi(optarg);
+	    break;
+	case 'm': /* Mmap and write static bodies, as in the book */
+	    use_mmap = 1;
+	    break;
+	case 'c': /* Static files kept open, 0: none */
+	    cache_entries = atoi(optarg);
+	    break;
+	case 'r': /* Seconds before a cached file is checked for changes */
+	    recheck = atoi(optarg);
+	    break;
+	case 'w': /* Persistent workers per CGI program, 0: fork per request */
+	    cgi_workers = atoi(optarg);
+	    break;
+	case 'v': /* Log requests even with a pool */
+	    verbose = 2;
+	    break;
+	default:
+	    optind = argc;
+	}
+    }
+    if (optind != argc - 1 || nthreads < 0 || sbufsize <= 0 || cache_entries < 0 || recheck < 0 || cgi_workers < 0) {
+	fprintf(stderr, "usage: %s [-t nthreads] [-q queue] [-m] [-c cached files] [-r recheck secs] [-w cgi workers] [-v] <port>\n", argv[0]);
 	exit(1);
     }
+    /* A client that goes away must not take the server down */
+    Signal(SIGPIPE, SIG_IGN);
+    filecache_init(cache_entries, recheck, get_filetype, static_headers);
+    cgipool_init(cgi_workers);
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[optind]);
+    if (nthreads > 0) {
+	/* Logging every request would serialize the workers */
+	verbose = verbose > 1;
+	sbuf_init(&sbuf, sbufsize);
+	for (i = 0; i < nthreads; i++)
+	    Pthread_create(&tid, NULL, thread, NULL);
+    }
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
-	Close(connfd);                                            //line:netp:tiny:close
+	if (verbose) {
+	    Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE,
+			port, MAXLINE, 0);
+	    printf("Accepted connection from (%s, %s)\n", hostname, port);
+	}
+	if (nthreads > 0)
+	    sbuf_insert(&sbuf, connfd); /* Blocks while the queue is full */
+	else
+	    serve_conn(connfd);
     }
 }
 /* $end tinymain */
 
+/*
+ * serve_conn - answer requests on a connection until it is to be closed
+ */
+void serve_conn(int fd)
+{
+    rio_t rio;
+    struct timeval idle = {IDLE_TIMEOUT, 0};
+
+    /* An idle persistent connection must not hold a worker forever */
+    if (nthreads > 0)
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    Rio_readinitb(&rio, fd);
+    while (doit(fd, &rio))                                   //line:netp:tiny:doit
+	;
+    Close(fd);                                               //line:netp:tiny:close
+}
+
+/*
+ * thread - worker thread: serve connections from the queue forever
+ */
+void *thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1)
+	serve_conn(sbuf_remove(&sbuf));
+    return NULL;
+}
+
 /*
  * doit - handle one HTTP request/response transaction
+ *     returns whether the connection stays open for the next one
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rp)
 {
-    int is_static;
+    int is_static, is_head, keep_alive, rc;
     struct stat sbuf;
+    FileEntry *hot;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    char filename[MAXLINE], cgiargs[MAXLINE], range[MAXLINE];
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
-    if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Tiny does not implement this method");
-        return;
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)            //line:netp:doit:readrequest
+	return 0;
+    if (verbose)
+	printf("%s", buf);
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) { //line:netp:doit:parserequest
+	clienterror(fd, buf, "400", "Bad Request",
+		    "Tiny couldn't parse the request");
+	return 0;
+    }
+    is_head = !strcasecmp(method, "HEAD");
+    if (strcasecmp(method, "GET") && !is_head) {         //line:netp:doit:beginrequesterr
+	clienterror(fd, method, "501", "Not Implemented",
+		    "Tiny does not implement this method");
+	return 0;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    /* HTTP/1.1 connections persist unless closed, HTTP/1.0 ones if asked to */
+    keep_alive = read_requesthdrs(rp, !strcasecmp(version, "HTTP/1.1"), range); //line:netp:doit:readrequesthdrs
+    if (keep_alive < 0)
+	return 0;
+    /* A HEAD answers as a GET of the whole file would */
+    if (is_head)
+	range[0] = '\0';
+    /* The iterative server must get to the next client */
+    if (nthreads == 0)
+	keep_alive = 0;
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
+    if (is_static && (hot = filecache_get(filename)) != NULL) {
+	/* A hot file: open, with its headers ready */
+	rc = answer_static(fd, hot->hdr[keep_alive], hot->hdr_len[keep_alive],
+			   hot->fd, hot->size, hot->filetype, range, is_head,
+			   keep_alive);
+	filecache_release(hot);
+	return rc < 0 ? 0 : keep_alive;
+    }
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
 	clienterror(fd, filename, "404", "Not found",
 		    "Tiny couldn't find this file");
-	return;
+	return 0;
     }                                                    //line:netp:doit:endnotfound
 
-    if (is_static) { /* Serve static content */          
+    if (is_static) { /* Serve static content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't read the file");
-	    return;
+	    return 0;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	if (serve_static(fd, filename, sbuf.st_size, keep_alive, range, is_head) < 0) //line:netp:doit:servestatic
+	    return 0;
+	return keep_alive;
     }
     else { /* Serve dynamic content */
+	if (is_head) {
+	    clienterror(fd, method, "501", "Not Implemented",
+			"Tiny does not implement HEAD for CGI programs");
+	    return 0;
+	}
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
 	    clienterror(fd, filename, "403", "Forbidden",
 			"Tiny couldn't run the CGI program");
-	    return;
+	    return 0;
 	}
+	/* The CGI program ends its response by exiting */
 	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
+	return 0;
     }
 }
 /* $end doit */
 
 /*
  * read_requesthdrs - read HTTP request headers
+ *     returns whether the client wants the connection kept open
+ *     (keep_alive unless a Connection header says otherwise), or -1
+ *     if the headers did not arrive. The value of a Range header goes
+ *     to range ("" if none, or if it comes with an If-Range: Tiny
+ *     sends no validators, so it cannot tell whether they match)
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp, int keep_alive, char *range)
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *p;
+    int if_range = 0;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
-    }
-    return;
+    range[0] = '\0';
+    do {
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
+	if (verbose)
+	    printf("%s", buf);
+	if (!strncasecmp(buf, "Connection:", 11)) {
+	    for (p = buf + 11; *p == ' ' || *p == '\t'; p++)
+		;
+	    if (!strncasecmp(p, "close", 5))
+		keep_alive = 0;
+	    else if (!strncasecmp(p, "keep-alive", 10))
+		keep_alive = 1;
+	}
+	else if (!strncasecmp(buf, "Range:", 6)) {
+	    for (p = buf + 6; *p == ' ' || *p == '\t'; p++)
+		;
+	    strcpy(range, p);
+	}
+	else if (!strncasecmp(buf, "If-Range:", 9))
+	    if_range = 1;
+    } while (strcmp(buf, "\r\n"));                      //line:netp:readhdrs:checkterm
+    if (if_range)
+	range[0] = '\0';
+    return keep_alive;
 }
 /* $end read_requesthdrs */
 
@@ -115,7 +297,7 @@ void read_requesthdrs(rio_t *rp)
  *             return 0 if dynamic content, 1 if static
  */
 /* $begin parse_uri */
-int parse_uri(char *uri, char *filename, char *cgiargs) 
+int parse_uri(char *uri, char *filename, char *cgiargs)
 {
     char *ptr;
 
@@ -133,7 +315,7 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 	    strcpy(cgiargs, ptr+1);
 	    *ptr = '\0';
 	}
-	else 
+	else
 	    strcpy(cgiargs, "");                         //line:netp:parseuri:endextract
 	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert2
 	strcat(filename, uri);                           //line:netp:parseuri:endconvert2
@@ -143,37 +325,235 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client
+ *     (files the cache does not hold); returns -1 if the client went away
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+int serve_static(int fd, char *filename, off_t filesize, int keep_alive,
+		 char *range, int head)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
- 
-    /* Send response headers to client */
+    int srcfd, rc, len;
+    char filetype[MAXLINE], buf[MAXBUF];
+
+    /* Build response headers */
     get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
-    printf("Response headers:\n");
-    printf("%s", buf);
-
-    /* Send response body to client */
+    len = static_headers(buf, MAXBUF, filetype, filesize, keep_alive); //line:netp:servestatic:beginserve
+
+    /* Send response headers and body to client */
     srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
+    rc = answer_static(fd, buf, len, srcfd, filesize, filetype, range, head,
+		       keep_alive);
     Close(srcfd);                           //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
+    return rc;
+}
+
+/*
+ * static_headers - the response headers of a static file, into buf
+ */
+int static_headers(char *buf, size_t size, char *filetype, off_t filesize, int keep_alive)
+{
+    return snprintf(buf, size,
+	"HTTP/1.1 200 OK\r\n"
+	"Server: Tiny Web Server\r\n"
+	"Connection: %s\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Content-length: %lld\r\n"
+	"Content-type: %s\r\n\r\n",
+	keep_alive ? "keep-alive" : "close", (long long)filesize, filetype);
+}
+
+/*
+ * answer_static - answer a request for a static file open as srcfd,
+ *     whose full response headers are hdr: with hdr alone for HEAD,
+ *     with the ranges asked for if range holds any that fit, with a
+ *     416 if none does, else with the whole file; returns -1 if the
+ *     client went away
+ */
+int answer_static(int fd, char *hdr, size_t hdrlen, int srcfd, off_t filesize,
+		  char *filetype, char *range, int head, int keep_alive)
+{
+    range_t ranges[MAXRANGES];
+    int n;
+
+    if (range[0] && (n = parse_ranges(range, filesize, ranges)) >= 0)
+	return send_ranges(fd, ranges, n, srcfd, filesize, filetype, keep_alive);
+    if (verbose)
+	printf("Response headers:\n%s", hdr);
+    if (head)
+	return rio_writen(fd, hdr, hdrlen) < 0 ? -1 : 0;
+    return send_static(fd, hdr, hdrlen, srcfd, filesize);
+}
+
+/*
+ * send_static - send headers, then the body from srcfd: with sendfile,
+ *     or with -m in one gather write from a mapping; returns -1 if the
+ *     client went away
+ */
+int send_static(int fd, char *hdr, size_t hdrlen, int srcfd, off_t filesize)
+{
+    char *srcp;
+    int rc;
+    struct iovec iov[2];
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hdrlen;
+    if (filesize == 0)
+	return writev_all(fd, iov, 1);
+    if (!use_mmap) {
+	/* The headers wait for the first body bytes to fill a segment */
+	if (send(fd, hdr, hdrlen, MSG_MORE) != hdrlen)
+	    return -1;
+	return send_file(fd, srcfd, 0, filesize);
+    }
+    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
+    iov[1].iov_base = srcp;
+    iov[1].iov_len = filesize;
+    rc = writev_all(fd, iov, 2);            //line:netp:servestatic:write
     Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    return rc;
+}
+
+/*
+ * parse_ranges - the ranges of a "bytes=first-last,first-,-suffix"
+ *     Range value that fit in a file of filesize bytes, into ranges,
+ *     clamped to the file; returns how many, or -1 if the value is not
+ *     one Tiny honors (bad syntax, another unit, too many ranges) and
+ *     the whole file is to be sent
+ */
+int parse_ranges(char *spec, off_t filesize, range_t *ranges)
+{
+    char *p = spec + 6, *end;
+    long long first, last;
+    int n = 0, seen = 0;
+
+    if (strncasecmp(spec, "bytes=", 6))
+	return -1;
+    while (1) {
+	while (*p == ' ' || *p == '\t')
+	    p++;
+	if (*p == '-') { /* The last bytes of the file */
+	    if (!isdigit((unsigned char)p[1]))
+		return -1;
+	    last = strtoll(p + 1, &end, 10);
+	    first = last < filesize ? filesize - last : 0;
+	    last = last > 0 ? filesize - 1 : -1;
+	}
+	else if (isdigit((unsigned char)*p)) {
+	    first = strtoll(p, &end, 10);
+	    if (*end++ != '-')
+		return -1;
+	    if (isdigit((unsigned char)*end)) {
+		last = strtoll(end, &end, 10);
+		if (last < first)
+		    return -1;
+	    }
+	    else
+		last = filesize - 1;
+	    if (last > filesize - 1)
+		last = filesize - 1;
+	}
+	else
+	    return -1;
+	if (++seen > MAXRANGES)
+	    return -1;
+	if (first <= last) { /* Fits in the file */
+	    ranges[n].first = first;
+	    ranges[n].last = last;
+	    n++;
+	}
+	for (p = end; *p == ' ' || *p == '\t'; p++)
+	    ;
+	if (*p == ',')
+	    p++;
+	else if (*p == '\0' || *p == '\r' || *p == '\n')
+	    return n;
+	else
+	    return -1;
+    }
+}
+
+/*
+ * send_ranges - answer with the n ranges of srcfd: a 416 if there are
+ *     none, a 206 with Content-Range for one, a multipart/byteranges
+ *     206 for several; bodies go with sendfile from their offsets.
+ *     Returns -1 if the client went away.
+ */
+int send_ranges(int fd, range_t *ranges, int n, int srcfd, off_t filesize,
+		char *filetype, int keep_alive)
+{
+    char hdr[MAXLINE], part[MAXRANGES][MAXLINE];
+    int hdrlen, partlen[MAXRANGES], i;
+    long long length;
+    char *conn = keep_alive ? "keep-alive" : "close";
+    static char *last_boundary = "\r\n--" BOUNDARY "--\r\n";
+
+    if (n == 0) {
+	hdrlen = snprintf(hdr, MAXLINE,
+	    "HTTP/1.1 416 Range Not Satisfiable\r\n"
+	    "Server: Tiny Web Server\r\n"
+	    "Connection: %s\r\n"
+	    "Content-Range: bytes */%lld\r\n"
+	    "Content-length: 0\r\n\r\n",
+	    conn, (long long)filesize);
+	if (verbose)
+	    printf("Response headers:\n%s", hdr);
+	return rio_writen(fd, hdr, hdrlen) < 0 ? -1 : 0;
+    }
+    if (n == 1) {
+	hdrlen = snprintf(hdr, MAXLINE,
+	    "HTTP/1.1 206 Partial Content\r\n"
+	    "Server: Tiny Web Server\r\n"
+	    "Connection: %s\r\n"
+	    "Content-Range: bytes %lld-%lld/%lld\r\n"
+	    "Content-length: %lld\r\n"
+	    "Content-type: %s\r\n\r\n",
+	    conn, (long long)ranges[0].first, (long long)ranges[0].last,
+	    (long long)filesize,
+	    (long long)(ranges[0].last - ranges[0].first + 1), filetype);
+	if (verbose)
+	    printf("Response headers:\n%s", hdr);
+	if (send(fd, hdr, hdrlen, MSG_MORE) != hdrlen)
+	    return -1;
+	return send_file(fd, srcfd, ranges[0].first,
+			 ranges[0].last - ranges[0].first + 1);
+    }
+
+    /* Several: each part has its own headers; the length is known ahead */
+    length = strlen(last_boundary);
+    for (i = 0; i < n; i++) {
+	partlen[i] = snprintf(part[i], MAXLINE,
+	    "\r\n--" BOUNDARY "\r\n"
+	    "Content-type: %s\r\n"
+	    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+	    filetype, (long long)ranges[i].first, (long long)ranges[i].last,
+	    (long long)filesize);
+	length += partlen[i] + ranges[i].last - ranges[i].first + 1;
+    }
+    hdrlen = snprintf(hdr, MAXLINE,
+	"HTTP/1.1 206 Partial Content\r\n"
+	"Server: Tiny Web Server\r\n"
+	"Connection: %s\r\n"
+	"Content-length: %lld\r\n"
+	"Content-type: multipart/byteranges; boundary=" BOUNDARY "\r\n\r\n",
+	conn, length);
+    if (verbose)
+	printf("Response headers:\n%s", hdr);
+    if (send(fd, hdr, hdrlen, MSG_MORE) != hdrlen)
+	return -1;
+    for (i = 0; i < n; i++) {
+	if (send(fd, part[i], partlen[i], MSG_MORE) != partlen[i])
+	    return -1;
+	if (send_file(fd, srcfd, ranges[i].first,
+		      ranges[i].last - ranges[i].first + 1) < 0)
+	    return -1;
+    }
+    return rio_writen(fd, last_boundary, strlen(last_boundary)) < 0 ? -1 : 0;
 }
 
 /*
  * get_filetype - derive file type from file name
  */
-void get_filetype(char *filename, char *filetype) 
+void get_filetype(char *filename, char *filetype)
 {
     if (strstr(filename, ".html"))
 	strcpy(filetype, "text/html");
@@ -185,30 +565,42 @@ void get_filetype(char *filename, char *filetype)
 	strcpy(filetype, "image/jpeg");
     else
 	strcpy(filetype, "text/plain");
-}  
+}
 /* $end serve_static */
 
 /*
  * serve_dynamic - run a CGI program on behalf of the client
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) 
+void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
     char buf[MAXLINE], *emptylist[] = { NULL };
+    pid_t pid;
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-  
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
+    snprintf(buf, MAXLINE, "HTTP/1.0 200 OK\r\n"
+	     "Server: Tiny Web Server\r\n");
+
+    /* A persistent worker answers, if the program runs as one */
+    switch (cgipool_serve(fd, filename, cgiargs, buf)) {
+    case CGI_DONE:
+	return;
+    case CGI_FAILED:
+	clienterror(fd, filename, "502", "Bad Gateway",
+		    "Tiny's CGI worker died");
+	return;
+    }
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return;
+
+    if ((pid = Fork()) == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    /* Parent waits for and reaps its child (not another thread's) */
+    Waitpid(pid, NULL, 0); //line:netp:servedynamic:wait
 }
 /* $end serve_dynamic */
 
@@ -216,25 +608,78 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
  * clienterror - returns an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
+void clienterror(int fd, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg)
 {
     char buf[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    iov[1].iov_base = body;
+    iov[1].iov_len = snprintf(body, MAXBUF,
+	"<html><title>Tiny Error</title>"
+	"<body bgcolor=""ffffff"">\r\n"
+	"%s: %s\r\n"
+	"<p>%s: %.512s\r\n"
+	"<hr><em>The Tiny Web server</em>\r\n",
+	errnum, shortmsg, longmsg, cause);
+
+    /* Print the HTTP response; the connection is closed after it */
+    iov[0].iov_base = buf;
+    iov[0].iov_len = snprintf(buf, MAXLINE,
+	"HTTP/1.1 %s %s\r\n"
+	"Connection: close\r\n"
+	"Content-type: text/html\r\n"
+	"Content-length: %d\r\n\r\n",
+	errnum, shortmsg, (int)iov[1].iov_len);
+    writev_all(fd, iov, 2);
 }
 /* $end clienterror */
+
+/*
+ * writev_all - write all bytes of iov[0..cnt-1], restarting after
+ *     short writes; returns 0, or -1 if the client went away
+ */
+int writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt > 0) {
+	if ((n = writev(fd, iov, cnt)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	/* Skip what went out */
+	while (cnt > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    cnt--;
+	}
+	if (cnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return 0;
+}
+
+/*
+ * send_file - send count bytes of srcfd from offset on to fd with
+ *     sendfile, without copying them through user space; returns 0,
+ *     or -1 if the client went away (or the file shrank)
+ */
+int send_file(int fd, int srcfd, off_t offset, size_t count)
+{
+    ssize_t n;
+
+    while (count > 0) {
+	if ((n = sendfile(fd, srcfd, &offset, count)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+	count -= n;
+    }
+    return 0;
+}
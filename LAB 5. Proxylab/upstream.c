@@ -0,0 +1,188 @@
+/*
+ * upstream.c - pool of idle keep-alive connections to origin servers
+ *
+ * After a response has been relayed completely and the origin agreed
+ * to keep the connection open, the connection goes back into the pool
+ * under its (host, port). The next miss for the same origin reuses it
+ * and skips the TCP handshake. New connections get the origin's address
+ * from the resolver cache (dns.c). A reaper thread closes
+ * connections that stay idle longer than the timeout.
+ *
+ * A fetch has deadlines, so a dead or slow origin cannot hold a worker
+ * forever: the connect is given upstream_timeouts.connect seconds, every
+ * read (SO_RCVTIMEO) upstream_timeouts.read, and the whole response
+ * upstream_timeouts.response from the moment the connection is handed
+ * out, which the relay checks with upstream_expired.
+ */
+#include "upstream.h"
+#include "hash.h"
+#include "dns.h"
+
+static struct{
+    pthread_mutex_t lock;
+    Upstream *buckets[UPSTREAM_BUCKETS];
+    int idle_timeout;           /* seconds; 0 disables pooling */
+} pool;
+
+UpstreamTimeouts upstream_timeouts = {
+    UPSTREAM_CONNECT_TIMEOUT, UPSTREAM_READ_TIMEOUT, UPSTREAM_RESPONSE_TIMEOUT
+};
+
+static int still_open(int fd);
+static void *reaper_thread(void *vargp);
+
+// initialize the pool; idle_timeout 0 turns pooling off
+void upstream_init(int idle_timeout){
+    pthread_t tid;
+    pthread_mutex_init(&pool.lock, NULL);
+    memset(pool.buckets, 0, sizeof(pool.buckets));
+    pool.idle_timeout = idle_timeout;
+    if(idle_timeout > 0){
+        Pthread_create(&tid, NULL, reaper_thread, NULL);
+    }
+}
+// set the deadlines of origin fetches, in seconds (0: none)
+void upstream_set_timeouts(int connect, int read, int response){
+    upstream_timeouts.connect = connect;
+    upstream_timeouts.read = read;
+    upstream_timeouts.response = response;
+}
+// monotonic clock in milliseconds, for deadlines
+long upstream_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+// is the response on this connection overdue?
+int upstream_expired(Upstream *up){
+    return up->deadline && upstream_now() >= up->deadline;
+}
+// are upstream connections kept alive?
+int upstream_pooling(){
+    return pool.idle_timeout > 0;
+}
+// take an idle connection to host:port, or open a new one (NULL on
+// failure, errno ETIMEDOUT if the connect ran out of time); the response
+// deadline starts now
+Upstream *upstream_get(char *host, char *port, int *reused){
+    unsigned int h = hash_origin(host, port);
+    struct timeval tv = {upstream_timeouts.read, 0};
+    Upstream **pp, *up = NULL;
+    long deadline = 0;
+    int fd;
+
+    if(upstream_timeouts.response > 0){
+        deadline = upstream_now() + upstream_timeouts.response * 1000L;
+    }
+    *reused = 0;
+    pthread_mutex_lock(&pool.lock);
+    pp = &pool.buckets[h & (UPSTREAM_BUCKETS - 1)];
+    while(*pp != NULL){
+        if((*pp)->hash == h && !strcmp((*pp)->host, host) && !strcmp((*pp)->port, port)){
+            up = *pp;
+            *pp = up->next;
+            break;
+        }
+        pp = &(*pp)->next;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if(up != NULL){
+        // the origin may have closed it while it was idle
+        if(still_open(up->fd)){
+            *reused = 1;
+            up->deadline = deadline;
+            return up;
+        }
+        upstream_close(up);
+    }
+
+    if((fd = dns_connect(host, port, upstream_timeouts.connect * 1000)) < 0){
+        return NULL;
+    }
+    // a silent origin makes reads (and writes) fail with EAGAIN
+    if(upstream_timeouts.read > 0){
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    up = Malloc(sizeof(Upstream));
+    up->fd = fd;
+    up->deadline = deadline;
+    rio_readinitb(&up->rio, fd);
+    snprintf(up->host, sizeof(up->host), "%s", host);
+    snprintf(up->port, sizeof(up->port), "%s", port);
+    up->hash = h;
+    up->next = NULL;
+    return up;
+}
+// give a connection whose response was read completely back to the pool
+void upstream_put(Upstream *up){
+    Upstream **pp;
+    int n = 0;
+    if(!upstream_pooling() || up->rio.rio_cnt > 0){
+        upstream_close(up);
+        return;
+    }
+    up->idle_since = time(NULL);
+    pthread_mutex_lock(&pool.lock);
+    pp = &pool.buckets[up->hash & (UPSTREAM_BUCKETS - 1)];
+    for(; *pp != NULL; pp = &(*pp)->next){
+        if((*pp)->hash == up->hash && !strcmp((*pp)->host, up->host)
+            && !strcmp((*pp)->port, up->port) && ++n >= UPSTREAM_MAX_IDLE){
+            break;
+        }
+    }
+    if(n < UPSTREAM_MAX_IDLE){
+        up->next = pool.buckets[up->hash & (UPSTREAM_BUCKETS - 1)];
+        pool.buckets[up->hash & (UPSTREAM_BUCKETS - 1)] = up;
+        up = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    // enough idle connections to this origin already
+    if(up != NULL){
+        upstream_close(up);
+    }
+}
+// close a connection for good
+void upstream_close(Upstream *up){
+    close(up->fd);
+    free(up);
+}
+
+// an idle connection must have nothing to read: no EOF, no stray bytes
+static int still_open(int fd){
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+// close connections idle for longer than the timeout
+static void *reaper_thread(void *vargp){
+    Upstream **pp, *up, *expired;
+    time_t now;
+    int i;
+    Pthread_detach(pthread_self());
+    while(1){
+        sleep(1);
+        now = time(NULL);
+        expired = NULL;
+        pthread_mutex_lock(&pool.lock);
+        for(i = 0; i < UPSTREAM_BUCKETS; i++){
+            pp = &pool.buckets[i];
+            while((up = *pp) != NULL){
+                if(now - up->idle_since >= pool.idle_timeout){
+                    *pp = up->next;
+                    up->next = expired;
+                    expired = up;
+                }else{
+                    pp = &up->next;
+                }
+            }
+        }
+        pthread_mutex_unlock(&pool.lock);
+        // close outside the lock
+        while((up = expired) != NULL){
+            expired = up->next;
+            upstream_close(up);
+        }
+    }
+    return NULL;
+}
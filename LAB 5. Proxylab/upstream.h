@@ -0,0 +1,50 @@
+/*
+ * upstream.h - pool of idle keep-alive connections to origin servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* Number of hash buckets of the pool (power of two) */
+#define UPSTREAM_BUCKETS 256
+/* Idle connections kept per (host, port) */
+#define UPSTREAM_MAX_IDLE 8
+/* Default idle timeout in seconds */
+#define UPSTREAM_IDLE_TIMEOUT 30
+/* Default deadlines in seconds: connect, between two reads, whole response */
+#define UPSTREAM_CONNECT_TIMEOUT 5
+#define UPSTREAM_READ_TIMEOUT 15
+#define UPSTREAM_RESPONSE_TIMEOUT 60
+
+/* Deadlines of an origin fetch in seconds; 0 waits forever */
+typedef struct{
+    int connect;
+    int read;
+    int response;
+} UpstreamTimeouts;
+
+extern UpstreamTimeouts upstream_timeouts;
+
+/* A connection to an origin, with the read buffer that goes with it */
+typedef struct Upstream{
+    int fd;
+    rio_t rio;
+    char host[200];
+    char port[10];
+    unsigned int hash;
+    time_t idle_since;
+    long deadline;              /* upstream_now() the response must be in by; 0: none */
+    struct Upstream *next;      /* next idle connection in the bucket */
+} Upstream;
+
+void upstream_init(int idle_timeout);
+void upstream_set_timeouts(int connect, int read, int response);
+long upstream_now();
+int upstream_expired(Upstream *up);
+int upstream_pooling();
+Upstream *upstream_get(char *host, char *port, int *reused);
+void upstream_put(Upstream *up);
+void upstream_close(Upstream *up);
+
+#endif /* __UPSTREAM_H__ */